@@ -38,6 +38,7 @@ typedef struct nfs_options {
 	int link_relative;
 	int noaccess;
 	int cross_mounts;
+	int sync_writes;
 	uid_t nobody_uid;
 	gid_t nobody_gid;
 	char *clnt_nisdomain;
@@ -85,10 +86,12 @@ extern int promiscuous;
 extern int re_export;
 extern int trace_spoof;
 extern struct exportnode *export_list;
-extern uid_t cred_uid;
-extern uid_t auth_uid;
-extern gid_t cred_gid;
-extern gid_t auth_gid;
+extern THREAD_LOCAL uid_t cred_uid;
+extern THREAD_LOCAL uid_t auth_uid;
+extern THREAD_LOCAL gid_t cred_gid;
+extern THREAD_LOCAL gid_t auth_gid;
+extern THREAD_LOCAL GETGROUPS_T auth_gids[];
+extern THREAD_LOCAL int auth_gidlen;
 extern char *public_root_path;
 extern struct nfs_fh public_root;
 
@@ -98,8 +101,8 @@ extern struct nfs_fh public_root;
  * etc. pp.
  */
 
-extern struct nfs_client *nfsclient;
-extern struct nfs_mount *nfsmount;
+extern THREAD_LOCAL struct nfs_client *nfsclient;
+extern THREAD_LOCAL struct nfs_mount *nfsmount;
 
 /*
  * Global Function prototypes.
@@ -132,6 +135,7 @@ extern void auth_log_all(void);
  */
 
 extern void auth_override_uid(uid_t);
+extern unsigned int auth_gids_hash(void);
 
 /*
  * Prototypes for ugidd mapping
@@ -28,6 +28,48 @@
 #define	FHC_XONLY_PATH		001	/* NOT USED ANYMORE */
 #define	FHC_ATTRVALID		002
 #define FHC_NFSMOUNTED		004
+#define FHC_SHAREDFD		010	/* fd was opened for all users */
+#define FHC_NOSHARE		020	/* has an ACL, don't share the fd */
+
+/*
+ * Permission checks for shared fds, cached per file for a few users
+ * (uid, and a hash of their groups) while the owner, group and mode
+ * of the file stay the same, and those of the directories above it as
+ * far as we know (see fh_perm_forget).
+ */
+#define FH_PERM_SLOTS		4
+#define FH_PERM_READ		1
+#define FH_PERM_WRITE		2
+
+typedef struct fh_perm {
+	uid_t		uid;
+	unsigned int	gids;
+	unsigned char	mode;		/* FH_PERM_*, 0 if unused */
+	unsigned char	allowed;
+} fh_perm;
+
+/*
+ * Names LOOKUP found missing in a directory, cached while its mtime
+ * and ctime stay the same, in a hash table that grows up to
+ * FH_NEG_MAX names. Once a directory has that many, or all of them
+ * have FH_NEG_LIMIT, its table starts over.
+ */
+#define FH_NEG_MIN		16	/* slots in a new table */
+#define FH_NEG_MAX		1024
+#define FH_NEG_LIMIT		65536
+
+typedef struct fh_negname {
+	unsigned int	hash;
+	char *		name;		/* NULL if the slot is free */
+} fh_negname;
+
+typedef struct fh_negative {
+	time_t		mtime;		/* of the directory */
+	time_t		ctime;
+	unsigned int	count;
+	unsigned int	size;		/* a power of two */
+	fh_negname *	slots;
+} fh_negative;
 
 /*
  * Modes for fh_find
@@ -39,25 +81,42 @@
 #define FHFIND_CHECK		0x10	/* Check for cached path */
 
 /*
- * This defines the maximum number of handles nfsd will cache.
+ * This defines the default maximum number of handles nfsd will cache
+ * (see fh_cache_limit).
  */
 
 #define	FH_CACHE_LIMIT		2048
 
 /*
- * This defines how far to cut back the cache when the cache limit
- * is exceeded; the cache is cut back to contain only the last
- * (FH_CACHE_LIMIT * FH_CACHE_FLUSH_RATIO) entries.
+ * The cache is managed like 2Q: new handles go through a FIFO (A1in)
+ * of FH_CACHE_IN_RATIO of the cache. Those used again after they fell
+ * out of it, as remembered for the last FH_CACHE_OUT_RATIO times the
+ * cache size handles (A1out), are kept in an LRU list (Am).
  */
 
-#define FH_CACHE_FLUSH_RATIO	0.5
+#define FH_CACHE_IN_RATIO	0.25
+#define FH_CACHE_OUT_RATIO	0.5
+
+/*
+ * Attributes kept in the fh cache are reused by the request that
+ * fetched them, and by later requests for this many milliseconds
+ * (see fh_attr_ttl).
+ */
+
+#define FH_ATTR_TTL		0
 
 /*
  * This defines the maximum number of files nfsd may keep open
- * for NFS I/O. It used to be 8...
+ * for NFS I/O. It used to be 8, then 3*FOPEN_MAX/4... Now it is half
+ * the limit on open files, leaving the rest for sockets, but no more
+ * than FD_CACHE_MEMORY allows, as each open file pins about
+ * FD_CACHE_COST bytes of kernel memory (see fd_cache_limit).
  */
 
-#define FD_CACHE_LIMIT		(3*FOPEN_MAX/4)
+#define FD_CACHE_MIN		12
+#define FD_CACHE_MEMORY		(16*1024*1024)
+#define FD_CACHE_COST		1024
+#define FD_CACHE_RESERVE	64	/* fds never used for the cache */
 
 /* The following affect cache expiry.
  * CLOSE_INTERVAL applies to the closing of inactive file descriptors
@@ -124,22 +183,64 @@ typedef enum {
  *		index(name, '/') == 0
  */
 
+/*
+ * The names of cached files, as a tree of path components shared by
+ * the handles below a directory. A dentry is found by its parent and
+ * name, so there is only one for each path; it holds a reference to
+ * its parent, and is freed along with the last handle below it.
+ * Renaming a directory moves its dentry, and with it the paths of
+ * the handles below.
+ */
+typedef struct fh_dentry {
+	struct fh_dentry *parent;	/* NULL for "/" */
+	struct fh_dentry *hnext;	/* in the hash chain */
+	unsigned int refs;
+	int hashed;			/* 0 once removed or replaced */
+	char *name;
+} fh_dentry;
+
 typedef struct fhcache {
 	struct fhcache *next;
 	struct fhcache *prev;
-	struct fhcache *hash_next;
+	int in_fifo;			/* in A1in rather than Am */
 	struct fhcache *fd_next;
 	struct fhcache *fd_prev;
 	svc_fh h;
 	int fd;
 	int omode;
-	char *path;
+	fh_dentry *dentry;		/* NULL until the file is created */
+	char *path;			/* use fhc_path */
+	unsigned long path_gen;		/* fh_dentry_gen it was built at */
 	time_t last_used;
 	nfs_client *last_clnt;
 	nfs_mount *last_mount;
 	uid_t last_uid;
 	int flags;
 	struct stat attrs;
+	unsigned long attr_req;		/* request that fetched attrs */
+	unsigned long attr_time;	/* when, in msec */
+	off_t ra_next;			/* offset of next sequential READ */
+	off_t ra_end;			/* end of the data read ahead */
+	unsigned int ra_size;	/* read-ahead window, 0 if random */
+	fh_perm perms[FH_PERM_SLOTS];
+	unsigned int perm_next;		/* slot to replace */
+	mode_t perm_mode;		/* attributes the checks are for */
+	uid_t perm_uid;
+	gid_t perm_gid;
+	unsigned long perm_gen;		/* fh_perm_gen of the checks */
+	fh_negative *negative;		/* if a directory with missing names */
+	/* Transfers since the fd was opened, for the transfer log */
+	struct timeval xfer_first;	/* 0 if none */
+	struct timeval xfer_last;
+	unsigned long long xfer_read;
+	unsigned long long xfer_written;
+	unsigned int xfer_reads;
+	unsigned int xfer_writes;
+	struct in_addr xfer_addr;
+	uid_t xfer_uid;
+#ifdef ENABLE_MULTIPLE_SERVERS
+	unsigned int share_gen;		/* see fh_share_init */
+#endif
 } fhcache;
 
 /*
@@ -147,6 +248,10 @@ typedef struct fhcache {
  */
 
 extern int _rpcpmstart;
+extern int fh_cache_limit;
+extern int fd_cache_limit;
+extern int fh_attr_ttl;
+extern THREAD_LOCAL unsigned int fh_attr_hits;
 
 /*
  * Global function prototypes.
@@ -160,6 +265,13 @@ extern void fh_init(void);
 extern char *fh_pr(nfs_fh * fh);
 extern int fh_create(nfs_fh * fh, char *path);
 extern fhcache *fh_find(svc_fh * h, int create);
+extern void fh_attr_begin(void);
+extern struct stat *fhc_stat(fhcache * fhc);
+extern void fh_perm_forget(void);
+extern char *fhc_path(fhcache * fhc);
+extern int fh_negative_find(fhcache * dirh, const char *name);
+extern void fh_negative_add(fhcache * dirh, const char *name);
+extern void fh_negative_forget(fhcache * dirh);
 extern char *fh_path(nfs_fh * fh, nfsstat * status);
 extern int fh_path_open(char *path, int omode, int perm);
 extern int fh_fd(fhcache * fhc, nfsstat * status, int omode);
@@ -168,9 +280,26 @@ extern nfsstat fh_compose(diropargs * dopa, nfs_fh * new_fh,
 			  struct stat *sbp, int fd, int omode, int public);
 extern psi_t fh_psi(nfs_fh * fh);
 extern void fh_remove(char *path);
+extern void fh_rename(char *from, char *to);
 extern nfs_fh *fh_handle(fhcache * fhc);
 extern int fh_need_flush(void);
 extern void fh_flush(int force);
 extern RETSIGTYPE fh_flush_cache(int sig);
+extern void fh_xferlog_all(void);
+#ifdef ENABLE_FH_INDEX
+extern void fh_index_rename(diropargs * to, char *path);
+#else
+#define fh_index_rename(to, path)	do { } while (0)
+#endif
+#ifdef ENABLE_MULTIPLE_SERVERS
+extern int fh_share_init(void);
+extern int fh_lock(nfs_fh * fh);
+extern void fh_unlock(nfs_fh * fh);
+extern int fh_lock_threads(void);
+#else
+#define fh_lock(fh)		0
+#define fh_lock_threads()	1
+#define fh_unlock(fh)		do { } while (0)
+#endif
 
 #endif /* UNFSD_FHANDLE_H_INCLUDED */
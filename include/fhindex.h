@@ -0,0 +1,27 @@
+/*
+ * fhindex.h
+ *
+ * Persistent index of file handle paths.
+ */
+
+#ifndef UNFSD_FHINDEX_H_INCLUDED
+#define UNFSD_FHINDEX_H_INCLUDED
+
+#ifdef ENABLE_FH_INDEX
+
+#ifndef PATH_FHINDEX
+#define PATH_FHINDEX	"/var/state/nfs/fhindex"
+#endif /* PATH_FHINDEX */
+
+#define FHI_NAMELEN	54	/* longest file name that is indexed */
+
+extern int	fhindex_open(const char *path);
+extern int	fhindex_create(const char *path);
+extern int	fhindex_commit(void);
+extern int	fhindex_lookup(__u32 psi, __u32 *parent, char *name);
+extern void	fhindex_add(__u32 psi, __u32 parent, const char *name);
+extern void	fhindex_remove(__u32 psi);
+
+#endif /* ENABLE_FH_INDEX */
+
+#endif /* UNFSD_FHINDEX_H_INCLUDED */
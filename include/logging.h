@@ -48,6 +48,9 @@ extern void log_enable(char *kind);
 extern int  log_level_enabled(int level);
 extern void log_toggle(int sig);
 extern void log_set_background(void);
+extern void log_async_start(void);
+extern void log_flush(void);
+extern void log_idle(void);
 extern void log_call(const char *file, int line, struct svc_req *rqstp, char *name, char *arg);
 extern void dbg_printf(const char *file, int line, int level, const char *fmt, ...);
 
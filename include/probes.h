@@ -0,0 +1,26 @@
+/*
+ * probes.h
+ *
+ * Static probes for tracing tools such as bpftrace and perf. Each is a
+ * nop until a tool attaches to it; without <sys/sdt.h> they vanish.
+ */
+
+#ifndef UNFSD_PROBES_H_INCLUDED
+#define UNFSD_PROBES_H_INCLUDED
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)			DTRACE_PROBE1(nfsserver, name, a)
+#define PROBE2(name, a, b)		DTRACE_PROBE2(nfsserver, name, a, b)
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3(nfsserver, name, a, b, c)
+#define PROBE4(name, a, b, c, d)	DTRACE_PROBE4(nfsserver, name, a, b, c, d)
+#else
+/* Never evaluated, but keeps variables only probes use referenced */
+#define PROBE1(name, a)			do { if (0) { (void) (a); } } while (0)
+#define PROBE2(name, a, b)		PROBE1(name, ((void) (a), (b)))
+#define PROBE3(name, a, b, c)		PROBE2(name, a, ((void) (b), (c)))
+#define PROBE4(name, a, b, c, d)	PROBE3(name, a, b, ((void) (c), (d)))
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* UNFSD_PROBES_H_INCLUDED */
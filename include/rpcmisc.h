@@ -5,6 +5,21 @@
 #ifndef UNFSD_RPCMISC_H_INCLUDED
 #define UNFSD_RPCMISC_H_INCLUDED
 
+/*
+ * Reply context of a UDP call saved for a later reply.
+ */
+
+typedef struct rpc_defer {
+	int			rd_sock;
+	u_int			rd_iosz;
+	struct sockaddr_in	rd_addr;
+	socklen_t		rd_addrlen;
+	__u32			rd_xid;
+	int			rd_verf_flavor;
+	u_int			rd_verf_length;
+	char			rd_verfbody[MAX_AUTH_BYTES];
+} rpc_defer;
+
 /*
  * Global variables.
  */
@@ -12,6 +27,9 @@
 extern int _rpcpmstart;
 extern int _rpcfdtype;
 extern int _rpcsvcdirty;
+extern int _rpcsvcthreaded;
+extern int _rpcreuseport;
+extern void (*_rpcsignalled)(void);
 extern const char *auth_daemon;
 
 /*
@@ -22,6 +40,25 @@ extern void rpc_init(const char *name, unsigned long prog, unsigned long *verstb
 		     void (*dispatch) (), in_port_t defport, int bufsize);
 extern void rpc_exit(unsigned long prog, unsigned long *verstbl);
 extern void rpc_closedown(void);
+extern void rpc_run(void);
+extern void rpc_watch(int sock);
+extern void rpc_ownsocks(void);
+extern void rpc_closesocks(void);
+extern SVCXPRT *svcdgram_create(int sock, u_int iosz);
+extern bool_t svcdgram_defer(SVCXPRT *xprt, rpc_defer *rd);
+extern bool_t svcdgram_xid(SVCXPRT *xprt, __u32 *xidp);
+extern bool_t svcdgram_sendreply(rpc_defer *rd, xdrproc_t xdr_results,
+				 caddr_t results);
+extern bool_t svcdgram_senddata(rpc_defer *rd, xdrproc_t xdr_results,
+				caddr_t results, char *buf, u_int len);
+extern void svcdgram_stats(FILE *fp);
+extern SVCXPRT *svcstream_create(int sock);
+extern void svcstream_destroy(SVCXPRT *xprt);
+extern bool_t svcstream_check(SVCXPRT *xprt);
+extern bool_t svcstream_xid(SVCXPRT *xprt, __u32 *xidp);
+extern bool_t svcstream_sendreply(SVCXPRT *xprt, xdrproc_t xdr_results,
+				  caddr_t results, char *buf, int pipefd,
+				  u_int len);
 
 /*
  * Should be delcared in xdr.h, but sometimes isn't.
@@ -0,0 +1,76 @@
+/*
+ * stats.h
+ *
+ * Cache statistics, published by each server process in a file
+ * mapped into memory, so they can be read while the server runs.
+ */
+
+#ifndef UNFSD_STATS_H_INCLUDED
+#define UNFSD_STATS_H_INCLUDED
+
+#ifndef PATH_STATSDIR
+#define PATH_STATSDIR	"/var/run"
+#endif /* PATH_STATSDIR */
+
+#define STATS_MAGIC	0x4e465353	/* NFSS */
+#define STATS_VERSION	8
+#define STATS_SUFFIX	".stats"
+
+/*
+ * The counters, as STAT(name, is_gauge, description). Gauges hold a
+ * current size, all the others only ever go up.
+ */
+#define STATS_LIST \
+	STAT(fh_entries,     1, "file handles cached") \
+	STAT(fh_hits,        0, "fh cache hits") \
+	STAT(fh_misses,      0, "fh cache misses") \
+	STAT(fh_evictions,   0, "handles evicted to make room") \
+	STAT(fh_ghost_hits,  0, "handles used again after eviction") \
+	STAT(fh_buildpath,   0, "paths rebuilt from hash path") \
+	STAT(fh_dirscans,    0, "directories scanned for a path") \
+	STAT(fd_entries,     1, "fds cached") \
+	STAT(fd_limit,       1, "fds that may be cached") \
+	STAT(fd_opens,       0, "fd cache opens") \
+	STAT(fd_evictions,   0, "fds evicted to make room") \
+	STAT(fd_mismatch,    0, "fds closed on uid/omode mismatch") \
+	STAT(fd_shared,      0, "reopens avoided by sharing fds") \
+	STAT(perm_hits,      0, "permission cache hits") \
+	STAT(perm_misses,    0, "permission cache misses") \
+	STAT(neg_entries,    1, "missing names cached") \
+	STAT(neg_hits,       0, "lookups of names cached as missing") \
+	STAT(neg_misses,     0, "lookups of names not cached") \
+	STAT(auth_hits,      0, "client address cache hits") \
+	STAT(auth_misses,    0, "client address cache misses") \
+	STAT(ugid_lookups,   0, "dynamic uid/gid lookups") \
+	STAT(drc_hits,       0, "retransmissions caught by the reply cache") \
+	STAT(udp_drops,      0, "datagrams dropped by the kernel") \
+	STAT(udp_recvs,      0, "system calls receiving datagrams") \
+	STAT(udp_calls,      0, "datagrams received") \
+	STAT(udp_sends,      0, "batches of replies to those") \
+	STAT(udp_replies,    0, "replies in those batches") \
+	STAT(devtab_entries, 1, "devices in devtab") \
+	STAT(log_dropped,    0, "log messages dropped")
+
+typedef struct nfs_stats {
+	unsigned int		magic;
+	unsigned int		version;
+	unsigned int		pid;
+	char			progname[20];
+#define STAT(name, gauge, descr)	unsigned long name;
+	STATS_LIST
+#undef STAT
+} nfs_stats_t;
+
+extern nfs_stats_t *	nfs_stats;
+
+/* Updates are made under the nfsd lock, like those of the caches.
+ * drc_hits is only updated under the reply cache lock, and the udp
+ * counters only by the thread that receives the calls. */
+#define stats_inc(name)		(nfs_stats->name++)
+#define stats_add(name, val)	(nfs_stats->name += (val))
+#define stats_set(name, val)	(nfs_stats->name = (val))
+
+extern void		stats_init(const char *progname);
+extern void		stats_exit(void);
+
+#endif /* UNFSD_STATS_H_INCLUDED */
@@ -273,6 +273,13 @@ typedef unsigned char __u8;
 # define MAX(a, b)		(((a) > (b))? (a) : (b))
 #endif
 
+/* Storage class for data private to each nfsd worker thread */
+#if defined(ENABLE_WORKER_THREADS) && defined(__GNUC__)
+# define THREAD_LOCAL		__thread
+#else
+# define THREAD_LOCAL
+#endif
+
 #define SECURE_PORT(p)		(IPPORT_RESERVED/2 <= ntohs(p) \
 				 && ntohs(p) < IPPORT_RESERVED)
 
@@ -0,0 +1,34 @@
+/*
+ * trace.h
+ *
+ * Tracing of the phases of a call, recorded in a ring buffer that can
+ * be dumped in the JSON format of Chrome's trace viewer.
+ */
+
+#ifndef UNFSD_TRACE_H_INCLUDED
+#define UNFSD_TRACE_H_INCLUDED
+
+extern int			trace_enabled;
+extern THREAD_LOCAL __u32	trace_xid;	/* call being processed */
+
+/*
+ * Time a phase:
+ *	unsigned long long t = TRACE_BEGIN();
+ *	...
+ *	TRACE_END("phase", t);
+ * When tracing is off, this costs a test of trace_enabled.
+ */
+#define TRACE_BEGIN()		(trace_enabled ? latency_now() : 0)
+#define TRACE_END(name, t) \
+	do { \
+		if (t) \
+			trace_record(name, trace_xid, t); \
+	} while (0)
+
+extern unsigned long long	latency_now(void);
+extern void			trace_init(unsigned int size);
+extern void			trace_record(const char *name, __u32 xid,
+					     unsigned long long start);
+extern void			trace_dump(FILE *fp);
+
+#endif /* UNFSD_TRACE_H_INCLUDED */
@@ -0,0 +1,60 @@
+/*
+ * xferlog.h
+ *
+ * The transfer log: one record per file read or written, with the
+ * bytes moved while nfsd kept the file open.
+ */
+
+#ifndef UNFSD_XFERLOG_H_INCLUDED
+#define UNFSD_XFERLOG_H_INCLUDED
+
+#define XFERLOG_SYSLOG		0
+#define XFERLOG_TEXT		1
+#define XFERLOG_JSON		2
+#define XFERLOG_BINARY		3
+
+#define XFERLOG_BUFSIZE		65536	/* records are written in batches */
+#define XFERLOG_FLUSH_INTERVAL	1	/* of at most 1 second's worth */
+#define XFERLOG_KEEP		5	/* rotated files kept */
+
+/*
+ * The binary format: a header, then one record per transfer followed
+ * by the path, without a terminating null. All in host byte order,
+ * except the client address.
+ */
+#define XFERLOG_MAGIC		0x4e465358	/* NFSX */
+#define XFERLOG_VERSION		1
+
+typedef struct xferlog_header {
+	unsigned int		magic;
+	unsigned int		version;
+} xferlog_header;
+
+typedef struct xferlog_binrec {
+	unsigned int		start;		/* time of first transfer */
+	unsigned int		duration;	/* until the last, in msecs */
+	unsigned int		addr;		/* network byte order */
+	unsigned int		uid;
+	unsigned long long	bytes_read;
+	unsigned long long	bytes_written;
+	unsigned int		reads;
+	unsigned int		writes;
+	unsigned int		pathlen;
+	unsigned int		pad;
+} xferlog_binrec;
+
+struct fhcache;
+
+extern int		xferlog_enabled;
+
+extern int		xferlog_format(const char *name);
+extern int		xferlog_open(const char *path, int format,
+				     unsigned long maxsize);
+extern void		xferlog_account(struct fhcache *fhc,
+					struct in_addr addr, int write,
+					unsigned int count);
+extern void		xferlog_done(struct fhcache *fhc);
+extern void		xferlog_flush(void);
+extern void		xferlog_close(void);
+
+#endif /* UNFSD_XFERLOG_H_INCLUDED */
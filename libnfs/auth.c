@@ -13,6 +13,8 @@
 #include "xmalloc.h"
 #include "auth.h"
 #include "logging.h"
+#include "stats.h"
+#include "probes.h"
 
 #define AUTH_DEBUG
 
@@ -88,6 +90,7 @@ static nfs_options default_options = {
 	0,				       /* relative links */
 	0,				       /* noaccess */
 	1,				       /* cross_mounts */
+	0,				       /* sync writes */
 	(uid_t) - 2,			       /* default uid */
 	(gid_t) - 2,			       /* default gid */
 	0,				       /* no NIS domain */
@@ -103,6 +106,7 @@ static nfs_options anonymous_options = {
 	0,				       /* relative links */
 	0,				       /* noaccess */
 	1,				       /* cross_mounts */
+	0,				       /* sync writes */
 	(uid_t) - 2,			       /* default uid */
 	(gid_t) - 2,			       /* default gid */
 	0,				       /* no NIS domain */
@@ -566,14 +570,19 @@ auth_clientbyaddr(struct in_addr addr)
 
 	/* First, look into cache of recent clients */
 	for (i = 0; i < IPCACHEMAX; i++) {
-		if (cached_clients[i].addr.s_addr == addr.s_addr)
+		if (cached_clients[i].addr.s_addr == addr.s_addr) {
+			stats_inc(auth_hits);
 			return cached_clients[i].client;
+		}
 	}
+	stats_inc(auth_misses);
 
 	/* Check if this is a known host ... */
 	if ((cp = auth_known_clientbyaddr(addr)) == NULL) {
 		/* No, it's not. Check against list of unknown hosts */
+		PROBE1(auth_unknown_start, addr.s_addr);
 		cp = auth_unknown_clientbyaddr(addr);
+		PROBE2(auth_unknown_done, addr.s_addr, cp);
 	}
 
 	/* Put in the cache */
@@ -29,14 +29,32 @@ static void seteids(uid_t, gid_t, gid_t *, int);
 #endif /* FSUID_PRESENT */
 
 uid_t root_uid = 0;
-uid_t auth_uid = 0;			       /* Current effective user ids */
-gid_t auth_gid = 0;
-GETGROUPS_T auth_gids[NGRPS];		       /* Current supplementary gids */
-int auth_gidlen = -1;
-uid_t cred_uid = 0;
-gid_t cred_gid = 0;
-gid_t *cred_gids = NULL;
-int cred_len = 0;
+
+/*
+ * The fsuid and supplementary groups are per-thread attributes on
+ * Linux, so with worker threads each thread keeps its own copy.
+ */
+THREAD_LOCAL uid_t auth_uid = 0;	       /* Current effective user ids */
+THREAD_LOCAL gid_t auth_gid = 0;
+THREAD_LOCAL GETGROUPS_T auth_gids[NGRPS];     /* Current supplementary gids */
+THREAD_LOCAL int auth_gidlen = -1;
+THREAD_LOCAL uid_t cred_uid = 0;
+THREAD_LOCAL gid_t cred_gid = 0;
+THREAD_LOCAL gid_t *cred_gids = NULL;
+THREAD_LOCAL int cred_len = 0;
+
+#if defined(ENABLE_WORKER_THREADS) && defined(HAVE_SETGROUPS)
+#include <sys/syscall.h>
+
+/* The C library's setgroups() changes the groups of all threads at once.
+ * We want the system call, which only affects the calling thread.
+ */
+#if defined(SYS_setgroups32)
+#define setgroups(n, list)	syscall(SYS_setgroups32, (n), (list))
+#elif defined(SYS_setgroups)
+#define setgroups(n, list)	syscall(SYS_setgroups, (n), (list))
+#endif
+#endif
 
 #if defined(HAVE_AUTHDES_GETUCRED) && !defined(HAVE_AUTHDES_GETUCRED_DECL)
 
@@ -131,7 +149,7 @@ auth_user(nfs_mount * mp, struct svc_req *rqstp)
 		cred_set = 1;
 #ifdef HAVE_AUTHDES_GETUCRED
 	} else if (rqstp->rq_cred.oa_flavor == AUTH_DES) {
-		static GETGROUPS_T des_gids[NGRPS];
+		static THREAD_LOCAL GETGROUPS_T des_gids[NGRPS];
 		struct authdes_cred *cred;
 		short grplen = NGRPS;
 		int i;
@@ -210,6 +228,23 @@ auth_user(nfs_mount * mp, struct svc_req *rqstp)
 #endif
 }
 
+/*
+ * Hash the groups of the current user, for caches of what the user may
+ * do. These come from the client's credentials, which it picks freely,
+ * so a collision can't give a user more than asking for the colliding
+ * groups would.
+ */
+unsigned int
+auth_gids_hash(void)
+{
+	unsigned int hash = (unsigned int) auth_gid;
+	int i;
+
+	for (i = 0; i < auth_gidlen; i++)
+		hash = hash * 31 + (unsigned int) auth_gids[i];
+	return hash;
+}
+
 /*
  * The following functions deal with setting the client's uid/gid.
  */
@@ -325,9 +325,9 @@ parse_opts(char *cp, char terminator, nfs_mount * mp, char *client_name)
 		else if (strncmp(kwd, "anongid=", 8) == 0)
 			mp->o.nobody_gid = (gid_t) parse_num(&cp);
 		else if (strncmp(kwd, "async", 5) == 0)
-			/*@ -ifempty @*/ /* knfsd compatibility, ignore */ ;
+			mp->o.sync_writes = 0;
 		else if (strncmp(kwd, "sync", 4) == 0)
-			/*@ -ifempty @*/ /* knfsd compatibility, ignore */ ;
+			mp->o.sync_writes = 1;
 		else {
 			dbg_printf(__FILE__, __LINE__, L_ERROR,
 				   "Unknown keyword \"%.*s\" in export file\n",
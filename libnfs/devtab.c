@@ -35,6 +35,8 @@
 #include "logging.h"
 #include "auth.h"
 #include "devtab.h"
+#include "stats.h"
+#include "probes.h"
 
 #ifdef ENABLE_DEVTAB
 
@@ -80,6 +82,7 @@ devtab_index(dev_t dev)
 	}
 
 	/* Entry not found. We need to create a new entry. */
+	PROBE1(devtab_add_start, dev);
 
 	/* Set proper credentials and umask */
 	auth_override_uid(root_uid);
@@ -114,6 +117,7 @@ devtab_index(dev_t dev)
 	devtab_unlock();
 	auth_override_uid(auth_uid);
 	umask(oldmask);
+	PROBE2(devtab_add_done, dev, index);
 	return index;
 }
 
@@ -262,6 +266,7 @@ devtab_add(dev_t dev)
 	}
 
 	devtab[nrdevs++] = dev;
+	stats_set(devtab_entries, nrdevs);
 
 	return nrdevs - 1;
 }
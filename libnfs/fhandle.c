@@ -28,9 +28,10 @@
  *			returns open file descriptor for given file handle;
  *			provides caching of open files
  *
- *		fd_idle
- *			provides mututal exclusion of normal file descriptor
- *			cache use, and alarm-driven cache flushing
+ *		fd_inactive
+ *			releases a file descriptor obtained from fh_fd;
+ *			fds dropped from the cache while in use are
+ *			closed here
  *
  *		fh_compose
  *			construct new file handle from existing file handle
@@ -43,6 +44,25 @@
  *			delete the file handle associated with PATH from the
  *			cache
  *
+ *		fh_rename
+ *			moves the cached handles of a renamed file, and of
+ *			those below it, to the new path
+ *
+ *		fhc_path
+ *			returns the path of a cached file handle
+ *
+ *		fh_share_init
+ *			sets up the state shared by several server
+ *			processes
+ *
+ *		fh_lock, fh_unlock
+ *			serialize modifications of a file among several
+ *			server processes
+ *
+ *		fh_index_rename
+ *			records the new name of a renamed file in the
+ *			fh index
+ *
  * Authors:	Mark A. Shand, May 1988
  *			Donald J. Becker <becker@super.org>
  *			Rick Sladkey <jrs@world.std.com>
@@ -72,6 +92,21 @@
 #include "rpcmisc.h"
 #include "signals.h"
 #include "devtab.h"
+#include "fhindex.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
+#include "xferlog.h"
+#ifdef ENABLE_MULTIPLE_SERVERS
+#include <sys/mman.h>
+#endif
+#include <sys/resource.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+#ifdef HAVE_CLOCK_GETTIME
+#include <time.h>
+#endif
 
 /*
  * The following hash computes the exclusive or of all bytes of
@@ -106,22 +141,123 @@
 #define hash_psi(psi)		hash_xor8(psi)
 
 static mutex ex_state = inactive;
-static mutex io_state = inactive;
 
-#define HASH_TAB_SIZE		256
-static fhcache fh_head, fh_tail;
-static fhcache *fh_hashed[HASH_TAB_SIZE];
+/*
+ * Cache entries are found through an open addressing hash table. Each
+ * slot holds the psi along with the entry, so that probing doesn't
+ * have to touch the entries themselves. The table is doubled when it
+ * gets 3/4 full.
+ */
+typedef struct fh_slot {
+	psi_t		psi;
+	fhcache *	fhc;
+} fh_slot;
+
+#define FH_HASH_MINSIZE		1024	/* must be a power of two */
+
+static fhcache fh_head, fh_tail;		/* Am, most recently used first */
+static fhcache fh_in_head, fh_in_tail;	/* A1in, newest first */
+static int fh_in_size = 0;
+static fh_slot *fh_hashed = NULL;
+static unsigned int fh_hash_size = 0;
+static unsigned int fh_hash_used = 0;
 static fhcache *fd_lru_head = NULL;
 static fhcache *fd_lru_tail = NULL;
 static int fh_list_size;
 
-#ifndef FOPEN_MAX
-#define FOPEN_MAX		256
-#endif
+int fh_cache_limit = FH_CACHE_LIMIT;
+
+/*
+ * A1out: the psis of the handles last dropped from A1in, oldest first
+ * from fh_ghost_next in a ring, with a hash table of ring index + 1
+ * (0 if free) to look them up.
+ */
+static psi_t *fh_ghosts = NULL;
+static unsigned int fh_ghost_size = 0;
+static unsigned int fh_ghost_next = 0;
+static unsigned int *fh_ghost_hashed = NULL;
+static unsigned int fh_ghost_hash_size = 0;
+
+/*
+ * The dentry tree, hashed by parent and name. fh_dentry_gen goes up
+ * whenever a dentry is moved, which tells fhc_path that the paths
+ * built before may be out of date.
+ */
+static fh_dentry fh_root = { NULL, NULL, 1, 0, "" };
+static fh_dentry **fh_dentries = NULL;
+static unsigned int fh_dentry_size = 0;	/* a power of two */
+static unsigned int fh_dentry_count = 0;
+static unsigned long fh_dentry_gen = 1;
+
+static unsigned long fh_perm_gen = 0;	/* see fh_perm_forget */
+
+static unsigned long fh_neg_count = 0;	/* names in fh_negative tables */
+
+/*
+ * Attribute cache. Every request gets a serial number from
+ * fh_attr_begin; attributes are valid for the request that fetched
+ * them, and for fh_attr_ttl msec after the request started.
+ */
+int fh_attr_ttl = FH_ATTR_TTL;
+THREAD_LOCAL unsigned int fh_attr_hits = 0;	/* lstat calls saved */
+static unsigned long fh_attr_serial = 0;
+static THREAD_LOCAL unsigned long fh_attr_request = 0;
+static THREAD_LOCAL unsigned long fh_attr_now;
 
-static fhcache *fd_cache[FOPEN_MAX] = { NULL };
+/*
+ * Open fds, indexed by fd, and their number. The LRU list of these
+ * starts at fd_lru_head; the tail is closed to make room for a new one.
+ */
+int fd_cache_limit = 0;		/* 0 to size it in fh_init */
+static int fd_share = 0;		/* share fds between users */
+static fhcache **fd_cache = NULL;
+static int fd_cache_slots = 0;
 static int fd_cache_size = 0;
 
+/*
+ * Usage count of each fd handed out by fh_fd. When an fd that is still
+ * in use is dropped from the fd cache, it is merely marked orphaned and
+ * closed by the last fd_inactive. Worker threads rely on this when they
+ * do I/O without holding the nfsd lock.
+ */
+typedef struct fd_usage {
+	short	users;
+	short	orphaned;
+} fd_usage;
+
+static fd_usage *fd_users = NULL;
+static int fd_users_size = 0;
+
+#ifdef ENABLE_MULTIPLE_SERVERS
+/*
+ * When several servers are running, they share a table of generation
+ * numbers kept in a file mapped by all of them. Each file handle maps
+ * to a slot by its psi. Whenever a server removes or renames a file,
+ * it bumps the generation of the slot, and the other servers drop
+ * their cached handle (and open fd) for it on the next lookup.
+ *
+ * The same file is used for serializing modifications of a file
+ * across servers: fh_lock takes a write lock on the byte at the slot's
+ * offset. Where there are open file description locks, each thread
+ * opens the file for itself and takes its locks there, so that the
+ * worker threads of a server also keep out each other.
+ */
+#define FH_SHARE_SLOTS		4096
+#define fh_share_slot(psi)	((psi) % FH_SHARE_SLOTS)
+
+static volatile unsigned int *fh_share_gen = NULL;
+static int fh_share_fd = -1;
+#ifdef F_OFD_SETLKW
+static int fh_share_ofd = 0;
+static THREAD_LOCAL int fh_share_lockfd = -1;
+#endif
+
+static void fh_share_lockslot(int slot, int type);
+#ifdef F_OFD_SETLKW
+static int fh_share_open(void);
+#endif
+#endif
+
 #ifndef NFSERR_INVAL	/* that Sun forgot */
 #define NFSERR_INVAL	22
 #endif
@@ -158,10 +294,26 @@ int need_flush = 0;
 
 /* Forward declared local functions */
 static psi_t path_psi(char *, nfsstat *, struct stat *, int);
+static char *fh_tracepath(svc_fh *);
+#ifdef ENABLE_FH_INDEX
+static char *fh_findpath(svc_fh *);
+static void fh_index_add(psi_t, psi_t, char *);
+#else
+#define fh_findpath(h)		fh_tracepath(h)
+#endif
 static int fh_flush_fds(void);
+static void fd_cache_init(void);
+static int fh_permitted(fhcache * fhc, struct stat *sbp, int omode);
+static int fh_open_shared(fhcache * h, int omode, int want);
+static int fh_noshare(fhcache * h);
+static int fh_perm_changed(fhcache * fhc, struct stat *sbp);
 static char *fh_dump(svc_fh *);
+static void fh_evict(void);
+static fh_dentry *fh_dentry_walk(fh_dentry * d, const char *path);
+static void fh_dentry_put(fh_dentry * d);
 static void fh_insert_fdcache(fhcache * fhc);
 static void fh_unlink_fdcache(fhcache * fhc);
+static void fd_active(int fd);
 
 static void
 fh_move_to_front(fhcache * fhc)
@@ -177,33 +329,122 @@ fh_move_to_front(fhcache * fhc)
 	fhc->next->prev = fhc;
 }
 
+static unsigned int
+fh_mix(psi_t psi)
+{
+	__u32 h = (__u32) psi;
+
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h;
+}
+
+static unsigned int
+fh_hash(psi_t psi)
+{
+	return fh_mix(psi) & (fh_hash_size - 1);
+}
+
+static void
+fh_hash_grow(void)
+{
+	fh_slot *old = fh_hashed;
+	unsigned int oldsize = fh_hash_size, i, j;
+
+	if (fh_hash_size == 0) {
+		for (fh_hash_size = FH_HASH_MINSIZE;
+		     fh_hash_size * 3 < fh_cache_limit * 4; fh_hash_size *= 2);
+	} else
+		fh_hash_size *= 2;
+
+	fh_hashed = (fh_slot *) xmalloc(fh_hash_size * sizeof(fh_slot));
+	memset(fh_hashed, 0, fh_hash_size * sizeof(fh_slot));
+	for (i = 0; i < oldsize; i++) {
+		if (old[i].fhc == NULL)
+			continue;
+		for (j = fh_hash(old[i].psi); fh_hashed[j].fhc != NULL;
+		     j = (j + 1) & (fh_hash_size - 1));
+		fh_hashed[j] = old[i];
+	}
+	if (old != NULL)
+		free(old);
+}
+
 static void
-fh_inserthead(fhcache * fhc)
+fh_inserthead(fhcache * fhc, int in_fifo)
 {
-	register fhcache **hash_slot;
+	fhcache *head = in_fifo ? &fh_in_head : &fh_head;
+	unsigned int i;
 
 	/* Insert at head. */
-	fhc->prev = &fh_head;
-	fhc->next = fh_head.next;
+	fhc->prev = head;
+	fhc->next = head->next;
 	fhc->prev->next = fhc;
 	fhc->next->prev = fhc;
+	fhc->in_fifo = in_fifo;
+	fh_in_size += in_fifo;
 	fh_list_size++;
+	stats_set(fh_entries, fh_list_size);
 
 	/* Insert into hash tab. */
-	hash_slot = &(fh_hashed[fhc->h.psi % HASH_TAB_SIZE]);
-	fhc->hash_next = *hash_slot;
-	*hash_slot = fhc;
+	if ((fh_hash_used + 1) * 4 > fh_hash_size * 3)
+		fh_hash_grow();
+	for (i = fh_hash(fhc->h.psi); fh_hashed[i].fhc != NULL;
+	     i = (i + 1) & (fh_hash_size - 1));
+	fh_hashed[i].psi = fhc->h.psi;
+	fh_hashed[i].fhc = fhc;
+	fh_hash_used++;
 }
 
 static fhcache *
 fh_lookup(psi_t psi)
 {
-	register fhcache *fhc;
+	unsigned int i;
 
-	fhc = fh_hashed[psi % HASH_TAB_SIZE];
-	while (fhc != NULL && fhc->h.psi != psi)
-		fhc = fhc->hash_next;
-	return (fhc);
+	if (fh_hashed == NULL)
+		return NULL;
+	for (i = fh_hash(psi); fh_hashed[i].fhc != NULL;
+	     i = (i + 1) & (fh_hash_size - 1)) {
+		if (fh_hashed[i].psi == psi)
+			return fh_hashed[i].fhc;
+	}
+	return NULL;
+}
+
+/*
+ * Remove an entry from the hash table. The entries following it in
+ * the probe sequence are moved up, so there's no need for tombstones.
+ */
+static int
+fh_hash_remove(fhcache * fhc)
+{
+	unsigned int mask = fh_hash_size - 1;
+	unsigned int i, j, k;
+
+	if (fh_hashed == NULL)
+		return 0;
+	for (i = fh_hash(fhc->h.psi); fh_hashed[i].fhc != fhc;
+	     i = (i + 1) & mask) {
+		if (fh_hashed[i].fhc == NULL)
+			return 0;
+	}
+	fh_hash_used--;
+
+	for (;;) {
+		fh_hashed[i].fhc = NULL;
+		for (j = (i + 1) & mask;; j = (j + 1) & mask) {
+			if (fh_hashed[j].fhc == NULL)
+				return 1;
+			k = fh_hash(fh_hashed[j].psi);
+			/* Can the entry at j move to i? Only if its home
+			 * slot k isn't cyclically in (i, j] */
+			if (i <= j ? (k <= i || k > j) : (k <= i && k > j))
+				break;
+		}
+		fh_hashed[i] = fh_hashed[j];
+		i = j;
+	}
 }
 
 static void
@@ -220,6 +461,17 @@ fh_insert_fdcache(fhcache * fhc)
 	fhc->fd_next = fd_lru_head;
 	fd_lru_head = fhc;
 
+	if (fhc->fd >= fd_cache_slots) {
+		int size = fd_cache_slots ? fd_cache_slots : 64;
+
+		while (size <= fhc->fd)
+			size <<= 1;
+		fd_cache = (fhcache **) xrealloc(fd_cache,
+						 size * sizeof(fhcache *));
+		memset(fd_cache + fd_cache_slots, 0,
+		       (size - fd_cache_slots) * sizeof(fhcache *));
+		fd_cache_slots = size;
+	}
 	if (fd_cache[fhc->fd] != NULL) {
 		dbg_printf(__FILE__, __LINE__, D_FHTRACE | D_FHCACHE,
 			   "fd cache insert: fd %d [%s] already in cache\n", fhc->fd, fhc->path);
@@ -228,6 +480,7 @@ fh_insert_fdcache(fhcache * fhc)
 
 	fd_cache[fhc->fd] = fhc;
 	fd_cache_size++;
+	stats_set(fd_entries, fd_cache_size);
 }
 
 static void
@@ -255,7 +508,7 @@ fh_unlink_fdcache(fhcache * fhc)
 		return;
 	}
 
-	if (fd_cache[fhc->fd] != fhc) {
+	if (fhc->fd >= fd_cache_slots || fd_cache[fhc->fd] != fhc) {
 		dbg_printf(__FILE__, __LINE__, D_FHTRACE | D_FHCACHE,
 			   "fd cache unlink: fd %d [%s] lookup failed\n", fhc->fd, fhc->path);
 		return;
@@ -263,6 +516,7 @@ fh_unlink_fdcache(fhcache * fhc)
 
 	fd_cache[fhc->fd] = NULL;
 	fd_cache_size--;
+	stats_set(fd_entries, fd_cache_size);
 }
 
 static void
@@ -272,17 +526,22 @@ fh_close(fhcache * fhc)
 		dbg_printf(__FILE__, __LINE__, D_FHCACHE,
 			   "fh_close: closing handle %x ('%s', fd=%d)\n",
 			   fhc, fhc->path ? fhc->path : "<unnamed>", fhc->fd);
+		PROBE2(fd_close, fhc->fd, fhc->path);
+		if (fhc->xfer_first.tv_sec != 0)
+			xferlog_done(fhc);
 		fh_unlink_fdcache(fhc);
-		close(fhc->fd);
+		if (fhc->fd < fd_users_size && fd_users[fhc->fd].users > 0)
+			fd_users[fhc->fd].orphaned = 1;
+		else
+			close(fhc->fd);
 		fhc->fd = -1;
+		fhc->flags &= ~FHC_SHAREDFD;
 	}
 }
 
 static void
 fh_delete(fhcache * fhc)
 {
-	register fhcache **hash_slot;
-
 	if (fhc->h.hash_path[0] == (unsigned char) -1)
 		return;
 
@@ -293,32 +552,373 @@ fh_delete(fhcache * fhc)
 	/* Remove from current posn */
 	fhc->prev->next = fhc->next;
 	fhc->next->prev = fhc->prev;
+	fh_in_size -= fhc->in_fifo;
 	fh_list_size--;
+	stats_set(fh_entries, fh_list_size);
 
 	/* Remove from hash tab */
-	hash_slot = &(fh_hashed[fhc->h.psi % HASH_TAB_SIZE]);
-	while (*hash_slot != NULL && *hash_slot != fhc)
-		hash_slot = &((*hash_slot)->hash_next);
-	if (*hash_slot == NULL)
+	if (!fh_hash_remove(fhc))
 		dbg_printf(__FILE__, __LINE__, L_ERROR,
 			   "internal inconsistency -- fhc(%x) not in hash table\n",
 			   fhc);
-	else
-		*hash_slot = fhc->hash_next;
 
 	fh_close(fhc);
+	fh_negative_forget(fhc);
 
 	/* Free storage. */
 	if (fhc->path != NULL)
 		free(fhc->path);
+	if (fhc->dentry != NULL)
+		fh_dentry_put(fhc->dentry);
 
 	/* Safeguard against cache corruption */
 	fhc->path = NULL;
+	fhc->dentry = NULL;
 	fhc->h.hash_path[0] = -1;
 
 	free(fhc);
 }
 
+/*
+ * Find the slot of psi in the A1out hash table, or the free slot
+ * where it would go.
+ */
+static unsigned int
+fh_ghost_slot(psi_t psi)
+{
+	unsigned int mask = fh_ghost_hash_size - 1;
+	unsigned int i;
+
+	for (i = fh_mix(psi) & mask; fh_ghost_hashed[i] != 0;
+	     i = (i + 1) & mask) {
+		if (fh_ghosts[fh_ghost_hashed[i] - 1] == psi)
+			break;
+	}
+	return i;
+}
+
+/*
+ * Forget the ghost in a slot of the A1out hash table, moving up the
+ * ones following it like fh_hash_remove.
+ */
+static void
+fh_ghost_remove(unsigned int i)
+{
+	unsigned int mask = fh_ghost_hash_size - 1;
+	unsigned int j, k;
+
+	for (;;) {
+		fh_ghost_hashed[i] = 0;
+		for (j = (i + 1) & mask;; j = (j + 1) & mask) {
+			if (fh_ghost_hashed[j] == 0)
+				return;
+			k = fh_mix(fh_ghosts[fh_ghost_hashed[j] - 1]) & mask;
+			if ((j > i && (k <= i || k > j))
+			    || (j < i && k <= i && k > j))
+				break;
+		}
+		fh_ghost_hashed[i] = fh_ghost_hashed[j];
+		i = j;
+	}
+}
+
+/*
+ * Remember a handle dropped from A1in, forgetting the oldest one.
+ */
+static void
+fh_ghost_add(psi_t psi)
+{
+	unsigned int i, n = fh_ghost_next;
+
+	if (fh_ghosts == NULL) {
+		fh_ghost_size = (unsigned int) (fh_cache_limit
+						* FH_CACHE_OUT_RATIO) + 1;
+		for (fh_ghost_hash_size = 1;
+		     fh_ghost_hash_size < 2 * fh_ghost_size;
+		     fh_ghost_hash_size <<= 1);
+		fh_ghosts = (psi_t *) xmalloc(fh_ghost_size * sizeof(psi_t));
+		fh_ghost_hashed = (unsigned int *)
+		    xmalloc(fh_ghost_hash_size * sizeof(unsigned int));
+		memset(fh_ghosts, 0, fh_ghost_size * sizeof(psi_t));
+		memset(fh_ghost_hashed, 0,
+		       fh_ghost_hash_size * sizeof(unsigned int));
+	}
+
+	/* The oldest ghost may be gone already */
+	i = fh_ghost_slot(fh_ghosts[n]);
+	if (fh_ghost_hashed[i] == n + 1)
+		fh_ghost_remove(i);
+
+	fh_ghosts[n] = psi;
+	i = fh_ghost_slot(psi);
+	if (fh_ghost_hashed[i] != 0)
+		fh_ghost_remove(i);	/* the older one */
+	i = fh_ghost_slot(psi);
+	fh_ghost_hashed[i] = n + 1;
+	fh_ghost_next = (n + 1) % fh_ghost_size;
+}
+
+/*
+ * Check whether a handle was dropped from A1in not long ago, and
+ * forget it if so.
+ */
+static int
+fh_ghost_find(psi_t psi)
+{
+	unsigned int i;
+
+	if (fh_ghosts == NULL)
+		return 0;
+	i = fh_ghost_slot(psi);
+	if (fh_ghost_hashed[i] == 0)
+		return 0;
+	fh_ghost_remove(i);
+	return 1;
+}
+
+/*
+ * Make room for one handle: drop the oldest from A1in if it has more
+ * than its share, otherwise the least recently used from Am.
+ */
+static void
+fh_evict(void)
+{
+	fhcache *fhc;
+
+	if (fh_in_size > fh_cache_limit * FH_CACHE_IN_RATIO
+	    || fh_head.next == &fh_tail) {
+		if ((fhc = fh_in_tail.prev) == &fh_in_head)
+			return;
+		fh_ghost_add(fhc->h.psi);
+	} else {
+		fhc = fh_tail.prev;
+	}
+	stats_inc(fh_evictions);
+	fh_delete(fhc);
+}
+
+static unsigned int
+fh_dentry_hash(fh_dentry * parent, const char *name, size_t len)
+{
+	unsigned int h = (unsigned int) ((unsigned long) parent >> 4);
+
+	while (len--)
+		h = h * 31 + (unsigned char) *name++;
+	return fh_mix(h);
+}
+
+static void
+fh_dentry_insert(fh_dentry * d)
+{
+	fh_dentry **old = fh_dentries, *next;
+	unsigned int i, size = fh_dentry_size;
+
+	if (fh_dentry_count >= fh_dentry_size) {
+		fh_dentry_size = size ? 2 * size : 256;
+		fh_dentries = (fh_dentry **)
+		    xmalloc(fh_dentry_size * sizeof(fh_dentry *));
+		memset(fh_dentries, 0, fh_dentry_size * sizeof(fh_dentry *));
+		for (i = 0; i < size; i++) {
+			for (; old[i] != NULL; old[i] = next) {
+				next = old[i]->hnext;
+				old[i]->hashed = 0;
+				fh_dentry_count--;
+				fh_dentry_insert(old[i]);
+			}
+		}
+		if (old != NULL)
+			free(old);
+	}
+	i = fh_dentry_hash(d->parent, d->name, strlen(d->name))
+	    & (fh_dentry_size - 1);
+	d->hnext = fh_dentries[i];
+	fh_dentries[i] = d;
+	d->hashed = 1;
+	fh_dentry_count++;
+}
+
+/*
+ * Take a dentry out of the hash table, so that it is no longer found
+ * by its name. Handles keep using it until they are deleted.
+ */
+static void
+fh_dentry_unhash(fh_dentry * d)
+{
+	fh_dentry **dp;
+
+	if (!d->hashed)
+		return;
+	dp = &fh_dentries[fh_dentry_hash(d->parent, d->name, strlen(d->name))
+			  & (fh_dentry_size - 1)];
+	for (; *dp != NULL; dp = &(*dp)->hnext) {
+		if (*dp == d) {
+			*dp = d->hnext;
+			break;
+		}
+	}
+	d->hashed = 0;
+	fh_dentry_count--;
+}
+
+static fh_dentry *
+fh_dentry_find(fh_dentry * parent, const char *name, size_t len)
+{
+	fh_dentry *d;
+
+	if (fh_dentries == NULL)
+		return NULL;
+	d = fh_dentries[fh_dentry_hash(parent, name, len)
+			& (fh_dentry_size - 1)];
+	for (; d != NULL; d = d->hnext) {
+		if (d->parent == parent && !strncmp(d->name, name, len)
+		    && d->name[len] == '\0')
+			break;
+	}
+	return d;
+}
+
+/*
+ * Get a reference to the dentry of a name in parent, creating it if
+ * there's none yet.
+ */
+static fh_dentry *
+fh_dentry_get(fh_dentry * parent, const char *name, size_t len)
+{
+	fh_dentry *d;
+
+	if ((d = fh_dentry_find(parent, name, len)) != NULL) {
+		d->refs++;
+		return d;
+	}
+	d = (fh_dentry *) xmalloc(sizeof(fh_dentry));
+	d->name = (char *) xmalloc(len + 1);
+	memcpy(d->name, name, len);
+	d->name[len] = '\0';
+	d->parent = parent;
+	d->refs = 1;
+	parent->refs++;
+	fh_dentry_insert(d);
+	return d;
+}
+
+static void
+fh_dentry_put(fh_dentry * d)
+{
+	fh_dentry *parent;
+
+	for (; d != NULL && --d->refs == 0; d = parent) {
+		fh_dentry_unhash(d);
+		parent = d->parent;
+		free(d->name);
+		free(d);
+	}
+}
+
+/*
+ * Get a reference to the dentry of path, relative to d unless it is
+ * absolute. "." and ".." are resolved on the way, as in fh_compose.
+ */
+static fh_dentry *
+fh_dentry_walk(fh_dentry * d, const char *path)
+{
+	fh_dentry *next;
+	size_t len;
+
+	if (*path == '/')
+		d = &fh_root;
+	d->refs++;
+	for (; *path != '\0'; path += len) {
+		if ((len = strcspn(path, "/")) == 0) {
+			len = 1;
+			continue;
+		}
+		if (len == 1 && path[0] == '.')
+			continue;
+		if (len == 2 && path[0] == '.' && path[1] == '.') {
+			if ((next = d->parent) == NULL)
+				continue;
+			next->refs++;
+		} else {
+			next = fh_dentry_get(d, path, len);
+		}
+		fh_dentry_put(d);
+		d = next;
+	}
+	return d;
+}
+
+/*
+ * Find the dentry of an absolute path, if there is one.
+ */
+static fh_dentry *
+fh_dentry_lookup(const char *path)
+{
+	fh_dentry *d = &fh_root;
+	size_t len;
+
+	for (; d != NULL && *path != '\0'; path += len) {
+		if ((len = strcspn(path, "/")) == 0)
+			len = 1;
+		else
+			d = fh_dentry_find(d, path, len);
+	}
+	return d;
+}
+
+/*
+ * Put together the path of d at the end of buf. Returns NULL if it
+ * doesn't fit.
+ */
+static char *
+fh_dentry_path(fh_dentry * d, char *buf, size_t size)
+{
+	char *p = buf + size - 1;
+	size_t len;
+
+	*p = '\0';
+	if (d->parent == NULL)
+		*--p = '/';
+	for (; d->parent != NULL; d = d->parent) {
+		len = strlen(d->name);
+		if ((size_t) (p - buf) < len + 1)
+			return NULL;
+		p -= len;
+		memcpy(p, d->name, len);
+		*--p = '/';
+	}
+	return p;
+}
+
+/*
+ * The path of a cached file. It is only put together when needed,
+ * and again when a directory above it has been renamed.
+ */
+char *
+fhc_path(fhcache * fhc)
+{
+	char buf[PATH_MAX + NAME_MAX + 1], *path;
+
+	if (fhc->dentry == NULL
+	    || (fhc->path != NULL && fhc->path_gen == fh_dentry_gen))
+		return fhc->path;
+	fhc->path_gen = fh_dentry_gen;
+	if ((path = fh_dentry_path(fhc->dentry, buf, sizeof(buf))) == NULL) {
+		dbg_printf(__FILE__, __LINE__, L_WARNING,
+			   "path of handle %x too long\n", fhc);
+		return fhc->path;
+	}
+	if (fhc->path == NULL || strcmp(fhc->path, path) != 0) {
+		if (fhc->path != NULL) {
+			/* Moved: it may be under another export now */
+			free(fhc->path);
+			fhc->last_clnt = NULL;
+			fhc->last_mount = NULL;
+		}
+		fhc->path = xstrdup(path);
+	}
+	return fhc->path;
+}
+
 /* Lookup a UNIX error code and return NFS equivalent. */
 enum nfsstat
 nfs_errno(void)
@@ -569,6 +1169,7 @@ fh_buildpath(svc_fh * h)
 	int i;
 	size_t pathlen;
 
+	stats_inc(fh_buildpath);
 	if (h->hash_path[0] >= HP_LEN) {
 		dbg_printf(__FILE__, __LINE__, L_ERROR,
 			   "impossible hash_path[0] value: %s\n", fh_dump(h));
@@ -615,6 +1216,7 @@ fh_buildpath(svc_fh * h)
 
 		if (stat(pathbuf, &sbuf) >= 0
 		    && (dir = opendir(pathbuf)) != NULL) {
+			stats_inc(fh_dirscans);
 			pathlen = strlen(pathbuf);
 			if (cookie_stack[i] != 0) {
 				seekdir(dir, cookie_stack[i]);
@@ -755,6 +1357,7 @@ fh_buildpath(svc_fh * h)
 	psi_t psi;
 	int i;
 
+	stats_inc(fh_buildpath);
 	if (h->hash_path[0] >= HP_LEN) {
 		dbg_printf(__FILE__, __LINE__, L_ERROR,
 			   "impossible hash_path[0] value: %s\n", fh_dump(h));
@@ -782,6 +1385,7 @@ fh_buildpath(svc_fh * h)
 
 		if (stat(pathbuf, &sbuf) >= 0
 		    && (dir = opendir(pathbuf)) != NULL) {
+			stats_inc(fh_dirscans);
 			if (cookie_stack[i] != 0)
 				seekdir(dir, cookie_stack[i]);
 			if (!fh_buildcomp(h, sbuf.st_dev, dir, i, pathbuf)) {
@@ -814,6 +1418,23 @@ fh_buildpath(svc_fh * h)
 
 #endif /* !NEW_FH_BUILDPATH */
 
+/*
+ * fh_buildpath, timed for the trace and the probes.
+ */
+static char *
+fh_tracepath(svc_fh * h)
+{
+	unsigned long long t = TRACE_BEGIN();
+	unsigned long scans = nfs_stats->fh_dirscans;
+	char *path;
+
+	PROBE1(buildpath_start, h->psi);
+	path = fh_buildpath(h);
+	PROBE3(buildpath_done, h->psi, nfs_stats->fh_dirscans - scans, path);
+	TRACE_END("fh_buildpath", t);
+	return path;
+}
+
 static psi_t
 path_psi(char *path, nfsstat * status, struct stat *sbp, int svalid)
 {
@@ -916,54 +1537,262 @@ path_psi(char *path, nfsstat * status, struct stat *sbp, int svalid)
 	return (pseudo_inode(sbp->st_ino, sbp->st_dev));
 }
 
-fhcache *
-fh_find(svc_fh * h, int mode)
+/*
+ * Milliseconds since some point in the past.
+ */
+static unsigned long
+fh_msec(void)
 {
-	register fhcache *fhc, *flush;
-	int check;
-	time_t curtime;
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
 
-	check = (mode & FHFIND_CHECK);
-	mode &= 0xF;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
 
-	if (h->hash_path[0] >= HP_LEN) {
-		dbg_printf(__FILE__, __LINE__, D_FHTRACE,
-			   "stale fh detected: %s\n", fh_dump(h));
-		return NULL;
-	}
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+#endif
+}
 
-	ex_state = active;
-	(void) time(&curtime);
-	while ((fhc = fh_lookup(h->psi)) != NULL) {
-		dbg_printf(__FILE__, __LINE__, D_FHCACHE,
-			   "fh_find: psi=%lx... found '%s', fd=%d\n",
-			   (unsigned long) h->psi,
-			   fhc->path ? fhc->path : "<unnamed>", fhc->fd);
+/*
+ * Start processing a new request. nfsd calls this with the nfsd lock
+ * held. Without it (as in mountd), cached attributes are never used.
+ */
+void
+fh_attr_begin(void)
+{
+	if (++fh_attr_serial == 0)
+		fh_attr_serial++;
+	fh_attr_request = fh_attr_serial;
+	if (fh_attr_ttl > 0)
+		fh_attr_now = fh_msec();
+}
+
+static void
+fh_attr_stamp(fhcache * fhc)
+{
+	fhc->flags |= FHC_ATTRVALID;
+	fhc->attr_req = fh_attr_request;
+	fhc->attr_time = fh_attr_now;
+}
 
-		/* Invalidate cached attrs */
+/*
+ * Get the attributes of a cached file, calling lstat only if those
+ * in the cache are too old. Returns NULL if lstat fails.
+ */
+struct stat *
+fhc_stat(fhcache * fhc)
+{
+	if ((fhc->flags & FHC_ATTRVALID) && fh_attr_request != 0
+	    && (fhc->attr_req == fh_attr_request
+		|| (fh_attr_ttl > 0 && fh_attr_now - fhc->attr_time
+		    < (unsigned long) fh_attr_ttl))) {
+		fh_attr_hits++;
+		return &fhc->attrs;
+	}
+	if (lstat(fhc_path(fhc), &fhc->attrs) < 0) {
 		fhc->flags &= ~FHC_ATTRVALID;
+		return NULL;
+	}
+	fh_attr_stamp(fhc);
+	return &fhc->attrs;
+}
 
-		/* But what if hash_paths are not the same?
-		 * Something is stale. */
-		if (memcmp(h->hash_path, fhc->h.hash_path, HP_LEN) != 0) {
-			dbg_printf(__FILE__, __LINE__, D_FHTRACE,
-				   "fh_find: stale fh (path mismatch)\n");
-			goto fh_discard;
-		}
+static unsigned int
+fh_negative_hash(const char *name)
+{
+	unsigned int h = 0;
 
-		/* Check whether file exists.
-		 * If it doesn't try to rebuild the path.
-		 */
-		if (check) {
-			struct stat *s = &fhc->attrs;
-			psi_t psi;
-			nfsstat dummy;
+	while (*name != '\0')
+		h = h * 31 + (unsigned char) *name++;
+	return h;
+}
 
-			if (lstat(fhc->path, s) < 0) {
-				dbg_printf(__FILE__, __LINE__, D_FHTRACE,
+/*
+ * Find the slot of name in a table of missing names, or the free slot
+ * where it would go.
+ */
+static fh_negname *
+fh_negative_slot(fh_negative * neg, const char *name, unsigned int h)
+{
+	unsigned int i, mask = neg->size - 1;
+
+	for (i = h & mask; neg->slots[i].name != NULL; i = (i + 1) & mask) {
+		if (neg->slots[i].hash == h && !strcmp(neg->slots[i].name, name))
+			break;
+	}
+	return &neg->slots[i];
+}
+
+/*
+ * Check whether LOOKUP found name missing in dirh before, and the
+ * directory hasn't changed since.
+ */
+int
+fh_negative_find(fhcache * dirh, const char *name)
+{
+	fh_negative *neg = dirh->negative;
+	struct stat *sbp;
+
+	if (neg != NULL) {
+		if ((sbp = fhc_stat(dirh)) == NULL
+		    || sbp->st_mtime != neg->mtime
+		    || sbp->st_ctime != neg->ctime) {
+			fh_negative_forget(dirh);
+		} else if (fh_negative_slot(neg, name,
+					    fh_negative_hash(name))->name) {
+			stats_inc(neg_hits);
+			return 1;
+		}
+	}
+	stats_inc(neg_misses);
+	return 0;
+}
+
+/*
+ * Remember that LOOKUP found name missing in dirh.
+ */
+void
+fh_negative_add(fhcache * dirh, const char *name)
+{
+	fh_negative *neg = dirh->negative;
+	fh_negname *slot, *old;
+	struct stat *sbp;
+	time_t now = time(NULL);
+	unsigned int h, i, size;
+
+	/* Times are compared by the second, so a directory changed in
+	 * this second may change again without them showing it */
+	if ((sbp = fhc_stat(dirh)) == NULL || !S_ISDIR(sbp->st_mode)
+	    || sbp->st_mtime >= now || sbp->st_ctime >= now)
+		return;
+
+	if (neg != NULL && (sbp->st_mtime != neg->mtime
+			    || sbp->st_ctime != neg->ctime
+			    || neg->count >= FH_NEG_MAX
+			    || fh_neg_count >= FH_NEG_LIMIT)) {
+		fh_negative_forget(dirh);
+		neg = NULL;
+	}
+	if (fh_neg_count >= FH_NEG_LIMIT)
+		return;
+	if (neg == NULL) {
+		neg = (fh_negative *) xmalloc(sizeof(fh_negative));
+		neg->mtime = sbp->st_mtime;
+		neg->ctime = sbp->st_ctime;
+		neg->count = 0;
+		neg->size = FH_NEG_MIN;
+		neg->slots = (fh_negname *)
+		    xmalloc(neg->size * sizeof(fh_negname));
+		memset(neg->slots, 0, neg->size * sizeof(fh_negname));
+		dirh->negative = neg;
+	}
+
+	/* Keep the table at most half full */
+	if (2 * (neg->count + 1) > neg->size) {
+		old = neg->slots;
+		size = neg->size;
+		neg->size *= 2;
+		neg->slots = (fh_negname *)
+		    xmalloc(neg->size * sizeof(fh_negname));
+		memset(neg->slots, 0, neg->size * sizeof(fh_negname));
+		for (i = 0; i < size; i++) {
+			if (old[i].name != NULL)
+				*fh_negative_slot(neg, old[i].name,
+						  old[i].hash) = old[i];
+		}
+		free(old);
+	}
+
+	h = fh_negative_hash(name);
+	slot = fh_negative_slot(neg, name, h);
+	if (slot->name != NULL)
+		return;
+	slot->hash = h;
+	slot->name = xstrdup(name);
+	neg->count++;
+	fh_neg_count++;
+	stats_set(neg_entries, fh_neg_count);
+}
+
+/*
+ * Forget the missing names of a directory that is about to change.
+ */
+void
+fh_negative_forget(fhcache * dirh)
+{
+	fh_negative *neg = dirh->negative;
+	unsigned int i;
+
+	if (neg == NULL)
+		return;
+	for (i = 0; i < neg->size; i++) {
+		if (neg->slots[i].name != NULL)
+			free(neg->slots[i].name);
+	}
+	fh_neg_count -= neg->count;
+	stats_set(neg_entries, fh_neg_count);
+	free(neg->slots);
+	free(neg);
+	dirh->negative = NULL;
+}
+
+fhcache *
+fh_find(svc_fh * h, int mode)
+{
+	register fhcache *fhc;
+	int check, ghost;
+	time_t curtime;
+
+	check = (mode & FHFIND_CHECK);
+	mode &= 0xF;
+
+	if (h->hash_path[0] >= HP_LEN) {
+		dbg_printf(__FILE__, __LINE__, D_FHTRACE,
+			   "stale fh detected: %s\n", fh_dump(h));
+		return NULL;
+	}
+
+	ex_state = active;
+	(void) time(&curtime);
+	while ((fhc = fh_lookup(h->psi)) != NULL) {
+		dbg_printf(__FILE__, __LINE__, D_FHCACHE,
+			   "fh_find: psi=%lx... found '%s', fd=%d\n",
+			   (unsigned long) h->psi,
+			   fhc->path ? fhc->path : "<unnamed>", fhc->fd);
+
+		/* But what if hash_paths are not the same?
+		 * Something is stale. */
+		if (memcmp(h->hash_path, fhc->h.hash_path, HP_LEN) != 0) {
+			dbg_printf(__FILE__, __LINE__, D_FHTRACE,
+				   "fh_find: stale fh (path mismatch)\n");
+			goto fh_discard;
+		}
+
+#ifdef ENABLE_MULTIPLE_SERVERS
+		/* Another server may have removed or renamed the file */
+		if (fh_share_gen != NULL
+		    && fhc->share_gen != fh_share_gen[fh_share_slot(h->psi)]) {
+			dbg_printf(__FILE__, __LINE__, D_FHTRACE,
+				   "fh_find: stale fh (generation)\n");
+			goto fh_discard;
+		}
+#endif
+
+		/* Check whether file exists.
+		 * If it doesn't try to rebuild the path.
+		 */
+		if (check) {
+			struct stat *s;
+			psi_t psi;
+			nfsstat dummy;
+
+			if ((s = fhc_stat(fhc)) == NULL) {
+				dbg_printf(__FILE__, __LINE__, D_FHTRACE,
 					   "fh_find: stale fh: lstat: %m\n");
 			} else {
-				fhc->flags |= FHC_ATTRVALID;
 				/* If pseudo-inos don't match, we fhc->path
 				 * may be a mount point (hence lstat() returns
 				 * a different inode number than the readdir()
@@ -974,7 +1803,7 @@ fh_find(svc_fh * h, int mode)
 					goto fh_return;
 
 				/* Try again by computing the path psi */
-				psi = path_psi(fhc->path, &dummy, s, 1);
+				psi = path_psi(fhc_path(fhc), &dummy, s, 1);
 				if (h->psi == psi)
 					goto fh_return;
 
@@ -995,8 +1824,13 @@ fh_find(svc_fh * h, int mode)
 		}
 
 	      fh_return:
-		/* The cached fh seems valid */
-		if (fhc != fh_head.next)
+		stats_inc(fh_hits);
+		PROBE1(fh_hit, h->psi);
+		/* The cached fh seems valid. A1in is a FIFO, and the Am
+		 * LRU list only needs to be ordered by the second, so leave
+		 * it alone if the entry has been moved already. */
+		if (!fhc->in_fifo && fhc != fh_head.next
+		    && fhc->last_used != curtime)
 			fh_move_to_front(fhc);
 		fhc->last_used = curtime;
 		ex_state = inactive;
@@ -1005,27 +1839,26 @@ fh_find(svc_fh * h, int mode)
 
 	dbg_printf(__FILE__, __LINE__, D_FHCACHE,
 		   "fh_find: psi=%lx... not found\n", (unsigned long) h->psi);
+	stats_inc(fh_misses);
+	PROBE1(fh_miss, h->psi);
 	if (mode == FHFIND_FCACHED) {
 		ex_state = inactive;
 		return NULL;
 	}
 
-	for (flush = fh_tail.prev; fh_list_size > FH_CACHE_LIMIT; flush = fhc) {
-		/* Don't flush current head. */
-		if (flush == &fh_head)
-			break;
-		fhc = flush->prev;
-		fh_delete(flush);
-	}
+	while (fh_list_size >= fh_cache_limit && fh_list_size > 0)
+		fh_evict();
 	fhc = (fhcache *) xmalloc(sizeof *fhc);
+	fhc->path_gen = fh_dentry_gen;
 	if (mode == FHFIND_FCREATE) {
 		/* File will be created */
+		fhc->dentry = NULL;
 		fhc->path = NULL;
 	} else {
 		/* File must exist. Attempt to construct from hash_path */
 		char *path;
 
-		if ((path = fh_buildpath(h)) == NULL) {
+		if ((path = fh_findpath(h)) == NULL) {
 			dbg_printf(__FILE__, __LINE__, D_FHTRACE,
 				   "fh_find: stale fh (hash path)\n");
 			dbg_printf(__FILE__, __LINE__, D_FHTRACE,
@@ -1034,13 +1867,14 @@ fh_find(svc_fh * h, int mode)
 			ex_state = inactive;
 			return NULL;
 		}
+		fhc->dentry = fh_dentry_walk(&fh_root, path);
 		fhc->path = path;
 	}
 	fhc->flags = 0;
 	if (fhc->path && lstat(fhc->path, &fhc->attrs) >= 0) {
 		if (re_export && nfsmounted(fhc->path, &fhc->attrs))
 			fhc->flags |= FHC_NFSMOUNTED;
-		fhc->flags |= FHC_ATTRVALID;
+		fh_attr_stamp(fhc);
 	}
 	fhc->fd = -1;
 	fhc->last_used = curtime;
@@ -1049,18 +1883,25 @@ fh_find(svc_fh * h, int mode)
 	fhc->last_mount = NULL;
 	fhc->last_uid = (uid_t) - 1;
 	fhc->fd_next = fhc->fd_prev = NULL;
-	fh_inserthead(fhc);
+	fhc->ra_next = fhc->ra_end = fhc->ra_size = 0;
+	fhc->xfer_first.tv_sec = 0;
+	memset(fhc->perms, 0, sizeof(fhc->perms));
+	fhc->perm_next = 0;
+	fhc->perm_mode = 0;
+	fhc->negative = NULL;
+#ifdef ENABLE_MULTIPLE_SERVERS
+	if (fh_share_gen != NULL)
+		fhc->share_gen = fh_share_gen[fh_share_slot(h->psi)];
+#endif
+	/* Handles used again since they fell out of A1in go to Am */
+	ghost = fh_ghost_find(h->psi);
+	if (ghost)
+		stats_inc(fh_ghost_hits);
+	fh_inserthead(fhc, !ghost);
 	dbg_printf(__FILE__, __LINE__, D_FHCACHE,
 		   "fh_find: created new handle %x (path `%s' psi %08x)\n",
 		   fhc, fhc->path ? fhc->path : "<unnamed>", fhc->h.psi);
 	ex_state = inactive;
-	if (fh_list_size > FH_CACHE_LIMIT)
-		fh_flush_cache(0);
-	if (fhc->h.hash_path[0] == 0xFF) {
-		dbg_printf(__FILE__, __LINE__, L_ERROR,
-			   "newly created fh instantly flushed?!");
-		return NULL;
-	}
 	return (fhc);
 }
 
@@ -1075,7 +1916,7 @@ fh_pr(nfs_fh * fh)
 
 	if ((h = fh_find((svc_fh *) fh, FHFIND_FCACHED)) == NULL)
 		return fh_dump((svc_fh *) fh);
-	return (h->path);
+	return (fhc_path(h));
 }
 
 static char *
@@ -1133,9 +1974,9 @@ fh_create(nfs_fh * fh, char *path)
 		return NFSERR_STALE;
 
 	/* assert(h != NULL); */
-	if (h->path == NULL) {
+	if (h->dentry == NULL) {
 		h->fd = -1;
-		h->path = xstrdup(path);
+		h->dentry = fh_dentry_walk(&fh_root, path);
 		h->flags = 0;
 	}
 	memcpy(fh, &key, sizeof(key));
@@ -1152,7 +1993,7 @@ fh_path(nfs_fh * fh, nfsstat * status)
 		return (NULL);
 	}
 	*status = NFS_OK;
-	return (h->path);
+	return (fhc_path(h));
 }
 
 nfs_fh *
@@ -1249,36 +2090,79 @@ fh_path_open(char *path, int omode, int perm)
 int
 fh_fd(fhcache * h, nfsstat * status, int omode)
 {
+	unsigned long long t;
+	struct stat *sbp;
+	int share, want = omode;
+
+	/* Unless the file has an ACL, or is on an NFS file system that
+	 * may squash root, one fd is opened for all users, and whether
+	 * a user may open the file is decided from its attributes. */
+	share = fd_share && fhc_path(h)
+		&& !(h->flags & (FHC_NOSHARE | FHC_NFSMOUNTED));
+	if (share) {
+		if ((sbp = fhc_stat(h)) == NULL) {
+			*status = nfs_errno();
+			return -1;
+		}
+		/* Look for an ACL when opening, or when setfacl may have
+		 * changed the mode */
+		if ((fh_perm_changed(h, sbp) || h->fd < 0
+		     || !(h->flags & FHC_SHAREDFD)) && fh_noshare(h)) {
+			share = 0;
+		} else if (!fh_permitted(h, sbp, omode)) {
+			*status = NFSERR_ACCES;
+			return -1;
+		}
+	}
+
 	if (h->fd >= 0) {
 		/* If the requester's uid doesn't match that of the user who
 		 * opened the file, we close the file. I guess we could work
 		 * some magic with the eaccess stuff, but I don't know if
 		 * this would be any faster than simply re-doing the open.
 		 */
-		if (h->last_uid == auth_uid && (h->omode == omode ||
-						((omode == O_RDONLY
-						  || omode == O_WRONLY)
-						 && h->omode == O_RDWR))) {
+		if (((h->flags & FHC_SHAREDFD) ? share : h->last_uid == auth_uid)
+		    && (h->omode == omode || ((omode == O_RDONLY
+					       || omode == O_WRONLY)
+					      && h->omode == O_RDWR))) {
+			if (h->last_uid != auth_uid) {
+				stats_inc(fd_shared);
+				h->last_uid = auth_uid;
+			}
 			fh_insert_fdcache(h);	/* move to front of fd LRU */
+			fd_active(h->fd);
 			return (h->fd);
 		}
 		dbg_printf(__FILE__, __LINE__, D_FHCACHE,
 			   "fh_fd: uid/omode mismatch (%d/%d wanted, %d/%d cached)\n",
 			   auth_uid, omode, h->last_uid, h->omode);
+		stats_inc(fd_mismatch);
+		/* Reading and writing: open the file for both */
+		if ((h->flags & FHC_SHAREDFD) && share)
+			omode = O_RDWR;
 		fh_close(h);
 	}
 	errno = 0;
-	if (!h->path) {
+	if (!fhc_path(h)) {
 		*status = NFSERR_STALE;
 		return (-1);	/* something is really hosed */
 	}
 
-	if ((h->fd = fh_path_open(h->path, omode, 0)) >= 0) {
-		io_state = active;
+	t = TRACE_BEGIN();
+	if (!share)
+		h->fd = fh_path_open(fhc_path(h), omode, 0);
+	else if ((h->fd = fh_open_shared(h, omode, want)) >= 0)
+		omode = h->omode;
+	TRACE_END("open", t);
+	PROBE3(fd_open, h->fd, h->path, omode);
+	if (h->fd >= 0) {
+		stats_inc(fd_opens);
+		fd_active(h->fd);
 		h->omode = omode & O_ACCMODE;
 		fh_insert_fdcache(h);
 		dbg_printf(__FILE__, __LINE__, D_FHCACHE,
-			   "fh_fd: new open as fd=%d\n", h->fd);
+			   "fh_fd: new open as fd=%d%s\n", h->fd,
+			   (h->flags & FHC_SHAREDFD) ? " (shared)" : "");
 		h->last_uid = auth_uid;
 		return (h->fd);
 	}
@@ -1286,10 +2170,156 @@ fh_fd(fhcache * h, nfsstat * status, int omode)
 	return -1;
 }
 
+/*
+ * Open a file for all users, with root privileges, for omode, or for
+ * the mode wanted now if that fails.
+ */
+static int
+fh_open_shared(fhcache * h, int omode, int want)
+{
+	int fd;
+
+	auth_override_uid(root_uid);
+	fd = fh_path_open(fhc_path(h), omode, 0);
+	if (fd < 0 && omode != want)
+		fd = fh_path_open(fhc_path(h), omode = want, 0);
+	auth_override_uid(auth_uid);
+	if (fd < 0)
+		return -1;
+	h->omode = omode;
+	h->flags |= FHC_SHAREDFD;
+	return fd;
+}
+
+/*
+ * Files with an ACL are opened by each user, as the kernel may decide
+ * differently from fh_permitted. Returns 1 if that's so for h.
+ */
+static int
+fh_noshare(fhcache * h)
+{
+#ifdef HAVE_LGETXATTR
+	if (!(h->flags & FHC_NOSHARE)
+	    && lgetxattr(fhc_path(h), "system.posix_acl_access", NULL, 0) >= 0)
+		h->flags |= FHC_NOSHARE;
+#endif
+	return (h->flags & FHC_NOSHARE) != 0;
+}
+
+/*
+ * A directory was changed in a way that may take away search permission
+ * on the files below it: its owner, group or mode changed, or it moved.
+ * The permission checks of all files are forgotten, as we can't tell
+ * which files are below it.
+ */
+void
+fh_perm_forget(void)
+{
+	fh_perm_gen++;
+}
+
+/*
+ * Forget the permission checks for fhc if its owner, group or mode
+ * changed, or those of a directory (see fh_perm_forget). Returns 1 if
+ * so.
+ */
+static int
+fh_perm_changed(fhcache * fhc, struct stat *sbp)
+{
+	if (fhc->perm_mode == sbp->st_mode && fhc->perm_uid == sbp->st_uid
+	    && fhc->perm_gid == sbp->st_gid && fhc->perm_gen == fh_perm_gen)
+		return 0;
+	memset(fhc->perms, 0, sizeof(fhc->perms));
+	fhc->perm_mode = sbp->st_mode;
+	fhc->perm_uid = sbp->st_uid;
+	fhc->perm_gid = sbp->st_gid;
+	fhc->perm_gen = fh_perm_gen;
+	return 1;
+}
+
+/*
+ * Decide from its attributes whether the current user may open fhc
+ * for omode, as open would, with the exceptions fh_path_open makes
+ * for the owner and for executables. Like open, this also needs
+ * search permission on the directories above the file.
+ */
+static int
+fh_permitted(fhcache * fhc, struct stat *sbp, int omode)
+{
+	unsigned int gids = auth_gids_hash();
+	int mode, need, bits, i;
+	struct stat sb;
+	fh_perm *pp;
+
+	mode = (omode == O_RDONLY) ? FH_PERM_READ
+		: (omode == O_WRONLY) ? FH_PERM_WRITE
+		: FH_PERM_READ | FH_PERM_WRITE;
+
+	for (pp = fhc->perms; pp < fhc->perms + FH_PERM_SLOTS; pp++) {
+		if (pp->mode == mode && pp->uid == auth_uid && pp->gids == gids) {
+			stats_inc(perm_hits);
+			return pp->allowed;
+		}
+	}
+	stats_inc(perm_misses);
+
+	pp = &fhc->perms[fhc->perm_next++ % FH_PERM_SLOTS];
+	pp->uid = auth_uid;
+	pp->gids = gids;
+	pp->mode = mode;
+	if (auth_uid == 0 || sbp->st_uid == auth_uid) {
+		pp->allowed = 1;
+	} else if (mode == FH_PERM_READ && (sbp->st_mode & S_IXOTH)) {
+		pp->allowed = 1;
+	} else {
+		bits = sbp->st_mode;
+		if (sbp->st_gid == auth_gid)
+			bits >>= 3;
+		else for (i = 0; i < auth_gidlen; i++) {
+			if (auth_gids[i] == sbp->st_gid) {
+				bits >>= 3;
+				break;
+			}
+		}
+		need = ((mode & FH_PERM_READ) ? S_IROTH : 0)
+			| ((mode & FH_PERM_WRITE) ? S_IWOTH : 0);
+		pp->allowed = ((bits & need) == need);
+	}
+
+	/* lstat runs as the user, so the kernel checks the directories */
+	if (pp->allowed && lstat(fhc_path(fhc), &sb) < 0 && errno == EACCES)
+		pp->allowed = 0;
+	return pp->allowed;
+}
+
+static void
+fd_active(int fd)
+{
+	if (fd >= fd_users_size) {
+		int size = fd_users_size ? fd_users_size : 64;
+
+		while (size <= fd)
+			size <<= 1;
+		fd_users = (fd_usage *) xrealloc(fd_users,
+						 size * sizeof(fd_usage));
+		memset(fd_users + fd_users_size, 0,
+		       (size - fd_users_size) * sizeof(fd_usage));
+		fd_users_size = size;
+	}
+	fd_users[fd].users++;
+}
+
 void
 fd_inactive(int fd)
 {
-	io_state = inactive;
+	if (fd < 0 || fd >= fd_users_size || fd_users[fd].users <= 0)
+		return;
+	if (--fd_users[fd].users == 0 && fd_users[fd].orphaned) {
+		dbg_printf(__FILE__, __LINE__, D_FHCACHE,
+			   "fd_inactive: closing orphaned fd=%d\n", fd);
+		fd_users[fd].orphaned = 0;
+		close(fd);
+	}
 }
 
 /*
@@ -1336,7 +2366,8 @@ fh_compose(diropargs * dopa, nfs_fh * new_fh, struct stat * sbp,
 {
 	svc_fh *key;
 	fhcache *dirh, *h;
-	char *sindx;
+	fh_dentry *d;
+	char *sindx, *dirpath;
 	int is_dd;
 	nfsstat ret;
 	struct stat sbuf;
@@ -1381,7 +2412,9 @@ fh_compose(diropargs * dopa, nfs_fh * new_fh, struct stat * sbp,
 	}
 
 	/* Security check */
-	if (strlen(dirh->path) + strlen(fname) + 1 >= NFS_MAXPATHLEN)
+	if ((dirpath = fhc_path(dirh)) == NULL)
+		return NFSERR_STALE;
+	if (strlen(dirpath) + strlen(fname) + 1 >= NFS_MAXPATHLEN)
 		return NFSERR_NAMETOOLONG;
 
 	/* Construct path.
@@ -1394,23 +2427,23 @@ fh_compose(diropargs * dopa, nfs_fh * new_fh, struct stat * sbp,
 	}
 	if (strcmp(fname, "..") == 0) {
 		is_dd = 1;
-		sindx = strrchr(dirh->path, '/');
-		if (sindx == dirh->path)
+		sindx = strrchr(dirpath, '/');
+		if (sindx == dirpath)
 			strcpy(pathbuf, "/");
 		else {
-			int len = sindx - dirh->path;
-			strncpy(pathbuf, dirh->path, (size_t) len);
+			int len = sindx - dirpath;
+			strncpy(pathbuf, dirpath, (size_t) len);
 			pathbuf[len] = '\0';
 		}
 	} else if (!re_export && (dirh->flags & FHC_NFSMOUNTED)) {
 		return NFSERR_NOENT;
 	} else {
-		size_t len = strlen(dirh->path);
+		size_t len = strlen(dirpath);
 
 		is_dd = 0;
-		if (len && dirh->path[len - 1] == '/')
+		if (len && dirpath[len - 1] == '/')
 			len--;
-		strncpy(pathbuf, dirh->path, len);
+		strncpy(pathbuf, dirpath, len);
 		pathbuf[len] = '/';
 		strcpy(pathbuf + (len + 1), fname);
 	}
@@ -1430,33 +2463,42 @@ fh_compose(diropargs * dopa, nfs_fh * new_fh, struct stat * sbp,
 			return NFSERR_NAMETOOLONG;
 		key->hash_path[key->hash_path[0]] = (__u8) hash_psi(dirh->h.psi);
 	}
+	/* Get the dentry now, as making room in the cache for the new
+	 * handle may drop dirh */
+	d = fh_dentry_walk(dirh->dentry, fname);
+
 	/* FIXME: when crossing a mount point, we'll find the real
 	 * dev/ino in sbp and can store it in h... */
 	h = fh_find(key, FHFIND_FCREATE);
 
-	if (h == NULL)
+	if (h == NULL) {
+		fh_dentry_put(d);
 		return NFSERR_STALE;
+	}
 	if (h->h.hash_path[0] >= HP_LEN) {
 		dbg_printf(__FILE__, __LINE__, L_ERROR,
 			   "fh cache corrupted! file %s hplen %02x",
-			   h->path ? h->path : "<unnamed>",
+			   fhc_path(h) ? fhc_path(h) : "<unnamed>",
 			   h->h.hash_path[0]);
+		fh_dentry_put(d);
 		return NFSERR_STALE;
 	}
 
 	/* New code added by Don Becker */
-	if (h->path != NULL && strcmp(h->path, pathbuf) != 0) {
+	if (h->dentry != NULL && h->dentry != d) {
 		/* We must have cached an old file under the same inode # */
 		dbg_printf(__FILE__, __LINE__, D_FHTRACE,
 			   "Disposing of fh with bad path.\n");
 		fh_delete(h);
 		h = fh_find(key, FHFIND_FCREATE);
-		if (!h)
+		if (!h) {
+			fh_dentry_put(d);
 			return NFSERR_STALE;
-		if (h->path)
+		}
+		if (h->dentry)
 			dbg_printf(__FILE__, __LINE__, L_ERROR,
 				   "Internal inconsistency: double entry (path '%s', now '%s').\n",
-				   h->path, pathbuf);
+				   fhc_path(h), pathbuf);
 	}
 	dbg_printf(__FILE__, __LINE__, D_FHCACHE,
 		   "fh_compose: using  handle %x ('%s', fd=%d)\n", h,
@@ -1464,17 +2506,23 @@ fh_compose(diropargs * dopa, nfs_fh * new_fh, struct stat * sbp,
 	/* End of new code */
 
 	/* assert(h != NULL); */
-	if (h->path == 0) {
-		h->path = xstrdup(pathbuf);
+	if (h->dentry == NULL) {
+		h->dentry = d;
 		h->flags = 0;
 		if (!re_export && nfsmounted(pathbuf, sbp))
 			h->flags |= FHC_NFSMOUNTED;
 		dbg_printf(__FILE__, __LINE__, D_FHTRACE,
-			   "fh_compose: created handle %s\n", h->path);
+			   "fh_compose: created handle %s\n", pathbuf);
 		dbg_printf(__FILE__, __LINE__, D_FHTRACE, "\tdata: %s\n",
 			   fh_dump(&h->h));
+	} else {
+		fh_dentry_put(d);
 	}
 
+	/* path_psi has just fetched the attributes */
+	h->attrs = *sbp;
+	fh_attr_stamp(h);
+
 	if (fd >= 0) {
 		dbg_printf(__FILE__, __LINE__, D_FHCACHE,
 			   "fh_compose: handle %x using passed fd %d\n", h,
@@ -1490,6 +2538,10 @@ fh_compose(diropargs * dopa, nfs_fh * new_fh, struct stat * sbp,
 	}
 	if (omode >= 0)
 		h->omode = omode & O_ACCMODE;
+#ifdef ENABLE_FH_INDEX
+	if (!is_dd && strchr(fname, '/') == NULL)
+		fh_index_add(key->psi, fh_psi(&dopa->dir), fname);
+#endif
 	return (NFS_OK);
 }
 
@@ -1507,6 +2559,11 @@ fh_remove(char *path)
 	psi_t psi;
 	nfsstat status;
 	fhcache *fhc;
+	fh_dentry *d;
+
+	/* Whatever is created under this name next is another file */
+	if ((d = fh_dentry_lookup(path)) != NULL)
+		fh_dentry_unhash(d);
 
 	psi = path_psi(path, &status, NULL, 0);
 	if (psi == 0)
@@ -1516,26 +2573,371 @@ fh_remove(char *path)
 	if (fhc != NULL)
 		fh_delete(fhc);
 
+#ifdef ENABLE_FH_INDEX
+	auth_override_uid(root_uid);
+	fhindex_remove(psi);
+	auth_override_uid(auth_uid);
+#endif
+
+#ifdef ENABLE_MULTIPLE_SERVERS
+	/* Tell the other servers */
+	if (fh_share_gen != NULL) {
+		fh_share_lockslot(fh_share_slot(psi), F_WRLCK);
+		fh_share_gen[fh_share_slot(psi)]++;
+		fh_share_lockslot(fh_share_slot(psi), F_UNLCK);
+	}
+#endif
+
 	ex_state = inactive;
 	return;
 }
 
+/*
+ * A file has been renamed from one path to the other. Move its dentry,
+ * which keeps the handles of the file and those below it if it is a
+ * directory.
+ */
+void
+fh_rename(char *from, char *to)
+{
+	fh_dentry *d, *dir, *old;
+	char *name;
+
+	if ((d = fh_dentry_lookup(from)) == NULL || d == &fh_root)
+		return;
+	name = strrchr(to, '/');
+	*name = '\0';
+	dir = fh_dentry_walk(&fh_root, to);
+	*name++ = '/';
+
+	fh_dentry_unhash(d);
+	if ((old = fh_dentry_find(dir, name, strlen(name))) != NULL)
+		fh_dentry_unhash(old);
+	old = d->parent;
+	d->parent = dir;
+	fh_dentry_put(old);
+	free(d->name);
+	d->name = xstrdup(name);
+	fh_dentry_insert(d);
+	fh_dentry_gen++;
+	fh_perm_forget();
+
+#ifdef ENABLE_MULTIPLE_SERVERS
+	/* The other servers don't know, so they must drop the handle */
+	if (fh_share_gen != NULL) {
+		nfsstat status;
+		fhcache *fhc;
+		psi_t psi;
+
+		if ((psi = path_psi(to, &status, NULL, 0)) == 0)
+			return;
+
+		fh_share_lockslot(fh_share_slot(psi), F_WRLCK);
+		fh_share_gen[fh_share_slot(psi)]++;
+		fh_share_lockslot(fh_share_slot(psi), F_UNLCK);
+		if ((fhc = fh_lookup(psi)) != NULL)
+			fhc->share_gen = fh_share_gen[fh_share_slot(psi)];
+	}
+#endif
+}
+
+#ifdef ENABLE_FH_INDEX
+/*
+ * Find the path of a file handle in the fh index. This is only a hint,
+ * so make sure the path agrees with the hashed path in the handle and
+ * leads to the right file.
+ */
+static char *
+fh_index_path(svc_fh * h)
+{
+	char names[HP_LEN][FHI_NAMELEN + 1];
+	char pathbuf[NFS_MAXPATHLEN + 1];
+	struct stat sbuf;
+	__u32 psi, parent;
+	nfsstat status;
+	size_t len, n;
+	int depth, i;
+
+	depth = h->hash_path[0];
+	if (depth == 0 || depth >= HP_LEN)
+		return NULL;
+
+	/* Follow the directories up to the root */
+	psi = h->psi;
+	for (i = depth; i > 0; i--) {
+		if (!fhindex_lookup(psi, &parent, names[i - 1]))
+			return NULL;
+		if (hash_psi(parent) != h->hash_path[i])
+			goto stale;
+		psi = parent;
+	}
+	if (stat("/", &sbuf) < 0)
+		return NULL;
+	if (psi != pseudo_inode(sbuf.st_ino, sbuf.st_dev))
+		goto stale;
+
+	for (i = 0, len = 0; i < depth; i++) {
+		n = strlen(names[i]);
+		if (len + n + 1 >= NFS_MAXPATHLEN)
+			goto stale;
+		pathbuf[len++] = '/';
+		strcpy(pathbuf + len, names[i]);
+		len += n;
+	}
+
+	if (lstat(pathbuf, &sbuf) < 0
+	    || (pseudo_inode(sbuf.st_ino, sbuf.st_dev) != h->psi
+		&& path_psi(pathbuf, &status, &sbuf, 1) != h->psi))
+		goto stale;
+
+	dbg_printf(__FILE__, __LINE__, D_FHCACHE,
+		   "fh_index_path: psi=%lx found '%s'\n",
+		   (unsigned long) h->psi, pathbuf);
+	return xstrdup(pathbuf);
+
+      stale:
+	dbg_printf(__FILE__, __LINE__, D_FHTRACE,
+		   "fh_index_path: stale entry for psi=%lx\n",
+		   (unsigned long) h->psi);
+	fhindex_remove(h->psi);
+	return NULL;
+}
+
+/*
+ * Add a path and all the directories leading up to it to the index.
+ */
+static void
+fh_index_chain(char *path)
+{
+	char pathbuf[NFS_MAXPATHLEN + 1];
+	struct stat sbuf;
+	nfsstat status;
+	psi_t psi, parent;
+	char *sp;
+
+	if (strlen(path) > NFS_MAXPATHLEN || stat("/", &sbuf) < 0)
+		return;
+	strcpy(pathbuf, path);
+	parent = pseudo_inode(sbuf.st_ino, sbuf.st_dev);
+	for (sp = pathbuf + 1; *sp != '\0'; parent = psi) {
+		if ((sp = strchr(sp, '/')) != NULL)
+			*sp = '\0';
+		if ((psi = path_psi(pathbuf, &status, NULL, 0)) == 0)
+			return;
+		fhindex_add(psi, parent, strrchr(pathbuf, '/') + 1);
+		if (sp == NULL)
+			break;
+		*sp++ = '/';
+	}
+}
+
+/*
+ * Find the path of a file handle that isn't cached. Try the index
+ * first, and add the path to it if we have to scan for it.
+ */
+static char *
+fh_findpath(svc_fh * h)
+{
+	char *path;
+
+	auth_override_uid(root_uid);
+	if ((path = fh_index_path(h)) == NULL
+	    && (path = fh_tracepath(h)) != NULL) {
+		auth_override_uid(root_uid);
+		fh_index_chain(path);
+	}
+	auth_override_uid(auth_uid);
+	return path;
+}
+
+/*
+ * Record the name of a file in the index.
+ */
+static void
+fh_index_add(psi_t psi, psi_t parent, char *name)
+{
+	char oname[FHI_NAMELEN + 1];
+	__u32 oparent;
+
+	/* Most of the time, it's there already */
+	if (fhindex_lookup(psi, &oparent, oname)
+	    && oparent == parent && strcmp(oname, name) == 0)
+		return;
+
+	auth_override_uid(root_uid);
+	fhindex_add(psi, parent, name);
+	auth_override_uid(auth_uid);
+}
+
+void
+fh_index_rename(diropargs * to, char *path)
+{
+	nfsstat status;
+	psi_t psi;
+
+	if ((psi = path_psi(path, &status, NULL, 0)) != 0)
+		fh_index_add(psi, fh_psi(&to->dir), to->name);
+}
+#endif /* ENABLE_FH_INDEX */
+
+#ifdef ENABLE_MULTIPLE_SERVERS
+/*
+ * Set up the shared generation table. This must be called before
+ * forking the servers, which inherit the mapping and the lock file.
+ */
+int
+fh_share_init(void)
+{
+	size_t size = FH_SHARE_SLOTS * sizeof(unsigned int);
+	FILE *fp;
+	void *map;
+	int fd;
+
+	if ((fp = tmpfile()) == NULL)
+		goto failed;
+	fh_share_fd = fileno(fp);
+	if (ftruncate(fh_share_fd, size) < 0)
+		goto failed;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fh_share_fd, 0);
+	if (map == MAP_FAILED)
+		goto failed;
+	fh_share_gen = (volatile unsigned int *) map;
+#ifdef F_OFD_SETLKW
+	if ((fd = fh_share_open()) >= 0) {
+		close(fd);
+		fh_share_ofd = 1;
+	}
+#endif
+	return 0;
+
+failed:
+	dbg_printf(__FILE__, __LINE__, L_ERROR,
+		   "cannot set up shared fh table: %s\n", strerror(errno));
+	if (fp != NULL)
+		fclose(fp);
+	fh_share_fd = -1;
+	return -1;
+}
+
+#ifdef F_OFD_SETLKW
+/*
+ * Open the shared file again, for locks of our own. The servers are
+ * forked before any of them takes a lock, so none of them inherits
+ * another one's.
+ */
+static int
+fh_share_open(void)
+{
+	char path[32];
+
+	sprintf(path, "/proc/self/fd/%d", fh_share_fd);
+	return open(path, O_RDWR);
+}
+#endif
+
+static void
+fh_share_lockslot(int slot, int type)
+{
+	struct flock fl;
+	int fd = fh_share_fd;
+	int cmd = F_SETLKW;
+
+#ifdef F_OFD_SETLKW
+	if (fh_share_ofd && fh_share_lockfd < 0
+	    && (fh_share_lockfd = fh_share_open()) < 0) {
+		dbg_printf(__FILE__, __LINE__, L_ERROR,
+			   "fh_lock: cannot open lock file: %s\n",
+			   strerror(errno));
+	}
+	if (fh_share_lockfd >= 0) {
+		fd = fh_share_lockfd;
+		cmd = F_OFD_SETLKW;
+	}
+#endif
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = slot;
+	fl.l_len = 1;
+	fl.l_pid = 0;
+	while (fcntl(fd, cmd, &fl) < 0) {
+		if (errno != EINTR) {
+			dbg_printf(__FILE__, __LINE__, L_ERROR,
+				   "fh_lock: fcntl failed: %s\n",
+				   strerror(errno));
+			break;
+		}
+	}
+}
+
+/*
+ * Tell whether the locks of fh_lock are owned by the thread, rather
+ * than by the whole process. If they aren't, worker threads must keep
+ * the nfsd lock from fh_lock to fh_unlock.
+ */
+int
+fh_lock_threads(void)
+{
+	if (fh_share_gen == NULL)
+		return 1;
+#ifdef F_OFD_SETLKW
+	return fh_share_ofd;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Serialize modifications of a file with the other servers. Returns 1
+ * if the lock was taken, and 0 if we're the only server. See
+ * fh_lock_threads for who owns the lock.
+ */
+int
+fh_lock(nfs_fh * fh)
+{
+	if (fh_share_gen == NULL)
+		return 0;
+	fh_share_lockslot(fh_share_slot(fh_psi(fh)), F_WRLCK);
+	return 1;
+}
+
+void
+fh_unlock(nfs_fh * fh)
+{
+	if (fh_share_gen == NULL)
+		return;
+	fh_share_lockslot(fh_share_slot(fh_psi(fh)), F_UNLCK);
+}
+#endif /* ENABLE_MULTIPLE_SERVERS */
+
 /*
  * Close a file to make an fd available for a new file.
  */
 static int
 fh_flush_fds(void)
 {
-	if (io_state == active) {
-		dbg_printf(__FILE__, __LINE__, D_FHCACHE,
-			   "fh_flush_fds: not flushing... io active\n");
-		return (-1);
-	}
-	while (fd_cache_size >= FD_CACHE_LIMIT)
+	/* fds still in use are closed later by fd_inactive */
+	while (fd_cache_size >= fd_cache_limit) {
+		stats_inc(fd_evictions);
 		fh_close(fd_lru_tail);
+	}
 	return (0);
 }
 
+/*
+ * Log the transfers to the files still open, as when exiting.
+ */
+void
+fh_xferlog_all(void)
+{
+	fhcache *h;
+
+	for (h = fd_lru_head; h != NULL; h = h->fd_next) {
+		if (h->xfer_first.tv_sec != 0)
+			xferlog_done(h);
+	}
+}
+
 int
 fh_need_flush(void)
 {
@@ -1548,11 +2950,10 @@ fh_verify_cache() {
 	register fhcache* h;
 	int cache_size = 0;
 
-	h = fh_head.next;
-	while (h != &fh_tail) {
+	for (h = fh_head.next; h != &fh_tail; h = h->next)
+		cache_size++;
+	for (h = fh_in_head.next; h != &fh_in_tail; h = h->next)
 		cache_size++;
-		h = h->next;
-	}
 	if (fh_list_size != cache_size)
 		dbg_printf(__FILE__, __LINE__, L_ERROR,
 			"internal inconsistency (fh_list_size=%d) != (cache_size=%d)\n",
@@ -1578,6 +2979,7 @@ void
 fh_flush(int force)
 {
 	register fhcache *h;
+	fhcache *prev;
 	time_t	 curtime;
 	time_t	 oldtime;
 
@@ -1595,22 +2997,18 @@ fh_flush(int force)
 
 		(void) time(&curtime);
 
-		/* Remove excess entries from tail of cache	*/
-		/* If not forced, remove half the cache entries */
-
-		if (force || (fh_list_size > FH_CACHE_LIMIT)) {
-			int limit = force ? 0 : ((int) (FH_CACHE_LIMIT * FH_CACHE_FLUSH_RATIO));
-
-			while (fh_list_size > limit) {
-				fh_delete(fh_tail.prev);
-			}
-
-			/* If forcing a complete flush, we're done */
+		/* Remove excess entries, or all of them if forced */
 
-			if (force) {
-				return;
+		if (force) {
+			while (fh_list_size > 0) {
+				fh_delete(fh_in_head.next != &fh_in_tail
+					  ? fh_in_head.next : fh_head.next);
 			}
+			ex_state = inactive;
+			return;
 		}
+		while (fh_list_size > fh_cache_limit)
+			fh_evict();
 
 		/* Remove stale entries from tail of cache */
 
@@ -1622,6 +3020,13 @@ fh_flush(int force)
 			h = fh_tail.prev;
 		}
 
+		/* A1in is in the order handles came in, not of their use */
+		for (h = fh_in_tail.prev; h != &fh_in_head; h = prev) {
+			prev = h->prev;
+			if (h->last_used < oldtime)
+				fh_delete(h);
+		}
+
 		/* Close any stale fd in cache */
 
 		if (fd_cache_size > 0) {
@@ -1645,7 +3050,8 @@ fh_flush_cache(int sig)
 {
 	static volatile int inprogress = 0;
 
-	if (_rpcsvcdirty) {
+	/* With worker threads, leave the work to the housekeeping thread */
+	if (_rpcsvcdirty || (sig && _rpcsvcthreaded)) {
 		alarm(BUSY_RETRY_INTERVAL);
 		need_flush = 1;
 		return;
@@ -1653,6 +3059,7 @@ fh_flush_cache(int sig)
 	if (inprogress++)
 		return;
 	fh_flush(0);
+	xferlog_flush();
 	if (_rpcpmstart)
 		rpc_closedown();
 	inprogress = 0;
@@ -1671,10 +3078,55 @@ fh_init(void)
 
 	fh_head.next = fh_tail.next = &fh_tail;
 	fh_head.prev = fh_tail.prev = &fh_head;
+	fh_in_head.next = fh_in_tail.next = &fh_in_tail;
+	fh_in_head.prev = fh_in_tail.prev = &fh_in_head;
 	/* last_flushable = &fh_tail; */
 
+	fd_cache_init();
+
 	install_signal_handler(SIGALRM, fh_flush_cache);
 	alarm(FLUSH_INTERVAL);
 
 	umask(0);
 }
+
+/*
+ * Decide how many fds to keep open. A limit given by the user is only
+ * cut down to what the limit on open files allows, the default also to
+ * what fits in FD_CACHE_MEMORY. Either way, at least FD_CACHE_MIN are
+ * kept.
+ */
+static void
+fd_cache_init(void)
+{
+	int limit = fd_cache_limit;
+#ifdef RLIMIT_NOFILE
+	struct rlimit rl;
+#endif
+
+	if (limit == 0)
+		limit = FD_CACHE_MEMORY / FD_CACHE_COST;
+#ifdef RLIMIT_NOFILE
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+		rlim_t nofile = 0;
+
+		if (rl.rlim_cur > FD_CACHE_RESERVE)
+			nofile = rl.rlim_cur - FD_CACHE_RESERVE;
+		if (fd_cache_limit == 0)
+			nofile /= 2;
+		if ((rlim_t) limit > nofile)
+			limit = (int) nofile;
+	}
+#endif /* RLIMIT_NOFILE */
+	if (limit > fh_cache_limit)
+		limit = fh_cache_limit;	/* every fd belongs to a handle */
+	if (limit < FD_CACHE_MIN)
+		limit = FD_CACHE_MIN;
+	fd_cache_limit = limit;
+	stats_set(fd_limit, fd_cache_limit);
+
+	/* Opening files for everybody takes root privileges */
+	fd_share = (geteuid() == 0);
+	dbg_printf(__FILE__, __LINE__, D_FHCACHE,
+		   "fd cache: keeping up to %d files open\n", fd_cache_limit);
+}
@@ -0,0 +1,494 @@
+/*
+ * fhindex.c
+ *
+ * Persistent index of file handle paths.
+ *
+ * When nfsd is given a file handle that isn't in its cache, it has to
+ * find the path of the file by scanning directories from the root,
+ * guided by the hashed path in the handle (see fh_buildpath). On big
+ * exports this takes a lot of directory scans, and after a restart
+ * every handle held by a client has to go through it.
+ *
+ * The index records, for each psi nfsd has handed out, the psi of its
+ * directory and its name, so that the path can be put together by
+ * following the chain of directories up to the root. It is kept in a
+ * file (/var/state/nfs/fhindex) that is mapped into memory: a small
+ * header followed by an open addressing hash table keyed by psi.
+ * Names longer than FHI_NAMELEN are not indexed.
+ *
+ * The index is only a hint, and fhandle.c checks every path it puts
+ * together from it. Changes are made with the file locked, lookups
+ * don't lock at all. When the table fills up, it is copied to a bigger
+ * file which replaces the old one. The old file is marked stale, which
+ * tells other processes using it to open the new one.
+ *
+ * This software may be used for any purpose provided
+ * the above copyright notice is retained.  It is supplied
+ * as is, with no warranty expressed or implied.
+ */
+
+#include "system.h"
+#include "logging.h"
+#include "xmalloc.h"
+#include "fhindex.h"
+
+#ifdef ENABLE_FH_INDEX
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define FHI_MAGIC	0x66686978	/* "fhix" */
+#define FHI_VERSION	1
+#define FHI_MINSLOTS	65536		/* must be a power of two */
+
+#define FHI_EMPTY	0
+#define FHI_USED	1
+#define FHI_DELETED	2
+
+typedef struct fhi_header {
+	__u32		magic;
+	__u32		version;
+	__u32		nslots;		/* size of table */
+	__u32		nused;		/* slots in use */
+	__u32		ndeleted;	/* deleted slots */
+	__u32		stale;		/* file has been replaced */
+	__u32		spare[10];
+} fhi_header;
+
+typedef struct fhi_entry {
+	__u32		psi;
+	__u32		parent;		/* psi of directory */
+	__u8		state;
+	char		name[FHI_NAMELEN + 1];
+} fhi_entry;
+
+static char *		fhi_path = NULL;
+static char		fhi_tmpname[PATH_MAX];
+static int		fhi_building = 0;
+static int		fhi_fd = -1;
+static fhi_header *	fhi_hdr = NULL;
+static fhi_entry *	fhi_tab = NULL;
+static size_t		fhi_size = 0;
+
+static int		fhi_lock(void);
+static void		fhi_unlock(void);
+
+#define fhi_filesize(nslots) \
+	(sizeof(fhi_header) + (size_t) (nslots) * sizeof(fhi_entry))
+
+static __u32
+fhi_hash(__u32 psi)
+{
+	psi ^= psi >> 16;
+	psi *= 0x45d9f3b;
+	psi ^= psi >> 16;
+	return psi;
+}
+
+static void
+fhi_unmap(void)
+{
+	if (fhi_hdr != NULL)
+		munmap((void *) fhi_hdr, fhi_size);
+	if (fhi_fd >= 0)
+		close(fhi_fd);
+	fhi_hdr = NULL;
+	fhi_tab = NULL;
+	fhi_fd = -1;
+}
+
+/*
+ * Map the index in fd, replacing the one we're using.
+ */
+static int
+fhi_map(int fd)
+{
+	struct stat stb;
+	fhi_header *hdr;
+	void *map;
+
+	if (fstat(fd, &stb) < 0 || stb.st_size < sizeof(fhi_header))
+		return -1;
+	map = mmap(NULL, stb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = (fhi_header *) map;
+	if (hdr->magic != FHI_MAGIC || hdr->version != FHI_VERSION
+	    || hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0
+	    || fhi_filesize(hdr->nslots) != stb.st_size) {
+		munmap(map, stb.st_size);
+		return -1;
+	}
+
+	fhi_unmap();
+	fhi_fd = fd;
+	fhi_hdr = hdr;
+	fhi_tab = (fhi_entry *) (hdr + 1);
+	fhi_size = stb.st_size;
+	return 0;
+}
+
+/*
+ * Create an empty index with nslots slots in a temporary file.
+ */
+static int
+fhi_create(char *tmpname, __u32 nslots)
+{
+	fhi_header hdr;
+	int fd;
+
+	if (strlen(fhi_path) + 32 > PATH_MAX) {
+		errno = ENAMETOOLONG;
+		goto failed;
+	}
+	sprintf(tmpname, "%s.%d.%u", fhi_path, (int) getpid(), nslots);
+	if ((fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+		goto failed;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FHI_MAGIC;
+	hdr.version = FHI_VERSION;
+	hdr.nslots = nslots;
+	if (ftruncate(fd, fhi_filesize(nslots)) < 0
+	    || write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		close(fd);
+		unlink(tmpname);
+		goto failed;
+	}
+	return fd;
+
+      failed:
+	dbg_printf(__FILE__, __LINE__, L_ERROR,
+		   "cannot create fh index %s: %s\n", fhi_path,
+		   strerror(errno));
+	return -1;
+}
+
+/*
+ * Put a new index file in place of the current one, and tell the
+ * processes using the old one.
+ */
+static int
+fhi_replace(char *tmpname)
+{
+	__u32 stale = 1;
+	int oldfd;
+
+	oldfd = open(fhi_path, O_WRONLY);
+	if (rename(tmpname, fhi_path) < 0) {
+		dbg_printf(__FILE__, __LINE__, L_ERROR,
+			   "cannot rename %s to %s: %s\n", tmpname,
+			   fhi_path, strerror(errno));
+		if (oldfd >= 0)
+			close(oldfd);
+		unlink(tmpname);
+		return -1;
+	}
+	if (oldfd >= 0) {
+		if (lseek(oldfd, offsetof(fhi_header, stale), SEEK_SET) >= 0)
+			(void) write(oldfd, &stale, sizeof(stale));
+		close(oldfd);
+	}
+	return 0;
+}
+
+/*
+ * Make sure we're using the current index file. Returns 0 if there is
+ * no usable index.
+ */
+static int
+fhi_check(void)
+{
+	int fd;
+
+	if (fhi_hdr != NULL && !fhi_hdr->stale)
+		return 1;
+	if (fhi_path == NULL || fhi_building)
+		return fhi_hdr != NULL;
+
+	if ((fd = open(fhi_path, O_RDWR)) < 0) {
+		fhi_unmap();
+		return 0;
+	}
+	if (fhi_map(fd) < 0) {
+		close(fd);
+		fhi_unmap();
+		return 0;
+	}
+	return !fhi_hdr->stale;
+}
+
+static fhi_entry *
+fhi_find(__u32 psi)
+{
+	__u32 mask = fhi_hdr->nslots - 1;
+	__u32 i, n;
+	fhi_entry *e;
+
+	for (i = fhi_hash(psi) & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+		e = &fhi_tab[i];
+		if (e->state == FHI_EMPTY)
+			break;
+		if (e->state == FHI_USED && e->psi == psi)
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * Find a free slot for psi in the table.
+ */
+static fhi_entry *
+fhi_slot(fhi_entry * tab, __u32 nslots, __u32 psi)
+{
+	__u32 i;
+
+	for (i = fhi_hash(psi) & (nslots - 1);
+	     tab[i].state == FHI_USED; i = (i + 1) & (nslots - 1));
+	return &tab[i];
+}
+
+/*
+ * Copy the index to a new table, dropping deleted entries, and doubling
+ * its size if it is getting full. This is called with the index locked;
+ * if it succeeds, the lock is gone with the old file.
+ */
+static int
+fhi_grow(void)
+{
+	char tmpname[PATH_MAX];
+	fhi_header *hdr;
+	fhi_entry *tab, *e;
+	__u32 nslots, nused, i;
+	void *map;
+	int fd;
+
+	nslots = fhi_hdr->nslots;
+	if (fhi_hdr->nused >= nslots / 2)
+		nslots *= 2;
+
+	if ((fd = fhi_create(tmpname, nslots)) < 0)
+		return -1;
+	map = mmap(NULL, fhi_filesize(nslots), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		unlink(tmpname);
+		return -1;
+	}
+
+	hdr = (fhi_header *) map;
+	tab = (fhi_entry *) (hdr + 1);
+	for (i = 0, nused = 0; i < fhi_hdr->nslots; i++) {
+		if (fhi_tab[i].state != FHI_USED)
+			continue;
+		e = fhi_slot(tab, nslots, fhi_tab[i].psi);
+		*e = fhi_tab[i];
+		nused++;
+	}
+	hdr->nused = nused;
+	munmap(map, fhi_filesize(nslots));
+
+	dbg_printf(__FILE__, __LINE__, D_FHCACHE,
+		   "fh index: %u entries, now %u slots\n", nused, nslots);
+
+	if (fhi_building) {
+		unlink(fhi_tmpname);
+		strcpy(fhi_tmpname, tmpname);
+	} else if (fhi_replace(tmpname) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (fhi_map(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fhi_lock(void)
+{
+	struct flock fl;
+
+	for (;;) {
+		if (!fhi_check())
+			return -1;
+
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = 0;
+		fl.l_len = 0;
+		while (fcntl(fhi_fd, F_SETLKW, &fl) < 0) {
+			if (errno != EINTR)
+				return -1;
+		}
+
+		/* The file may have been replaced while we waited */
+		if (!fhi_hdr->stale)
+			return 0;
+		fhi_unlock();
+	}
+}
+
+static void
+fhi_unlock(void)
+{
+	struct flock fl;
+
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 0;
+	(void) fcntl(fhi_fd, F_SETLK, &fl);
+}
+
+/*
+ * Open the index file, creating it if necessary.
+ */
+int
+fhindex_open(const char *path)
+{
+	char tmpname[PATH_MAX];
+	int fd;
+
+	fhi_path = xstrdup(path ? path : PATH_FHINDEX);
+	if ((fd = open(fhi_path, O_RDWR)) >= 0) {
+		if (fhi_map(fd) == 0)
+			return 0;
+		close(fd);
+		dbg_printf(__FILE__, __LINE__, L_WARNING,
+			   "fh index %s is corrupt, starting a new one\n",
+			   fhi_path);
+	} else if (errno != ENOENT) {
+		dbg_printf(__FILE__, __LINE__, L_ERROR,
+			   "cannot open fh index %s: %s\n", fhi_path,
+			   strerror(errno));
+		goto failed;
+	}
+
+	if ((fd = fhi_create(tmpname, FHI_MINSLOTS)) < 0)
+		goto failed;
+	if (fhi_replace(tmpname) < 0 || fhi_map(fd) < 0) {
+		close(fd);
+		goto failed;
+	}
+	return 0;
+
+      failed:
+	free(fhi_path);
+	fhi_path = NULL;
+	return -1;
+}
+
+/*
+ * Start a new, empty index. It is filled with fhindex_add, and put in
+ * place of the current index file by fhindex_commit.
+ */
+int
+fhindex_create(const char *path)
+{
+	int fd;
+
+	fhi_path = xstrdup(path ? path : PATH_FHINDEX);
+	if ((fd = fhi_create(fhi_tmpname, FHI_MINSLOTS)) < 0)
+		return -1;
+	if (fhi_map(fd) < 0) {
+		close(fd);
+		unlink(fhi_tmpname);
+		return -1;
+	}
+	fhi_building = 1;
+	return 0;
+}
+
+int
+fhindex_commit(void)
+{
+	if (!fhi_building || fhi_hdr == NULL)
+		return -1;
+	fhi_building = 0;
+	if (msync((void *) fhi_hdr, fhi_size, MS_SYNC) < 0
+	    || fhi_replace(fhi_tmpname) < 0) {
+		unlink(fhi_tmpname);
+		fhi_unmap();
+		return -1;
+	}
+	fhi_unmap();
+	return 0;
+}
+
+/*
+ * Look up the directory and name of psi. name must have room for
+ * FHI_NAMELEN + 1 characters.
+ */
+int
+fhindex_lookup(__u32 psi, __u32 * parent, char *name)
+{
+	fhi_entry *e;
+
+	if (!fhi_check() || (e = fhi_find(psi)) == NULL)
+		return 0;
+	*parent = e->parent;
+	memcpy(name, e->name, FHI_NAMELEN);
+	name[FHI_NAMELEN] = '\0';
+	return 1;
+}
+
+void
+fhindex_add(__u32 psi, __u32 parent, const char *name)
+{
+	fhi_entry *e;
+
+	if (strlen(name) > FHI_NAMELEN) {
+		fhindex_remove(psi);
+		return;
+	}
+	if (fhi_lock() < 0)
+		return;
+
+	if ((e = fhi_find(psi)) == NULL) {
+		if ((fhi_hdr->nused + fhi_hdr->ndeleted + 1) * 4
+		    > fhi_hdr->nslots * 3) {
+			if (fhi_grow() < 0) {
+				fhi_unlock();
+				return;
+			}
+			if (fhi_lock() < 0)
+				return;
+		}
+		e = fhi_slot(fhi_tab, fhi_hdr->nslots, psi);
+		if (e->state == FHI_DELETED)
+			fhi_hdr->ndeleted--;
+		fhi_hdr->nused++;
+	}
+
+	/* Readers don't lock, so mark the entry used last */
+	e->psi = psi;
+	e->parent = parent;
+	strcpy(e->name, name);
+	e->state = FHI_USED;
+
+	fhi_unlock();
+}
+
+void
+fhindex_remove(__u32 psi)
+{
+	fhi_entry *e;
+
+	if (!fhi_check() || fhi_find(psi) == NULL)
+		return;
+	if (fhi_lock() < 0)
+		return;
+	if ((e = fhi_find(psi)) != NULL) {
+		e->state = FHI_DELETED;
+		fhi_hdr->nused--;
+		fhi_hdr->ndeleted++;
+	}
+	fhi_unlock();
+}
+
+#endif /* ENABLE_FH_INDEX */
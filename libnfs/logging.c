@@ -8,6 +8,15 @@
  *		Fred N. van Kempen, <waltje@uWalt.NL.Mugnet.ORG>
  *		Olaf Kirch, <okir@monad.swb.de>
  *
+ *		Once log_async_start has been called, messages are not
+ *		written out by the thread that logs them. They are put
+ *		into a ring of log records, and written out later by a
+ *		writer thread, or else from the RPC loop once the calls
+ *		at hand have been answered. Timestamps and the details of
+ *		a call are formatted only then. Claiming a record takes
+ *		no lock; when the ring is full, the message is dropped
+ *		and counted, and the count is logged later.
+ *
  *		This software maybe be used for any purpose provided
  *		the above copyright notice is retained.  It is supplied
  *		as is, with no warranty expressed or implied.
@@ -15,6 +24,10 @@
 
 #include "system.h"
 #include "logging.h"
+#include "stats.h"
+#ifdef ENABLE_WORKER_THREADS
+#include <pthread.h>
+#endif
 
 #ifdef HAVE_SYSLOG_H
 #include <syslog.h>
@@ -28,6 +41,44 @@ static int dbg_mask = D_GENERAL;	       /* What will be logged          */
 static char log_name[NAME_MAX + 1];	       /* name of this program         */
 static FILE *log_fp = (FILE *) NULL;	       /* fp for the log file          */
 
+#define LOG_RING	512			/* records, a power of two */
+#define LOG_MSGLEN	1024
+#define LOG_NGIDS	16
+
+typedef struct log_record {
+	volatile unsigned long	seq;		/* slot number + 1 when filled */
+	unsigned long		slot;
+	int			kind;
+	int			line;
+	const char *		file;
+	time_t			when;
+	const char *		call;		/* log_call: procedure name */
+	int			flavor;		/* log_call: credentials */
+	time_t			cred_time;
+	char			machname[32];
+	int			uid, gid;
+	int			ngids;
+	int			gids[LOG_NGIDS];
+	char			msg[LOG_MSGLEN];
+} log_record;
+
+static log_record *log_ring = NULL;	       /* NULL until log_async_start */
+static volatile unsigned long log_head = 0;    /* next record to fill      */
+static volatile unsigned long log_tail = 0;    /* next record to write out */
+static volatile unsigned long log_dropped = 0;
+static unsigned long log_reported = 0;	       /* drops logged so far      */
+static volatile int log_draining = 0;
+#ifdef ENABLE_WORKER_THREADS
+static int log_writer = 0;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+static log_record *log_claim(void);
+static void log_commit(log_record *rec);
+static void log_write(log_record *rec);
+static void log_output(log_record *rec, const char *buff);
+
 void
 log_open(char *progname, int foreground)
 {
@@ -53,6 +104,9 @@ log_open(char *progname, int foreground)
 	}
 
 	snprintf(log_name, NAME_MAX, "%s[%d]", progname, (int) getpid());
+
+	/* A forked child must not share the ring with its writer */
+	log_ring = NULL;
 }
 
 void
@@ -122,90 +176,300 @@ log_level_enabled(int level)
 void
 dbg_printf(const char *file, int line, int kind, const char *fmt, ...)
 {
-	char buff[2048];
+	log_record *rec, buf;
 	va_list args;
-	time_t now;
-	struct tm *tm;
 
 	if (!(kind & (L_FATAL | L_ERROR | L_WARNING | L_NOTICE))
 	    && !(logging && (kind & dbg_mask)))
 		return;
 
+	if (log_ring == NULL || (kind & L_FATAL)) {
+		rec = &buf;
+	} else if ((rec = log_claim()) == NULL) {
+		return;		/* the ring is full */
+	}
+	rec->kind = kind;
+	rec->line = line;
+	rec->file = file;
+	rec->when = time(NULL);
+	rec->call = NULL;
+
 	va_start(args, fmt);
 #ifdef HAVE_VPRINTF
-	buff[0] = '\0';
-	vsnprintf(buff, sizeof(buff) - 1, fmt, args);
+	rec->msg[0] = '\0';
+	vsnprintf(rec->msg, sizeof(rec->msg) - 1, fmt, args);
 #else
 	/* Figure out how to use _doprnt here. */
 #endif
 	va_end(args);
 
+	if (rec == &buf) {
+		log_flush();	/* what came before goes first */
+		log_write(rec);
+	} else {
+		log_commit(rec);
+	}
+
+	if (kind & L_FATAL)
+		exit(1);
+}
+
+/*
+ * Log an incoming call. Only the credentials are copied here, they
+ * are formatted when the record is written out.
+ */
+void
+log_call(const char* file, int line, struct svc_req *rqstp, char *xname, char *arg)
+{
+	log_record *rec, buf;
+	int i;
+
+	if (!logging || !(dbg_mask & D_CALL))
+		return;
+
+	if (log_ring == NULL) {
+		rec = &buf;
+	} else if ((rec = log_claim()) == NULL) {
+		return;		/* the ring is full */
+	}
+	rec->kind = D_CALL;
+	rec->line = line;
+	rec->file = file;
+	rec->when = time(NULL);
+	rec->call = xname;
+	rec->flavor = rqstp->rq_cred.oa_flavor;
+	if (rec->flavor == AUTH_UNIX) {
+		struct authunix_parms *unix_cred;
+
+		unix_cred = (struct authunix_parms *) rqstp->rq_clntcred;
+		rec->cred_time = unix_cred->aup_time;
+		strncpy(rec->machname, unix_cred->aup_machname,
+			sizeof(rec->machname) - 1);
+		rec->machname[sizeof(rec->machname) - 1] = '\0';
+		rec->uid = unix_cred->aup_uid;
+		rec->gid = unix_cred->aup_gid;
+		rec->ngids = 0;
+		for (i = 0; i < (int) unix_cred->aup_len && i < LOG_NGIDS; i++)
+			rec->gids[rec->ngids++] = unix_cred->aup_gids[i];
+	}
+	rec->msg[0] = '\0';
+	if (arg != NULL) {
+		strncpy(rec->msg, arg, sizeof(rec->msg) - 1);
+		rec->msg[sizeof(rec->msg) - 1] = '\0';
+	}
+
+	if (rec == &buf) {
+		log_write(rec);
+	} else {
+		log_commit(rec);
+	}
+}
+
+/*
+ * Write a message to the log file or syslog.
+ */
+static void
+log_output(log_record *rec, const char *buff)
+{
+	struct tm tmbuf, *tm;
+
 #ifdef HAVE_SYSLOG_H
-	if (kind & (L_FATAL | L_ERROR)) {
+	if (rec->kind & (L_FATAL | L_ERROR)) {
 		(void) syslog(LOG_ERR, "%s", buff);
-	} else if (kind & L_WARNING) {
+	} else if (rec->kind & L_WARNING) {
 		(void) syslog(LOG_WARNING, "%s", buff);
-	} else if (kind & L_NOTICE) {
+	} else if (rec->kind & L_NOTICE) {
 		(void) syslog(LOG_NOTICE, "%s", buff);
 	} else if (log_fp == NULL) {
 		(void) syslog(LOG_DEBUG, "%s", buff);
 	}
 #endif
 	if (log_fp != (FILE *) NULL) {
-		(void) time(&now);
-		tm = localtime(&now);
+		tm = localtime_r(&rec->when, &tmbuf);
 		fprintf(log_fp, "%s %02d/%02d/%02d %02d:%02d %s %d : %s",
 			log_name, tm->tm_mon + 1, tm->tm_mday, tm->tm_year,
-			tm->tm_hour, tm->tm_min, file, line, buff);
+			tm->tm_hour, tm->tm_min, rec->file, rec->line, buff);
 		if (strchr(buff, '\n') == NULL)
 			fputc('\n', log_fp);
 	}
-
-	if (kind & L_FATAL)
-		exit(1);
 }
 
 /*
- * Log an incoming call.
+ * Format a record and write it out.
  */
-void
-log_call(const char* file, int line, struct svc_req *rqstp, char *xname, char *arg)
+static void
+log_write(log_record *rec)
 {
 	char buffer[4096];
 	size_t i, len, total;
+	struct tm tmbuf, *tm;
 
-	if (!logging || !(dbg_mask & D_CALL))
+	if (rec->call == NULL) {
+		log_output(rec, rec->msg);
 		return;
+	}
 
 	total = sizeof(buffer);
-	snprintf(buffer, total, "%s [%d ", xname, rqstp->rq_cred.oa_flavor);
+	snprintf(buffer, total, "%s [%d ", rec->call, rec->flavor);
 	len = strlen(buffer);
-
-	if (rqstp->rq_cred.oa_flavor == AUTH_UNIX) {
-		struct authunix_parms *unix_cred;
-		struct tm *tm;
-
-		unix_cred = (struct authunix_parms *) rqstp->rq_clntcred;
-		tm = localtime(&unix_cred->aup_time);
+	if (rec->flavor == AUTH_UNIX) {
+		tm = localtime_r(&rec->cred_time, &tmbuf);
 		snprintf(buffer + len, total - len,
 			 "%d/%d/%d %02d:%02d:%02d %s %d.%d",
 			 tm->tm_year, tm->tm_mon + 1, tm->tm_mday,
 			 tm->tm_hour, tm->tm_min, tm->tm_sec,
-			 unix_cred->aup_machname,
-			 unix_cred->aup_uid, unix_cred->aup_gid);
+			 rec->machname, rec->uid, rec->gid);
 		len = strlen(buffer);
-		if ((int) unix_cred->aup_len > 0) {
-			snprintf(buffer + len, total - len,
-				 "+%d", unix_cred->aup_gids[0]);
+		for (i = 0; i < (size_t) rec->ngids; i++) {
+			snprintf(buffer + len, total - len, "%c%d",
+				 i ? ',' : '+', rec->gids[i]);
 			len = strlen(buffer);
-			for (i = 1; i < unix_cred->aup_len; i++) {
-				snprintf(buffer + len, total - len,
-					 ",%d", unix_cred->aup_gids[i]);
-				len = strlen(buffer);
-			}
 		}
 	}
-	dbg_printf(file, line, D_CALL, "%s]\n", buffer);
-	if (arg && *arg)
-		dbg_printf(file, line, D_CALL, "\t%s\n", arg);
+	snprintf(buffer + len, total - len, "]\n");
+	log_output(rec, buffer);
+	if (rec->msg[0] != '\0') {
+		snprintf(buffer, total, "\t%s\n", rec->msg);
+		log_output(rec, buffer);
+	}
+}
+
+/*
+ * Get a record in the ring to fill, or NULL if the ring is full.
+ */
+static log_record *
+log_claim(void)
+{
+	log_record *rec;
+	unsigned long head;
+
+	do {
+		head = log_head;
+		if (head - log_tail >= LOG_RING) {
+			__sync_fetch_and_add(&log_dropped, 1);
+			return NULL;
+		}
+	} while (!__sync_bool_compare_and_swap(&log_head, head, head + 1));
+	rec = &log_ring[head & (LOG_RING - 1)];
+	rec->slot = head;
+	return rec;
+}
+
+/*
+ * Hand a filled record to the writer.
+ */
+static void
+log_commit(log_record *rec)
+{
+	__sync_synchronize();
+	rec->seq = rec->slot + 1;
+#ifdef ENABLE_WORKER_THREADS
+	if (log_writer && ((rec->kind & (L_ERROR | L_WARNING | L_NOTICE))
+			   || log_head - log_tail == LOG_RING / 2))
+		pthread_cond_signal(&log_cond);
+#endif
+}
+
+/*
+ * Write out the records in the ring, up to the first one still being
+ * filled.
+ */
+void
+log_flush(void)
+{
+	log_record *rec;
+	unsigned long dropped;
+
+	if (log_ring == NULL)
+		return;
+	if (__sync_lock_test_and_set(&log_draining, 1)) {
+		return;		/* someone else is at it */
+	}
+	while (log_tail != log_head) {
+		rec = &log_ring[log_tail & (LOG_RING - 1)];
+		if (rec->seq != log_tail + 1)
+			break;
+		__sync_synchronize();
+		log_write(rec);
+		rec->seq = 0;
+		__sync_synchronize();
+		log_tail++;
+	}
+	if ((dropped = log_dropped) != log_reported) {
+		dbg_printf(__FILE__, __LINE__, L_WARNING,
+			   "log ring full, dropped %lu messages\n",
+			   dropped - log_reported);
+		log_reported = dropped;
+		stats_set(log_dropped, dropped);
+	}
+	if (log_fp != NULL)
+		fflush(log_fp);
+	__sync_lock_release(&log_draining);
+}
+
+#ifdef ENABLE_WORKER_THREADS
+static void *
+log_writer_run(void *arg)
+{
+	struct timespec ts;
+	struct timeval tv;
+
+	for (;;) {
+		log_flush();
+		pthread_mutex_lock(&log_mutex);
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = tv.tv_usec * 1000 + 100000000;	/* 100 msec */
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (log_tail == log_head)
+			pthread_cond_timedwait(&log_cond, &log_mutex, &ts);
+		pthread_mutex_unlock(&log_mutex);
+	}
+	return NULL;
+}
+#endif /* ENABLE_WORKER_THREADS */
+
+/*
+ * Stop writing messages out as they are logged. Call this once the
+ * server has done all its forks, as a writer thread doesn't survive
+ * them.
+ */
+void
+log_async_start(void)
+{
+	if (log_ring != NULL)
+		return;
+	log_ring = (log_record *) calloc(LOG_RING, sizeof(log_record));
+	if (log_ring == NULL)
+		return;
+	log_head = log_tail = 0;
+	atexit(log_flush);
+#ifdef ENABLE_WORKER_THREADS
+	{
+		pthread_t tid;
+
+		if (pthread_create(&tid, NULL, log_writer_run, NULL) == 0) {
+			pthread_detach(tid);
+			log_writer = 1;
+		}
+	}
+#endif
+}
+
+/*
+ * Write out what was logged while the calls at hand were processed.
+ * The writer thread, if we have one, takes care of that itself.
+ */
+void
+log_idle(void)
+{
+#ifdef ENABLE_WORKER_THREADS
+	if (log_writer)
+		return;
+#endif
+	if (log_tail != log_head || log_dropped != log_reported)
+		log_flush();
 }
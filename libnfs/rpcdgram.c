@@ -0,0 +1,543 @@
+/*
+ * rpcdgram.c
+ *
+ * UDP server transport for the RPC library. This is a straight
+ * reimplementation of the svcudp transport found in the C library,
+ * except that it allows the server to take a snapshot of the reply
+ * context of the call currently being processed (socket, peer address,
+ * xid and verifier). The reply can then be sent at a later time, and
+ * from a different thread than the one that received the call.
+ *
+ * This software may be used for any purpose provided
+ * the above copyright notice is retained.  It is supplied
+ * as is, with no warranty expressed or implied.
+ */
+
+#include "system.h"
+#include "rpcmisc.h"
+#include "logging.h"
+#include "xmalloc.h"
+#include "stats.h"
+#include <time.h>
+
+#ifndef UDPMSGSIZE
+#define UDPMSGSIZE	8800
+#endif
+
+/*
+ * With recvmmsg, all datagrams waiting on the socket (up to DGRAM_BATCH)
+ * are received with a single system call, and then processed one by
+ * one. With sendmmsg, the replies sent meanwhile by svcdgram_reply are
+ * held back and sent together once the batch is done.
+ */
+#ifdef HAVE_RECVMMSG
+#define DGRAM_BATCH	16
+#else
+#define DGRAM_BATCH	1
+#endif
+
+#ifdef SO_RXQ_OVFL
+#define DGRAM_CMSGSIZE	CMSG_SPACE(sizeof(__u32))
+#else
+#define DGRAM_CMSGSIZE	0
+#endif
+
+#define DROPS_WARN_INTERVAL	60	/* seconds between drop warnings */
+
+struct svcdgram_slot {
+	char *			ds_buffer;
+	int			ds_len;		/* of datagram or reply */
+	int			ds_reply;	/* reply held back */
+	struct sockaddr_in	ds_addr;
+	struct iovec		ds_iov;
+	struct msghdr		ds_msg;
+	char			ds_cmsg[DGRAM_CMSGSIZE + 1];
+};
+
+struct svcdgram_data {
+	u_int		sd_iosz;		/* size of send/recv buffer */
+	__u32		sd_xid;			/* xid of the current call */
+	XDR		sd_xdrs;		/* XDR handle */
+	char		sd_verfbody[MAX_AUTH_BYTES];
+	char *		sd_buffer;		/* that of the current call */
+	int		sd_count;		/* datagrams received */
+	int		sd_next;		/* next one to process */
+	int		sd_nreply;		/* replies held back */
+	struct svcdgram_slot sd_slot[DGRAM_BATCH];
+};
+
+#define sd_data(xprt)	((struct svcdgram_data *) (xprt)->xp_p2)
+
+static bool_t		svcdgram_recv(SVCXPRT *xprt, struct rpc_msg *msg);
+static enum xprt_stat	svcdgram_stat(SVCXPRT *xprt);
+static bool_t		svcdgram_getargs(SVCXPRT *xprt, xdrproc_t xdr_args,
+					 caddr_t args_ptr);
+static bool_t		svcdgram_reply(SVCXPRT *xprt, struct rpc_msg *msg);
+static bool_t		svcdgram_freeargs(SVCXPRT *xprt, xdrproc_t xdr_args,
+					  caddr_t args_ptr);
+static void		svcdgram_destroy(SVCXPRT *xprt);
+static int		svcdgram_fill(SVCXPRT *xprt);
+static void		svcdgram_flush(SVCXPRT *xprt);
+static void		svcdgram_drops(struct msghdr *msg);
+
+static struct xp_ops	svcdgram_ops = {
+	svcdgram_recv,
+	svcdgram_stat,
+	svcdgram_getargs,
+	svcdgram_reply,
+	svcdgram_freeargs,
+	svcdgram_destroy
+};
+
+/* Per-thread buffer for encoding deferred replies */
+static THREAD_LOCAL char *	rd_buffer = NULL;
+static THREAD_LOCAL u_int	rd_bufsz = 0;
+
+/* Statistics: datagrams dropped by the kernel, and batch sizes. The
+ * totals are also kept in the statistics file, for nfsdstat. */
+static __u32		dgram_drops = 0;
+static time_t		dgram_drops_warned = 0;
+static unsigned long	dgram_recv_hist[DGRAM_BATCH + 1];
+static unsigned long	dgram_send_hist[DGRAM_BATCH + 1];
+
+/*
+ * Create a UDP transport on the given socket. If sock is RPC_ANYSOCK,
+ * a new socket is created and bound to an arbitrary port.
+ */
+SVCXPRT *
+svcdgram_create(int sock, u_int iosz)
+{
+	struct svcdgram_data *sd;
+	struct svcdgram_slot *ds;
+	struct sockaddr_in addr;
+	socklen_t len;
+	SVCXPRT *xprt;
+	int i;
+
+	if (sock == RPC_ANYSOCK) {
+		if ((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+			dbg_printf(__FILE__, __LINE__, L_ERROR,
+				   "svcdgram_create: cannot create socket: %s\n",
+				   strerror(errno));
+			return NULL;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		if (bindresvport(sock, &addr) < 0) {
+			addr.sin_port = 0;
+			(void) bind(sock, (struct sockaddr *) &addr,
+				    sizeof(addr));
+		}
+	}
+
+	len = (socklen_t) sizeof(addr);
+	if (getsockname(sock, (struct sockaddr *) &addr, &len) < 0) {
+		dbg_printf(__FILE__, __LINE__, L_ERROR,
+			   "svcdgram_create: cannot getsockname: %s\n",
+			   strerror(errno));
+		return NULL;
+	}
+
+#ifdef SO_RXQ_OVFL
+	/* Have the kernel tell us how many datagrams it dropped */
+	i = 1;
+	(void) setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &i, sizeof(i));
+#endif
+
+	iosz = ((MAX(iosz, UDPMSGSIZE) + 3) / 4) * 4;
+
+	xprt = (SVCXPRT *) xmalloc(sizeof(*xprt));
+	sd = (struct svcdgram_data *) xmalloc(sizeof(*sd));
+	memset(xprt, 0, sizeof(*xprt));
+	memset(sd, 0, sizeof(*sd));
+
+	sd->sd_iosz = iosz;
+	for (i = 0; i < DGRAM_BATCH; i++) {
+		ds = &sd->sd_slot[i];
+		ds->ds_buffer = (char *) xmalloc(iosz);
+		ds->ds_iov.iov_base = ds->ds_buffer;
+		ds->ds_iov.iov_len = iosz;
+	}
+	sd->sd_buffer = sd->sd_slot[0].ds_buffer;
+	xdrmem_create(&sd->sd_xdrs, sd->sd_buffer, iosz, XDR_DECODE);
+
+	xprt->xp_p2 = (caddr_t) sd;
+	xprt->xp_verf.oa_base = sd->sd_verfbody;
+	xprt->xp_ops = &svcdgram_ops;
+	xprt->xp_port = ntohs(addr.sin_port);
+	xprt->xp_sock = sock;
+	xprt_register(xprt);
+
+	return xprt;
+}
+
+static bool_t
+svcdgram_recv(SVCXPRT *xprt, struct rpc_msg *msg)
+{
+	struct svcdgram_data *sd = sd_data(xprt);
+	struct svcdgram_slot *ds;
+	XDR *xdrs = &sd->sd_xdrs;
+
+	if (sd->sd_next >= sd->sd_count && svcdgram_fill(xprt) <= 0)
+		return FALSE;
+
+	ds = &sd->sd_slot[sd->sd_next++];
+	memcpy(&xprt->xp_raddr, &ds->ds_addr, sizeof(ds->ds_addr));
+	xprt->xp_addrlen = ds->ds_msg.msg_namelen;
+
+	/* Anything shorter than four 32-bit ints is garbage */
+	if (ds->ds_len < 16)
+		return FALSE;
+
+	if (sd->sd_buffer != ds->ds_buffer) {
+		XDR_DESTROY(xdrs);
+		sd->sd_buffer = ds->ds_buffer;
+		xdrmem_create(xdrs, sd->sd_buffer, sd->sd_iosz, XDR_DECODE);
+	}
+	xdrs->x_op = XDR_DECODE;
+	XDR_SETPOS(xdrs, 0);
+	if (!xdr_callmsg(xdrs, msg))
+		return FALSE;
+	sd->sd_xid = msg->rm_xid;
+	return TRUE;
+}
+
+/*
+ * Receive the datagrams waiting on the socket. Returns their number.
+ */
+static int
+svcdgram_fill(SVCXPRT *xprt)
+{
+	struct svcdgram_data *sd = sd_data(xprt);
+	struct svcdgram_slot *ds;
+	int i, n;
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[DGRAM_BATCH];
+#endif
+
+	sd->sd_next = sd->sd_count = 0;
+	for (i = 0; i < DGRAM_BATCH; i++) {
+		ds = &sd->sd_slot[i];
+		memset(&ds->ds_msg, 0, sizeof(ds->ds_msg));
+		ds->ds_msg.msg_name = &ds->ds_addr;
+		ds->ds_msg.msg_namelen = sizeof(ds->ds_addr);
+		ds->ds_msg.msg_iov = &ds->ds_iov;
+		ds->ds_msg.msg_iovlen = 1;
+		ds->ds_msg.msg_control = ds->ds_cmsg;
+		ds->ds_msg.msg_controllen = DGRAM_CMSGSIZE;
+#ifdef HAVE_RECVMMSG
+		msgs[i].msg_hdr = ds->ds_msg;
+		msgs[i].msg_len = 0;
+#endif
+	}
+
+#ifdef HAVE_RECVMMSG
+	/* The socket is readable, but another nfsd may beat us to it */
+	do {
+		n = recvmmsg(xprt->xp_sock, msgs, DGRAM_BATCH, MSG_DONTWAIT,
+			     NULL);
+	} while (n < 0 && errno == EINTR);
+	for (i = 0; i < n; i++) {
+		sd->sd_slot[i].ds_msg = msgs[i].msg_hdr;
+		sd->sd_slot[i].ds_len = (int) msgs[i].msg_len;
+	}
+#else
+	do {
+		n = recvmsg(xprt->xp_sock, &sd->sd_slot[0].ds_msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n >= 0) {
+		sd->sd_slot[0].ds_len = n;
+		n = 1;
+	}
+#endif
+	if (n <= 0)
+		return 0;
+
+	dgram_recv_hist[n]++;
+	stats_inc(udp_recvs);
+	stats_add(udp_calls, n);
+	svcdgram_drops(&sd->sd_slot[n - 1].ds_msg);
+	sd->sd_count = n;
+	return n;
+}
+
+/*
+ * Note how many datagrams the kernel has dropped on the socket so far,
+ * and complain if that number keeps growing.
+ */
+static void
+svcdgram_drops(struct msghdr *msg)
+{
+#ifdef SO_RXQ_OVFL
+	struct cmsghdr *cmsg;
+	time_t now;
+	__u32 drops;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET
+		    || cmsg->cmsg_type != SO_RXQ_OVFL)
+			continue;
+		memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+		if (drops == dgram_drops)
+			return;
+		now = time(NULL);
+		if (now - dgram_drops_warned >= DROPS_WARN_INTERVAL) {
+			dbg_printf(__FILE__, __LINE__, L_WARNING,
+				   "UDP receive queue overflow, %u datagrams "
+				   "dropped so far\n", drops);
+			dgram_drops_warned = now;
+		}
+		dgram_drops = drops;
+		stats_set(udp_drops, drops);
+	}
+#endif
+}
+
+static enum xprt_stat
+svcdgram_stat(SVCXPRT *xprt)
+{
+	struct svcdgram_data *sd = sd_data(xprt);
+
+	if (sd->sd_next < sd->sd_count)
+		return XPRT_MOREREQS;
+	svcdgram_flush(xprt);
+	return XPRT_IDLE;
+}
+
+static bool_t
+svcdgram_getargs(SVCXPRT *xprt, xdrproc_t xdr_args, caddr_t args_ptr)
+{
+	return (*xdr_args) (&sd_data(xprt)->sd_xdrs, args_ptr);
+}
+
+static bool_t
+svcdgram_freeargs(SVCXPRT *xprt, xdrproc_t xdr_args, caddr_t args_ptr)
+{
+	XDR *xdrs = &sd_data(xprt)->sd_xdrs;
+
+	xdrs->x_op = XDR_FREE;
+	return (*xdr_args) (xdrs, args_ptr);
+}
+
+/*
+ * Reply to the current call. The reply goes into the buffer the call
+ * came in, and, with sendmmsg, waits there for the rest of the batch.
+ */
+static bool_t
+svcdgram_reply(SVCXPRT *xprt, struct rpc_msg *msg)
+{
+	struct svcdgram_data *sd = sd_data(xprt);
+	XDR *xdrs = &sd->sd_xdrs;
+	int slen;
+
+	xdrs->x_op = XDR_ENCODE;
+	XDR_SETPOS(xdrs, 0);
+	msg->rm_xid = sd->sd_xid;
+	if (!xdr_replymsg(xdrs, msg))
+		return FALSE;
+
+	slen = (int) XDR_GETPOS(xdrs);
+#ifdef HAVE_SENDMMSG
+	if (sd->sd_count > 1) {
+		struct svcdgram_slot *ds = &sd->sd_slot[sd->sd_next - 1];
+
+		ds->ds_len = slen;
+		ds->ds_reply = 1;
+		ds->ds_iov.iov_len = slen;
+		ds->ds_msg.msg_control = NULL;
+		ds->ds_msg.msg_controllen = 0;
+		ds->ds_msg.msg_flags = 0;
+		sd->sd_nreply++;
+		return TRUE;
+	}
+#endif
+	dgram_send_hist[1]++;
+	stats_inc(udp_sends);
+	stats_inc(udp_replies);
+	return sendto(xprt->xp_sock, sd->sd_buffer, slen, 0,
+		      (struct sockaddr *) &xprt->xp_raddr,
+		      xprt->xp_addrlen) == slen;
+}
+
+/*
+ * Send the replies held back by svcdgram_reply.
+ */
+static void
+svcdgram_flush(SVCXPRT *xprt)
+{
+#ifdef HAVE_SENDMMSG
+	struct svcdgram_data *sd = sd_data(xprt);
+	struct mmsghdr msgs[DGRAM_BATCH];
+	struct svcdgram_slot *ds;
+	int i, n, sent;
+
+	if (sd->sd_nreply == 0)
+		return;
+
+	for (i = n = 0; i < sd->sd_count; i++) {
+		ds = &sd->sd_slot[i];
+		if (ds->ds_reply) {
+			msgs[n].msg_hdr = ds->ds_msg;
+			msgs[n].msg_len = 0;
+			n++;
+		}
+		ds->ds_reply = 0;
+		ds->ds_iov.iov_len = sd->sd_iosz;
+	}
+	sd->sd_nreply = 0;
+	dgram_send_hist[n]++;
+	stats_inc(udp_sends);
+	stats_add(udp_replies, n);
+
+	for (i = 0; i < n; i += sent) {
+		sent = sendmmsg(xprt->xp_sock, msgs + i, n - i, 0);
+		if (sent < 0 && errno == EINTR) {
+			sent = 0;
+		} else if (sent <= 0) {
+			dbg_printf(__FILE__, __LINE__, L_ERROR,
+				   "svcdgram: cannot send replies: %s\n",
+				   strerror(errno));
+			break;
+		}
+	}
+#endif
+}
+
+static void
+svcdgram_destroy(SVCXPRT *xprt)
+{
+	struct svcdgram_data *sd = sd_data(xprt);
+	int i;
+
+	xprt_unregister(xprt);
+	(void) close(xprt->xp_sock);
+	XDR_DESTROY(&sd->sd_xdrs);
+	for (i = 0; i < DGRAM_BATCH; i++)
+		free(sd->sd_slot[i].ds_buffer);
+	free(sd);
+	free(xprt);
+}
+
+/*
+ * Print the number of datagrams dropped by the kernel, and how many
+ * datagrams were received and replies sent per system call.
+ */
+void
+svcdgram_stats(FILE *fp)
+{
+	int i;
+
+	fprintf(fp, "udp drops %u\n", (unsigned int) dgram_drops);
+	fprintf(fp, "udp batch  recv      send\n");
+	for (i = 1; i <= DGRAM_BATCH; i++) {
+		if (dgram_recv_hist[i] == 0 && dgram_send_hist[i] == 0)
+			continue;
+		fprintf(fp, "%9d %9lu %9lu\n", i,
+			dgram_recv_hist[i], dgram_send_hist[i]);
+	}
+	memset(dgram_recv_hist, 0, sizeof(dgram_recv_hist));
+	memset(dgram_send_hist, 0, sizeof(dgram_send_hist));
+}
+
+/*
+ * Save everything needed to reply to the current call on xprt.
+ * Returns FALSE if xprt isn't one of ours.
+ */
+bool_t
+svcdgram_defer(SVCXPRT *xprt, rpc_defer *rd)
+{
+	struct svcdgram_data *sd;
+
+	if (xprt->xp_ops != &svcdgram_ops
+	    || xprt->xp_verf.oa_length > MAX_AUTH_BYTES)
+		return FALSE;
+
+	sd = sd_data(xprt);
+	rd->rd_sock = xprt->xp_sock;
+	rd->rd_iosz = sd->sd_iosz;
+	memcpy(&rd->rd_addr, &xprt->xp_raddr, sizeof(rd->rd_addr));
+	rd->rd_addrlen = xprt->xp_addrlen;
+	rd->rd_xid = sd->sd_xid;
+	rd->rd_verf_flavor = xprt->xp_verf.oa_flavor;
+	rd->rd_verf_length = xprt->xp_verf.oa_length;
+	memcpy(rd->rd_verfbody, xprt->xp_verf.oa_base, rd->rd_verf_length);
+	return TRUE;
+}
+
+/*
+ * Get the xid of the call being processed on xprt.
+ */
+bool_t
+svcdgram_xid(SVCXPRT *xprt, __u32 *xidp)
+{
+	if (xprt->xp_ops != &svcdgram_ops)
+		return FALSE;
+	*xidp = sd_data(xprt)->sd_xid;
+	return TRUE;
+}
+
+/*
+ * Send a successful reply to a call saved by svcdgram_defer.
+ */
+bool_t
+svcdgram_sendreply(rpc_defer *rd, xdrproc_t xdr_results, caddr_t results)
+{
+	return svcdgram_senddata(rd, xdr_results, results, NULL, 0);
+}
+
+/*
+ * Same, but the results encoded by xdr_results are followed by len
+ * bytes of opaque data from buf. The data is sent from where it is
+ * rather than being copied into the reply buffer.
+ */
+bool_t
+svcdgram_senddata(rpc_defer *rd, xdrproc_t xdr_results, caddr_t results,
+		  char *buf, u_int len)
+{
+	static char zero[4];
+	struct rpc_msg rply;
+	struct msghdr msg;
+	struct iovec iov[3];
+	XDR xdrs;
+	int slen;
+
+	if (rd_bufsz < rd->rd_iosz) {
+		free(rd_buffer);
+		rd_buffer = (char *) xmalloc(rd->rd_iosz);
+		rd_bufsz = rd->rd_iosz;
+	}
+
+	rply.rm_xid = rd->rd_xid;
+	rply.rm_direction = REPLY;
+	rply.rm_reply.rp_stat = MSG_ACCEPTED;
+	rply.acpted_rply.ar_verf.oa_flavor = rd->rd_verf_flavor;
+	rply.acpted_rply.ar_verf.oa_base = rd->rd_verfbody;
+	rply.acpted_rply.ar_verf.oa_length = rd->rd_verf_length;
+	rply.acpted_rply.ar_stat = SUCCESS;
+	rply.acpted_rply.ar_results.where = results;
+	rply.acpted_rply.ar_results.proc = xdr_results;
+
+	xdrmem_create(&xdrs, rd_buffer, rd->rd_iosz, XDR_ENCODE);
+	if (!xdr_replymsg(&xdrs, &rply)) {
+		XDR_DESTROY(&xdrs);
+		return FALSE;
+	}
+	slen = (int) XDR_GETPOS(&xdrs);
+	XDR_DESTROY(&xdrs);
+
+	iov[0].iov_base = rd_buffer;
+	iov[0].iov_len = slen;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	iov[2].iov_base = zero;
+	iov[2].iov_len = (4 - (len & 3)) & 3;
+	slen += iov[1].iov_len + iov[2].iov_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = (struct sockaddr *) &rd->rd_addr;
+	msg.msg_namelen = rd->rd_addrlen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	return sendmsg(rd->rd_sock, &msg, 0) == slen;
+}
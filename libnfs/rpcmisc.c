@@ -18,22 +18,40 @@
 #include "rpcmisc.h"
 #include "logging.h"
 #include <rpc/pmap_clnt.h>
-
-#ifdef S_SPLINT_S
-fd_set svc_fdset;
-#endif /* S_SPLINT */
+#include <sys/resource.h>
+#include <sys/poll.h>
+#ifdef HAVE_EPOLL_CREATE
+#include <sys/epoll.h>
+#endif
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
 
 /* Another undefined function in RPC */
 extern SVCXPRT *svcfd_create(int sock, u_int ssize, u_int rsize);
 
 static int makesock(in_port_t port, int proto, int socksz);
+static void rpc_nofile(void);
+static void rpc_steer(void);
 
 #define RPCSVC_CLOSEDOWN	120
+#define RPC_EVENTS		64	/* events per epoll_wait */
+#define RPC_MAXFILES		65536	/* if there's no hard limit */
 time_t closedown = 0;
 int _rpcpmstart = 0;
 int _rpcfdtype = 0;
 int _rpcsvcdirty = 0;
+int _rpcsvcthreaded = 0;
+int _rpcreuseport = 0;			/* see rpc_ownsocks */
+void (*_rpcsignalled)(void) = NULL;	/* see rpc_run */
 const char *auth_daemon = 0;
+static int rpc_epfd = -1;		/* epoll set of rpc_run */
+
+/* Transports created by rpc_init on the default port */
+static SVCXPRT *rpc_udpxprt = NULL;
+static SVCXPRT *rpc_tcpxprt = NULL;
+static in_port_t rpc_port = 0;
+static int rpc_bufsiz = 0;
 
 #ifdef AUTH_DAEMON
 static bool_t(*tcp_rendevouser) (SVCXPRT *, struct rpc_msg *);
@@ -58,6 +76,11 @@ rpc_init(const char *name, unsigned long prog, unsigned long *verstbl, void (*di
 		return;
 	}
 
+	/* Every TCP connection takes a descriptor, so take all we may
+	 * have. This has to happen before the first transport is
+	 * registered, as the RPC library sizes its tables then. */
+	rpc_nofile();
+
 	asize = (socklen_t) sizeof(saddr);
 	sock = 0;
 	if (getsockname(0, (struct sockaddr *) &saddr, &asize) == 0) {
@@ -83,16 +106,21 @@ rpc_init(const char *name, unsigned long prog, unsigned long *verstbl, void (*di
 			pmap_unset(prog, vers);
 		sock = RPC_ANYSOCK;
 	}
+	rpc_port = defport;
+	rpc_bufsiz = bufsiz;
 
 	if ((_rpcfdtype == 0) || (_rpcfdtype == SOCK_DGRAM)) {
 		if (_rpcfdtype == 0 && defport != 0) {
 			sock = makesock(defport, IPPROTO_UDP, bufsiz);
 		}
-		transp = svcudp_create(sock);
+		transp = svcdgram_create(sock, bufsiz ? bufsiz + 1024 : 0);
 		if (transp == NULL) {
 			dbg_printf(__FILE__, __LINE__, L_FATAL,
 				   "cannot create udp service.");
 		}
+		if (_rpcfdtype == 0 && defport != 0) {
+			rpc_udpxprt = transp;
+		}
 		for (i = 0; (vers = verstbl[i]) != 0; i++) {
 			if (!svc_register
 			    (transp, prog, vers, dispatch, IPPROTO_UDP)) {
@@ -107,11 +135,14 @@ rpc_init(const char *name, unsigned long prog, unsigned long *verstbl, void (*di
 		if (_rpcfdtype == 0 && defport != 0) {
 			sock = makesock(defport, IPPROTO_TCP, bufsiz);
 		}
-		transp = svctcp_create(sock, 0, 0);
+		transp = svcstream_create(sock);
 		if (transp == NULL) {
 			dbg_printf(__FILE__, __LINE__, L_FATAL,
 				   "cannot create tcp service.");
 		}
+		if (_rpcfdtype == 0 && defport != 0) {
+			rpc_tcpxprt = transp;
+		}
 #ifdef AUTH_DAEMON
 		tcp_rendevouser = transp->xp_ops->xp_recv;
 		transp->xp_ops->xp_recv = auth_rendevouser;
@@ -127,6 +158,10 @@ rpc_init(const char *name, unsigned long prog, unsigned long *verstbl, void (*di
 		}
 	}
 
+	if (_rpcreuseport) {
+		rpc_steer();
+	}
+
 	/* 
 	 * We ignore SIGPIPE. SIGPIPE is being sent to a daemon when trying
 	 * to do a sendmsg() on a TCP socket whose peer has disconnected.
@@ -159,7 +194,6 @@ void
 rpc_closedown(void)
 {
 	struct sockaddr_in sin;
-	static int size = 0;
 	time_t now = time(NULL);
 	int i;
 	socklen_t len;
@@ -177,16 +211,13 @@ rpc_closedown(void)
 		 * Okay, this is a TCP socket. Check whether we're still
 		 * connected
 		 */
-		if (size == 0) {
-			size = getdtablesize();
-		}
-
-		for (i = 0; i < size; i++) {
-			if (!FD_ISSET(i, &svc_fdset)) {
+		for (i = 0; i < svc_max_pollfd; i++) {
+			if (svc_pollfd[i].fd < 0) {
 				continue;
 			}
 			len = (socklen_t) sizeof(sin);
-			if (getpeername(i, (struct sockaddr *) &sin, &len) >= 0) {
+			if (getpeername(svc_pollfd[i].fd,
+					(struct sockaddr *) &sin, &len) >= 0) {
 				exit(0);
 			}
 		}
@@ -195,6 +226,214 @@ rpc_closedown(void)
 	closedown = now + RPCSVC_CLOSEDOWN;
 }
 
+/*
+ * Wait for calls and dispatch them. This replaces svc_run(), which
+ * select()s over all transports on every wakeup; that gets slow with
+ * thousands of TCP connections, and fails for descriptors past
+ * FD_SETSIZE. With epoll, only the transports that are ready are
+ * looked at. Returns only if waiting fails.
+ *
+ * When a signal interrupts the wait, _rpcsignalled is called, so that
+ * work the signal handler couldn't do itself is done without waiting
+ * for the next call.
+ */
+void
+rpc_run(void)
+{
+#ifdef HAVE_EPOLL_CREATE
+	struct epoll_event ev[RPC_EVENTS];
+	int i, n;
+
+	if ((rpc_epfd = epoll_create(RPC_EVENTS)) < 0) {
+		dbg_printf(__FILE__, __LINE__, L_ERROR,
+			   "epoll_create failed: %s\n", strerror(errno));
+		svc_run();
+		return;
+	}
+
+	/* Pick up the transports created so far */
+	for (i = 0; i < svc_max_pollfd; i++) {
+		if (svc_pollfd[i].fd >= 0) {
+			rpc_watch(svc_pollfd[i].fd);
+		}
+	}
+
+	for (;;) {
+		if ((n = epoll_wait(rpc_epfd, ev, RPC_EVENTS, -1)) < 0) {
+			if (errno == EINTR) {
+				if (_rpcsignalled != NULL) {
+					(*_rpcsignalled)();
+				}
+				continue;
+			}
+			dbg_printf(__FILE__, __LINE__, L_ERROR,
+				   "epoll_wait failed: %s\n", strerror(errno));
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			svc_getreq_common(ev[i].data.fd);
+		}
+		log_idle();
+	}
+	close(rpc_epfd);
+	rpc_epfd = -1;
+#else
+	svc_run();
+#endif /* HAVE_EPOLL_CREATE */
+}
+
+/*
+ * Have rpc_run wait on the socket of a transport created while it is
+ * running. The descriptor drops out of the set when it is closed.
+ */
+void
+rpc_watch(int sock)
+{
+#ifdef HAVE_EPOLL_CREATE
+	struct epoll_event ev;
+
+	if (rpc_epfd < 0) {
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = sock;
+	if (epoll_ctl(rpc_epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		dbg_printf(__FILE__, __LINE__, L_ERROR,
+			   "cannot watch socket %d: %s\n", sock,
+			   strerror(errno));
+	}
+#endif /* HAVE_EPOLL_CREATE */
+}
+
+/*
+ * Give a copy of a server that runs as several processes UDP and TCP
+ * sockets of its own on the default port, in place of the ones it
+ * inherited from rpc_init. Left to share one socket, all copies wake
+ * up on every call, and a client's calls end up in random processes.
+ * With SO_REUSEPORT, the kernel hands each call to one socket, picked
+ * by the client address (see rpc_steer), so a client keeps talking to
+ * the same process and finds its file handles cached there.
+ *
+ * _rpcreuseport has to be set to the number of processes before
+ * rpc_init, so that its sockets can be joined. It is reset to 0 if the
+ * kernel doesn't support SO_REUSEPORT.
+ */
+void
+rpc_ownsocks(void)
+{
+	SVCXPRT *transp;
+	int sock;
+
+	if (!_rpcreuseport) {
+		return;
+	}
+	rpc_closesocks();
+
+	sock = makesock(rpc_port, IPPROTO_UDP, rpc_bufsiz);
+	transp = svcdgram_create(sock, rpc_bufsiz ? rpc_bufsiz + 1024 : 0);
+	if (transp == NULL) {
+		dbg_printf(__FILE__, __LINE__, L_FATAL,
+			   "cannot create udp service.");
+	}
+	rpc_udpxprt = transp;
+
+	sock = makesock(rpc_port, IPPROTO_TCP, rpc_bufsiz);
+	if ((transp = svcstream_create(sock)) == NULL) {
+		dbg_printf(__FILE__, __LINE__, L_FATAL,
+			   "cannot create tcp service.");
+	}
+#ifdef AUTH_DAEMON
+	transp->xp_ops->xp_recv = auth_rendevouser;
+#endif /* AUTH_DAEMON */
+	rpc_tcpxprt = transp;
+	rpc_steer();
+
+	/* The programs stay registered, that is not tied to a transport */
+}
+
+/*
+ * Close the sockets created by rpc_init or rpc_ownsocks.
+ */
+void
+rpc_closesocks(void)
+{
+	if (rpc_udpxprt != NULL) {
+		svc_destroy(rpc_udpxprt);
+		rpc_udpxprt = NULL;
+	}
+	if (rpc_tcpxprt != NULL) {
+		svcstream_destroy(rpc_tcpxprt);
+		rpc_tcpxprt = NULL;
+	}
+}
+
+/*
+ * Have the kernel pick the socket of a SO_REUSEPORT group by the
+ * client's IP address alone, rather than by address and port. The
+ * program is attached to the group, so a TCP socket must have joined
+ * it, by listening, first.
+ */
+static void
+rpc_steer(void)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	struct sock_filter code[] = {
+		/* A = IPv4 source address */
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12},
+		/* A = A % number of sockets */
+		{BPF_ALU | BPF_MOD | BPF_K, 0, 0, 0},
+		/* return A */
+		{BPF_RET | BPF_A, 0, 0, 0}
+	};
+	struct sock_fprog prog;
+	SVCXPRT *xprts[2];
+	int i;
+
+	code[1].k = _rpcreuseport;
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	xprts[0] = rpc_udpxprt;
+	xprts[1] = rpc_tcpxprt;
+	for (i = 0; i < 2; i++) {
+		if (xprts[i] == NULL) {
+			continue;
+		}
+		if (setsockopt(xprts[i]->xp_sock, SOL_SOCKET,
+			       SO_ATTACH_REUSEPORT_CBPF,
+			       &prog, sizeof(prog)) < 0) {
+			dbg_printf(__FILE__, __LINE__, L_WARNING,
+				   "cannot steer calls by client address: "
+				   "%s\n", strerror(errno));
+		}
+	}
+#endif /* SO_ATTACH_REUSEPORT_CBPF */
+}
+
+/*
+ * Raise the soft limit on open files to the hard limit.
+ */
+static void
+rpc_nofile(void)
+{
+#ifdef RLIMIT_NOFILE
+	struct rlimit rl;
+	rlim_t max;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+		return;
+	}
+	max = rl.rlim_max;
+	if (max == RLIM_INFINITY || max > RPC_MAXFILES) {
+		max = RPC_MAXFILES;
+	}
+	if (rl.rlim_cur < max) {
+		rl.rlim_cur = max;
+		(void) setrlimit(RLIMIT_NOFILE, &rl);
+	}
+#endif /* RLIMIT_NOFILE */
+}
+
 static int
 makesock(in_port_t port, int proto, int socksz)
 {
@@ -225,6 +464,22 @@ makesock(in_port_t port, int proto, int socksz)
 			   strerror(errno));
 	}
 
+#ifdef SO_REUSEPORT
+	if (_rpcreuseport) {
+		int one = 1;
+
+		if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one,
+			       sizeof(one)) < 0) {
+			dbg_printf(__FILE__, __LINE__, L_WARNING,
+				   "cannot set SO_REUSEPORT, sharing one "
+				   "socket: %s\n", strerror(errno));
+			_rpcreuseport = 0;
+		}
+	}
+#else
+	_rpcreuseport = 0;
+#endif /* SO_REUSEPORT */
+
 	memset((char *) &sin, 0, sizeof(sin));
 	sin.sin_family = (sa_family_t) AF_INET;
 	sin.sin_addr.s_addr = INADDR_ANY;
@@ -274,6 +529,7 @@ auth_rendevouser(SVCXPRT * xprt, struct rpc_msg *rpcmsg)
 		xprt = svcfd_create(sock, 0, 0);
 		xprt->xp_raddr = sin;
 		xprt->xp_addrlen = slen;
+		rpc_watch(sock);
 
 		/* Swap the receive handler */
 		if (auth_daemon) {
@@ -336,6 +592,7 @@ auth_handler(int sock)
 	if (pid == 0) {
 		/* Parent: create a new transport for this socket */
 		svcfd_create(fds[0], 0, 0);
+		rpc_watch(fds[0]);
 		return;
 	}
 
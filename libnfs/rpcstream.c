@@ -0,0 +1,275 @@
+/*
+ * rpcstream.c
+ *
+ * TCP server transport for the RPC library. This is the svctcp
+ * transport of the C library, except that we accept connections and
+ * receive calls ourselves, so we know the xid of the call currently
+ * being processed. The server can then write a reply to the socket
+ * directly, handing bulk data to the kernel without first copying it
+ * into the XDR record stream (see svcstream_sendreply).
+ *
+ * This software may be used for any purpose provided
+ * the above copyright notice is retained.  It is supplied
+ * as is, with no warranty expressed or implied.
+ */
+
+#include "system.h"
+#include "rpcmisc.h"
+#include "logging.h"
+#include <sys/uio.h>
+
+/* Another undefined function in RPC */
+extern SVCXPRT *svcfd_create(int sock, u_int ssize, u_int rsize);
+
+#define LAST_FRAG	0x80000000
+#define SS_HDRSIZE	(4 + MAX_AUTH_BYTES + 256)
+
+static bool_t		svcstream_rendezvous(SVCXPRT *xprt,
+					     struct rpc_msg *msg);
+static bool_t		svcstream_recv(SVCXPRT *xprt, struct rpc_msg *msg);
+static bool_t		svcstream_sendv(int sock, struct iovec *iov, int cnt,
+					int flags);
+#ifdef HAVE_SPLICE
+static bool_t		svcstream_splice(int pipefd, int sock, u_int len,
+					 int more);
+#endif
+
+static struct xp_ops *	ss_tcp_ops;
+static struct xp_ops	ss_rendezvous_ops;
+static struct xp_ops	ss_conn_ops;
+static bool_t		(*ss_tcp_recv) (SVCXPRT *, struct rpc_msg *);
+
+/* Connection of the call being processed, and its xid */
+static SVCXPRT *	ss_xprt = NULL;
+static __u32		ss_xid;
+
+/*
+ * Create a TCP transport listening on the given socket.
+ */
+SVCXPRT *
+svcstream_create(int sock)
+{
+	SVCXPRT *xprt;
+
+	if ((xprt = svctcp_create(sock, 0, 0)) == NULL)
+		return NULL;
+
+	ss_tcp_ops = (struct xp_ops *) xprt->xp_ops;
+	ss_rendezvous_ops = *xprt->xp_ops;
+	ss_rendezvous_ops.xp_recv = svcstream_rendezvous;
+	xprt->xp_ops = &ss_rendezvous_ops;
+	return xprt;
+}
+
+/*
+ * Destroy a transport created by svcstream_create. The ops go back to
+ * those of the C library, which may tell a listening socket by them.
+ */
+void
+svcstream_destroy(SVCXPRT *xprt)
+{
+	if (xprt->xp_ops == &ss_rendezvous_ops)
+		xprt->xp_ops = ss_tcp_ops;
+	svc_destroy(xprt);
+}
+
+static bool_t
+svcstream_rendezvous(SVCXPRT *xprt, struct rpc_msg *msg)
+{
+	struct sockaddr_in addr;
+	socklen_t len;
+	int sock;
+
+	do {
+		len = (socklen_t) sizeof(addr);
+		sock = accept(xprt->xp_sock, (struct sockaddr *) &addr, &len);
+	} while (sock < 0 && errno == EINTR);
+	if (sock < 0)
+		return FALSE;
+
+	if ((xprt = svcfd_create(sock, 0, 0)) == NULL) {
+		dbg_printf(__FILE__, __LINE__, L_ERROR,
+			   "svcstream: cannot create connection\n");
+		(void) close(sock);
+		return FALSE;
+	}
+	memcpy(&xprt->xp_raddr, &addr, sizeof(addr));
+	xprt->xp_addrlen = len;
+	rpc_watch(sock);
+
+	if (ss_tcp_recv == NULL) {
+		ss_conn_ops = *xprt->xp_ops;
+		ss_tcp_recv = ss_conn_ops.xp_recv;
+		ss_conn_ops.xp_recv = svcstream_recv;
+	}
+	xprt->xp_ops = &ss_conn_ops;
+
+	/* There's never a call to be processed on the rendezvous socket */
+	return FALSE;
+}
+
+static bool_t
+svcstream_recv(SVCXPRT *xprt, struct rpc_msg *msg)
+{
+	if (!(*ss_tcp_recv) (xprt, msg)) {
+		ss_xprt = NULL;
+		return FALSE;
+	}
+	ss_xprt = xprt;
+	ss_xid = msg->rm_xid;
+	return TRUE;
+}
+
+/*
+ * Check whether svcstream_sendreply can reply to the call being
+ * processed on xprt.
+ */
+bool_t
+svcstream_check(SVCXPRT *xprt)
+{
+	return xprt != NULL && xprt == ss_xprt;
+}
+
+/*
+ * Get the xid of the call being processed on xprt.
+ */
+bool_t
+svcstream_xid(SVCXPRT *xprt, __u32 *xidp)
+{
+	if (!svcstream_check(xprt))
+		return FALSE;
+	*xidp = ss_xid;
+	return TRUE;
+}
+
+/*
+ * Send a successful reply to the call being processed on xprt. The
+ * results encoded by xdr_results are followed by len bytes of opaque
+ * data, taken from buf or, if buf is NULL, from the pipe pipefd.
+ * If sending fails half way, the connection is shut down, as the
+ * client would not be able to find the next record.
+ */
+bool_t
+svcstream_sendreply(SVCXPRT *xprt, xdrproc_t xdr_results, caddr_t results,
+		    char *buf, int pipefd, u_int len)
+{
+	static char zero[4];
+	char hdr[SS_HDRSIZE];
+	struct rpc_msg rply;
+	struct iovec iov[3];
+	XDR xdrs;
+	u_int hlen, pad;
+	__u32 mark;
+	bool_t ok;
+
+	if (!svcstream_check(xprt))
+		return FALSE;
+
+	rply.rm_xid = ss_xid;
+	rply.rm_direction = REPLY;
+	rply.rm_reply.rp_stat = MSG_ACCEPTED;
+	rply.acpted_rply.ar_verf = xprt->xp_verf;
+	rply.acpted_rply.ar_stat = SUCCESS;
+	rply.acpted_rply.ar_results.where = results;
+	rply.acpted_rply.ar_results.proc = xdr_results;
+
+	xdrmem_create(&xdrs, hdr + 4, sizeof(hdr) - 4, XDR_ENCODE);
+	if (!xdr_replymsg(&xdrs, &rply)) {
+		XDR_DESTROY(&xdrs);
+		return FALSE;
+	}
+	hlen = XDR_GETPOS(&xdrs);
+	XDR_DESTROY(&xdrs);
+
+	pad = (4 - (len & 3)) & 3;
+	mark = htonl(LAST_FRAG | (hlen + len + pad));
+	memcpy(hdr, &mark, 4);
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hlen + 4;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	iov[2].iov_base = zero;
+	iov[2].iov_len = pad;
+
+#ifdef HAVE_SPLICE
+	if (buf == NULL) {
+		ok = svcstream_sendv(xprt->xp_sock, iov, 1, MSG_MORE)
+		    && svcstream_splice(pipefd, xprt->xp_sock, len, pad != 0)
+		    && svcstream_sendv(xprt->xp_sock, iov + 2, 1, 0);
+	} else
+#endif
+		ok = svcstream_sendv(xprt->xp_sock, iov, 3, 0);
+
+	if (!ok) {
+		dbg_printf(__FILE__, __LINE__, L_ERROR,
+			   "svcstream: cannot send reply: %s\n",
+			   strerror(errno));
+		(void) shutdown(xprt->xp_sock, SHUT_RDWR);
+	}
+	return ok;
+}
+
+/*
+ * Write all of iov to sock.
+ */
+static bool_t
+svcstream_sendv(int sock, struct iovec *iov, int cnt, int flags)
+{
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = cnt;
+	while (msg.msg_iovlen > 0) {
+		if (msg.msg_iov->iov_len == 0) {
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+			continue;
+		}
+		if ((n = sendmsg(sock, &msg, flags)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		while (n > 0 && (size_t) n >= msg.msg_iov->iov_len) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov->iov_len = 0;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (n > 0) {
+			msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+	return TRUE;
+}
+
+#ifdef HAVE_SPLICE
+/*
+ * Move len bytes from pipefd to sock.
+ */
+static bool_t
+svcstream_splice(int pipefd, int sock, u_int len, int more)
+{
+	unsigned int flags;
+	ssize_t n;
+
+	flags = SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0);
+	while (len > 0) {
+		if ((n = splice(pipefd, NULL, sock, NULL, len, flags)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		if (n == 0) {
+			errno = EPIPE;
+			return FALSE;
+		}
+		len -= n;
+	}
+	return TRUE;
+}
+#endif /* HAVE_SPLICE */
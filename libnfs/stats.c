@@ -0,0 +1,80 @@
+/*
+ * stats.c
+ *
+ * Cache statistics. Each server process keeps its counters in a file
+ * PATH_STATSDIR/<program>.<pid>.stats mapped into memory, which
+ * nfsdstat reads without disturbing the server. Until stats_init has
+ * mapped the file, and if that fails, the counters are kept in
+ * private memory.
+ *
+ * This software may be used for any purpose provided
+ * the above copyright notice is retained.  It is supplied
+ * as is, with no warranty expressed or implied.
+ */
+
+#include "system.h"
+#include "logging.h"
+#include "stats.h"
+#include <sys/mman.h>
+
+static nfs_stats_t	stats_private;
+nfs_stats_t *		nfs_stats = &stats_private;
+static char		stats_path[PATH_MAX];
+
+/*
+ * Publish the counters of this process. This must be called after
+ * the last fork, as the file is named after the pid.
+ */
+void
+stats_init(const char *progname)
+{
+	nfs_stats_t *map;
+	int fd;
+
+	stats_exit();
+	snprintf(stats_path, sizeof(stats_path), "%s/%s.%d%s",
+		 PATH_STATSDIR, progname, (int) getpid(), STATS_SUFFIX);
+	if ((fd = open(stats_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		goto failed;
+	if (ftruncate(fd, sizeof(*map)) < 0) {
+		close(fd);
+		unlink(stats_path);
+		goto failed;
+	}
+	map = (nfs_stats_t *) mmap(NULL, sizeof(*map), PROT_READ | PROT_WRITE,
+				   MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		unlink(stats_path);
+		goto failed;
+	}
+
+	/* Keep what was counted so far; the magic number goes last */
+	*map = *nfs_stats;
+	map->version = STATS_VERSION;
+	map->pid = (unsigned int) getpid();
+	strncpy(map->progname, progname, sizeof(map->progname) - 1);
+	map->progname[sizeof(map->progname) - 1] = '\0';
+	map->magic = STATS_MAGIC;
+	nfs_stats = map;
+	return;
+
+failed:
+	dbg_printf(__FILE__, __LINE__, L_WARNING,
+		   "cannot publish statistics in %s: %s\n",
+		   stats_path, strerror(errno));
+	stats_path[0] = '\0';
+}
+
+/*
+ * Remove the statistics file. The counters stay accessible.
+ */
+void
+stats_exit(void)
+{
+	if (stats_path[0] == '\0')
+		return;
+	if (nfs_stats->pid == (unsigned int) getpid())
+		unlink(stats_path);
+	stats_path[0] = '\0';
+}
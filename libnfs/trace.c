@@ -0,0 +1,137 @@
+/*
+ * trace.c
+ *
+ * Tracing of the phases of a call: decoding, authentication and
+ * file handle lookup, system calls, uid mapping, and sending the
+ * reply. Each phase is recorded with the xid of its call into a ring
+ * buffer, which threads fill without taking a lock: a slot is claimed
+ * by bumping trace_next, and marked complete by setting its sequence
+ * number last. trace_dump skips the slots being written.
+ *
+ * This software may be used for any purpose provided
+ * the above copyright notice is retained.  It is supplied
+ * as is, with no warranty expressed or implied.
+ */
+
+#include "system.h"
+#include "xmalloc.h"
+#include "trace.h"
+#ifdef HAVE_CLOCK_GETTIME
+#include <time.h>
+#endif
+
+typedef struct trace_event {
+	volatile unsigned long	seq;		/* slot number + 1 if valid */
+	const char *		name;
+	__u32			xid;
+	unsigned int		tid;
+	unsigned long long	start;		/* usecs */
+	unsigned long		dur;
+} trace_event;
+
+int				trace_enabled = 0;
+THREAD_LOCAL __u32		trace_xid = 0;
+
+static trace_event *		trace_ring = NULL;
+static unsigned long		trace_size = 0;	/* a power of two */
+static volatile unsigned long	trace_next = 0;
+static unsigned int		trace_threads = 0;
+static THREAD_LOCAL unsigned int trace_tid = 0;
+
+/*
+ * Current time in microseconds, from a clock that doesn't jump.
+ */
+unsigned long long
+latency_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (unsigned long long) ts.tv_sec * 1000000
+		    + ts.tv_nsec / 1000;
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+}
+
+/*
+ * Start tracing into a ring of at least size events.
+ */
+void
+trace_init(unsigned int size)
+{
+	if (size == 0)
+		return;
+	for (trace_size = 1; trace_size < size; trace_size <<= 1)
+		;
+	trace_ring = (trace_event *) xmalloc(trace_size * sizeof(trace_event));
+	memset(trace_ring, 0, trace_size * sizeof(trace_event));
+	trace_enabled = 1;
+}
+
+/*
+ * Record a phase of call xid that began at start and ends now.
+ */
+void
+trace_record(const char *name, __u32 xid, unsigned long long start)
+{
+	unsigned long long now = latency_now();
+	trace_event *ev;
+	unsigned long n;
+
+	if (trace_ring == NULL)
+		return;
+	if (trace_tid == 0)
+		trace_tid = __sync_add_and_fetch(&trace_threads, 1);
+
+	n = __sync_fetch_and_add(&trace_next, 1);
+	ev = &trace_ring[n & (trace_size - 1)];
+	ev->seq = 0;
+	__sync_synchronize();
+	ev->name = name;
+	ev->xid = xid;
+	ev->tid = trace_tid;
+	ev->start = start;
+	ev->dur = (now > start) ? (unsigned long) (now - start) : 0;
+	__sync_synchronize();
+	ev->seq = n + 1;
+}
+
+/*
+ * Write the events in the ring as a Chrome trace, oldest first.
+ */
+void
+trace_dump(FILE *fp)
+{
+	unsigned long n, end;
+	trace_event ev;
+	int pid = (int) getpid();
+	int first = 1;
+
+	fprintf(fp, "{\"traceEvents\":[");
+	end = trace_next;
+	n = (end > trace_size) ? end - trace_size : 0;
+	for (; trace_ring != NULL && n < end; n++) {
+		trace_event *ep = &trace_ring[n & (trace_size - 1)];
+
+		if (ep->seq != n + 1)
+			continue;
+		__sync_synchronize();
+		ev = *ep;
+		__sync_synchronize();
+		if (ep->seq != n + 1)
+			continue;	/* overwritten meanwhile */
+		fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"nfs\",\"ph\":\"X\","
+			"\"ts\":%llu,\"dur\":%lu,\"pid\":%d,\"tid\":%u,"
+			"\"args\":{\"xid\":\"%08x\"}}",
+			first ? "" : ",", ev.name, ev.start, ev.dur, pid,
+			ev.tid, (unsigned int) ev.xid);
+		first = 0;
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+}
@@ -0,0 +1,358 @@
+/*
+ * xferlog.c
+ *
+ * The transfer log. The bytes read and written are added up in the
+ * fh cache entry of a file while nfsd keeps it open, and a single
+ * record is logged when the file is closed, or when another client
+ * or user starts using it. Records go to syslog, or are collected in a buffer
+ * that is written to the log file in batches, as text, JSON lines or
+ * binary records. Once the file reaches its maximum size, it is
+ * rotated, keeping XFERLOG_KEEP old files.
+ *
+ * All of this runs under the nfsd lock, like the fh cache.
+ *
+ * This software may be used for any purpose provided
+ * the above copyright notice is retained.  It is supplied
+ * as is, with no warranty expressed or implied.
+ */
+
+#include "system.h"
+#include "xmalloc.h"
+#include "mount.h"
+#include "nfs_prot.h"
+#include "auth.h"
+#include "fhandle.h"
+#include "logging.h"
+#include "xferlog.h"
+#ifdef HAVE_SYSLOG_H
+#include <syslog.h>
+#endif
+#include <time.h>
+
+/* Room needed for a record: a JSON escape takes up to 6 bytes */
+#define XFERLOG_RECMAX	(6 * PATH_MAX + 512)
+
+int			xferlog_enabled = 0;
+
+static int		xfer_format = XFERLOG_SYSLOG;
+static char *		xfer_path = NULL;
+static int		xfer_fd = -1;
+static dev_t		xfer_dev;
+static ino_t		xfer_ino;
+static off_t		xfer_size = 0;
+static unsigned long	xfer_maxsize = 0;	/* 0 if never rotated */
+static char		xfer_buf[XFERLOG_BUFSIZE];
+static size_t		xfer_len = 0;
+static time_t		xfer_flushed = 0;
+static int		xfer_failed = 0;
+
+static struct {
+	const char *	name;
+	int		format;
+} xfer_formats[] = {
+	{ "syslog",	XFERLOG_SYSLOG	},
+	{ "text",	XFERLOG_TEXT	},
+	{ "json",	XFERLOG_JSON	},
+	{ "binary",	XFERLOG_BINARY	},
+	{ NULL,		-1		}
+};
+
+static int		xfer_reopen(void);
+static void		xfer_rotate(void);
+static size_t		xfer_escape(char *buf, size_t size, const char *s);
+
+/*
+ * Look up a format by name.
+ */
+int
+xferlog_format(const char *name)
+{
+	int i;
+
+	for (i = 0; xfer_formats[i].name != NULL; i++) {
+		if (!strcmp(xfer_formats[i].name, name))
+			return xfer_formats[i].format;
+	}
+	return -1;
+}
+
+/*
+ * Start logging transfers to path, or to syslog if path is NULL.
+ * maxsize is the size in bytes at which the file is rotated.
+ */
+int
+xferlog_open(const char *path, int format, unsigned long maxsize)
+{
+	if (path == NULL || format == XFERLOG_SYSLOG) {
+		xfer_format = XFERLOG_SYSLOG;
+		xferlog_enabled = 1;
+		return 0;
+	}
+	xfer_path = xstrdup(path);
+	xfer_format = format;
+	xfer_maxsize = maxsize;
+	if (xfer_reopen() < 0)
+		return -1;
+	xferlog_enabled = 1;
+	return 0;
+}
+
+/*
+ * Add a READ or WRITE of count bytes from addr to the transfer of
+ * fhc. A client or user other than the one the transfer is for starts
+ * a new record, as users share the fd of a file.
+ */
+void
+xferlog_account(fhcache *fhc, struct in_addr addr, int write,
+		unsigned int count)
+{
+	if (fhc->xfer_first.tv_sec != 0
+	    && (fhc->xfer_addr.s_addr != addr.s_addr
+		|| fhc->xfer_uid != auth_uid))
+		xferlog_done(fhc);
+
+	gettimeofday(&fhc->xfer_last, NULL);
+	if (fhc->xfer_first.tv_sec == 0) {
+		fhc->xfer_first = fhc->xfer_last;
+		fhc->xfer_read = fhc->xfer_written = 0;
+		fhc->xfer_reads = fhc->xfer_writes = 0;
+		fhc->xfer_addr = addr;
+		fhc->xfer_uid = auth_uid;
+	}
+	if (write) {
+		fhc->xfer_written += count;
+		fhc->xfer_writes++;
+	} else {
+		fhc->xfer_read += count;
+		fhc->xfer_reads++;
+	}
+}
+
+/*
+ * Log the transfer of fhc, and start over.
+ */
+void
+xferlog_done(fhcache *fhc)
+{
+	const char *path = fhc_path(fhc) ? fhc->path : "<unnamed>";
+	const char *dir;
+	char when[32], *bp;
+	unsigned long msecs;
+	struct tm tmbuf;
+	time_t start;
+	size_t room, n;
+
+	start = fhc->xfer_first.tv_sec;
+	fhc->xfer_first.tv_sec = 0;
+	if (!xferlog_enabled)
+		return;
+
+	msecs = (fhc->xfer_last.tv_sec - start) * 1000
+		+ fhc->xfer_last.tv_usec / 1000
+		- fhc->xfer_first.tv_usec / 1000;
+	if (fhc->xfer_reads && fhc->xfer_writes)
+		dir = "<>";
+	else
+		dir = fhc->xfer_writes ? ">" : "<";
+
+	if (xfer_format == XFERLOG_SYSLOG) {
+#ifdef HAVE_SYSLOG_H
+		syslog(LOG_INFO, "%s %s %s %llu %llu %lu.%03lu",
+		       inet_ntoa(fhc->xfer_addr), dir, path,
+		       fhc->xfer_read, fhc->xfer_written,
+		       msecs / 1000, msecs % 1000);
+#endif
+		return;
+	}
+
+	if (sizeof(xfer_buf) - xfer_len < XFERLOG_RECMAX)
+		xferlog_flush();
+	bp = xfer_buf + xfer_len;
+	room = sizeof(xfer_buf) - xfer_len;
+
+	if (xfer_format == XFERLOG_BINARY) {
+		xferlog_binrec rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.start = (unsigned int) start;
+		rec.duration = (unsigned int) msecs;
+		rec.addr = fhc->xfer_addr.s_addr;
+		rec.uid = (unsigned int) fhc->xfer_uid;
+		rec.bytes_read = fhc->xfer_read;
+		rec.bytes_written = fhc->xfer_written;
+		rec.reads = fhc->xfer_reads;
+		rec.writes = fhc->xfer_writes;
+		rec.pathlen = strlen(path);
+		if (rec.pathlen > room - sizeof(rec))
+			rec.pathlen = room - sizeof(rec);
+		memcpy(bp, &rec, sizeof(rec));
+		memcpy(bp + sizeof(rec), path, rec.pathlen);
+		xfer_len += sizeof(rec) + rec.pathlen;
+	} else {
+		strftime(when, sizeof(when), xfer_format == XFERLOG_JSON
+			 ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S",
+			 localtime_r(&start, &tmbuf));
+		if (xfer_format == XFERLOG_JSON) {
+			n = snprintf(bp, room, "{\"start\":\"%s\","
+				     "\"duration\":%lu.%03lu,\"client\":\"%s\","
+				     "\"uid\":%d,\"read\":%llu,\"written\":%llu,"
+				     "\"reads\":%u,\"writes\":%u,\"path\":\"",
+				     when, msecs / 1000, msecs % 1000,
+				     inet_ntoa(fhc->xfer_addr),
+				     (int) fhc->xfer_uid, fhc->xfer_read,
+				     fhc->xfer_written, fhc->xfer_reads,
+				     fhc->xfer_writes);
+			n += xfer_escape(bp + n, room - n - 3, path);
+			n += snprintf(bp + n, room - n, "\"}\n");
+		} else {
+			n = snprintf(bp, room, "%s %lu.%03lu %s %s %llu %llu "
+				     "%u %u %d %s\n",
+				     when, msecs / 1000, msecs % 1000,
+				     inet_ntoa(fhc->xfer_addr), dir,
+				     fhc->xfer_read, fhc->xfer_written,
+				     fhc->xfer_reads, fhc->xfer_writes,
+				     (int) fhc->xfer_uid, path);
+		}
+		xfer_len += (n < room) ? n : room - 1;
+	}
+
+	/* Don't let the file grow much beyond its maximum size */
+	if (time(NULL) - xfer_flushed >= XFERLOG_FLUSH_INTERVAL
+	    || (xfer_maxsize != 0
+		&& (unsigned long) xfer_size + xfer_len >= xfer_maxsize))
+		xferlog_flush();
+}
+
+/*
+ * Write out the records collected so far.
+ */
+void
+xferlog_flush(void)
+{
+	struct stat sb;
+	size_t done = 0;
+	ssize_t n;
+
+	if (xfer_len == 0)
+		return;
+	xfer_flushed = time(NULL);
+
+	/* The file may have been rotated by another server, or removed */
+	if (xfer_fd < 0 || stat(xfer_path, &sb) < 0
+	    || sb.st_dev != xfer_dev || sb.st_ino != xfer_ino)
+		(void) xfer_reopen();
+	if (xfer_fd < 0) {
+		xfer_len = 0;
+		return;
+	}
+
+	while (done < xfer_len) {
+		if ((n = write(xfer_fd, xfer_buf + done, xfer_len - done)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!xfer_failed++)
+				dbg_printf(__FILE__, __LINE__, L_ERROR,
+					   "cannot write %s: %s\n",
+					   xfer_path, strerror(errno));
+			break;
+		}
+		done += n;
+	}
+	if (done == xfer_len)
+		xfer_failed = 0;
+	xfer_size += done;
+	xfer_len = 0;
+	if (xfer_maxsize != 0 && (unsigned long) xfer_size >= xfer_maxsize)
+		xfer_rotate();
+}
+
+/*
+ * Write out what's left before exiting.
+ */
+void
+xferlog_close(void)
+{
+	xferlog_flush();
+	if (xfer_fd >= 0) {
+		close(xfer_fd);
+		xfer_fd = -1;
+	}
+	xferlog_enabled = 0;
+}
+
+/*
+ * (Re)open the log file, and start it with a header if it's new
+ * and binary.
+ */
+static int
+xfer_reopen(void)
+{
+	xferlog_header hdr;
+	struct stat sb;
+
+	if (xfer_fd >= 0)
+		close(xfer_fd);
+	xfer_fd = open(xfer_path, O_WRONLY | O_APPEND | O_CREAT, 0640);
+	if (xfer_fd < 0 || fstat(xfer_fd, &sb) < 0) {
+		dbg_printf(__FILE__, __LINE__, L_ERROR, "cannot open %s: %s\n",
+			   xfer_path, strerror(errno));
+		if (xfer_fd >= 0)
+			close(xfer_fd);
+		xfer_fd = -1;
+		return -1;
+	}
+	xfer_dev = sb.st_dev;
+	xfer_ino = sb.st_ino;
+	xfer_size = sb.st_size;
+	if (xfer_format == XFERLOG_BINARY && xfer_size == 0) {
+		hdr.magic = XFERLOG_MAGIC;
+		hdr.version = XFERLOG_VERSION;
+		if (write(xfer_fd, &hdr, sizeof(hdr)) == sizeof(hdr))
+			xfer_size = sizeof(hdr);
+	}
+	return 0;
+}
+
+/*
+ * Shift the old files up by one, and start a new one.
+ */
+static void
+xfer_rotate(void)
+{
+	char from[PATH_MAX + 16], to[PATH_MAX + 16];
+	int i;
+
+	for (i = XFERLOG_KEEP - 1; i > 0; i--) {
+		snprintf(from, sizeof(from), "%s.%d", xfer_path, i);
+		snprintf(to, sizeof(to), "%s.%d", xfer_path, i + 1);
+		(void) rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.1", xfer_path);
+	if (rename(xfer_path, to) < 0)
+		dbg_printf(__FILE__, __LINE__, L_ERROR, "cannot rotate %s: %s\n",
+			   xfer_path, strerror(errno));
+	(void) xfer_reopen();
+}
+
+/*
+ * Copy s into buf as the contents of a JSON string.
+ */
+static size_t
+xfer_escape(char *buf, size_t size, const char *s)
+{
+	size_t n = 0;
+	unsigned char c;
+
+	for (; (c = (unsigned char) *s) != '\0' && n + 7 < size; s++) {
+		if (c == '"' || c == '\\') {
+			buf[n++] = '\\';
+			buf[n++] = c;
+		} else if (c < 0x20) {
+			n += sprintf(buf + n, "\\u%04x", c);
+		} else {
+			buf[n++] = c;
+		}
+	}
+	buf[n] = '\0';
+	return n;
+}
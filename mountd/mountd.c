@@ -24,6 +24,7 @@
 #include "haccess.h"
 #include "failsafe.h"
 #include "signals.h"
+#include "stats.h"
 #include <rpc/pmap_clnt.h>
 #include "xrealpath.h"
 
@@ -224,6 +225,9 @@ main(int argc, char **argv)
 		failsafe(failsafe_level, 1);
 	}
 
+	/* Publish the cache statistics */
+	stats_init("mountd");
+
 	/* Enable the LOG toggle with a signal. */
 	install_signal_handler(SIGUSR1, log_toggle);
 
@@ -235,9 +239,9 @@ main(int argc, char **argv)
 
 	atexit(terminate);
 
-	svc_run();
+	rpc_run();
 
-	dbg_printf(__FILE__, __LINE__, L_ERROR, "svc_run() returned\n");
+	dbg_printf(__FILE__, __LINE__, L_ERROR, "rpc_run() returned\n");
 
 	exit(1);
 }
@@ -265,6 +269,7 @@ static void
 terminate(void)
 {
 	rpc_exit(MOUNTPROG, mountd_versions);
+	stats_exit();
 }
 
 RETSIGTYPE
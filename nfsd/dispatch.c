@@ -16,14 +16,24 @@
 #include "nfsd.h"
 #include "nfs_prot.h"
 #include "rpcmisc.h"
+#include "probes.h"
+#include "stats.h"
+#ifdef ENABLE_WORKER_THREADS
+#include <pthread.h>
+#endif
 
 #include "nfs_prot_xdr.c"
 
 /*
  * These are the global variables that hold all argument and result data.
  */
-union argument_types argument;
-union result_types result;
+THREAD_LOCAL union argument_types argument;
+THREAD_LOCAL union result_types result;
+
+#ifdef ENABLE_WORKER_THREADS
+/* The queued call being executed by this worker */
+THREAD_LOCAL nfs_request *nfsd_request_current = NULL;
+#endif
 
 /*
  * The time at which we received the request.
@@ -102,51 +112,482 @@ static struct dispatch_entry dtable[] = {
 	table_ent(statfsres, nfs_fh, statfs),  /* STATFS */
 };
 
+#define PATH_LATENCY	"/tmp/nfsd.latency"
+#define PATH_TRACE	"/tmp/nfsd.trace.json"
+
 #ifdef ENABLE_CALL_PROFILING
 #define PATH_PROFILE	"/tmp/nfsd.profile"
 
-static struct timeval rtimes[18] = {
-	{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0},
-	{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0},
-	{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}
+static unsigned long long rtimes[18] = {	/* usecs */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 };
 
 static int calls[18] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 };
 
-static struct timeval t0, t1;
+static unsigned int syscalls[18] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static unsigned int attrhits[18] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static unsigned int drchits[18] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+THREAD_LOCAL unsigned int nfsd_syscalls = 0;
 
 #endif /* ENABLE_CALL_PROFILING */
 
+/*
+ * Duplicate request cache. A retransmitted call that changes something
+ * is not executed again, which would do the work twice (WRITE) or fail
+ * because it has been done already (CREATE, REMOVE, RENAME...). If the
+ * original call has completed, its reply is sent again, otherwise the
+ * retransmission is dropped and the original reply will do.
+ */
+#define DRC_SIZE	1024
+#define DRC_HASH	256
+
+typedef struct drc_key {
+	struct in_addr		addr;
+	in_port_t		port;
+	__u32			xid;
+	unsigned long		proc;
+} drc_key;
+
+typedef struct drc_entry {
+	struct drc_entry *	hash_next;
+	struct drc_entry *	lru_prev;	/* towards more recent */
+	struct drc_entry *	lru_next;
+	drc_key			key;
+	int			done;
+	union result_types	result;
+} drc_entry;
+
+static drc_entry	drc_entries[DRC_SIZE];
+static drc_entry *	drc_hash[DRC_HASH];
+static drc_entry *	drc_lru_head = NULL;	/* most recently used */
+static drc_entry *	drc_lru_tail = NULL;
+static int		drc_used = 0;
+
+#ifdef ENABLE_WORKER_THREADS
+static pthread_mutex_t	drc_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define drc_lock()	pthread_mutex_lock(&drc_mutex)
+#define drc_unlock()	pthread_mutex_unlock(&drc_mutex)
+#else
+#define drc_lock()	/* nothing */
+#define drc_unlock()	/* nothing */
+#endif
+
+static int drc_key_make(drc_key *key, unsigned long proc, SVCXPRT *transp,
+			rpc_defer *rd);
+static int drc_check(drc_key *key, SVCXPRT *transp,
+		     struct dispatch_entry *dent);
+static void drc_done(drc_key *key, union result_types *res);
+
+static void nfs_call(struct dispatch_entry *dent, unsigned long proc_index,
+		     struct svc_req *rqstp, union argument_types *argp);
+static void nfs_dispatch_done(void);
+static volatile int need_dump = 0;	/* SIGUSR2 handling */
+static bool_t nfs_sendreply_read(SVCXPRT * transp, rpc_defer * rd);
+static __u32 nfs_xid(SVCXPRT * transp);
+
 /*
  * The main dispatch routine.
  */
 void
 nfs_dispatch(struct svc_req *rqstp, SVCXPRT * transp)
 {
+	unsigned long long start = latency_now();
 	unsigned long proc_index = rqstp->rq_proc;
 	struct dispatch_entry *dent;
+	unsigned long long t;
+	drc_key key;
+	int cached;
 
-	_rpcsvcdirty = 1;
+	if (proc_index >= (sizeof(dtable) / sizeof(dtable[0]))) {
+		svcerr_noproc(transp);
+		return;
+	}
 
+	dent = &dtable[proc_index];
+
+#ifdef ENABLE_WORKER_THREADS
 	/*
-	 * Reset our credentials to some sane default.
-	 * Root privs will be needed in auth_fh/fh_find in order 
-	 * to successfully stat() existing file handles
+	 * Hand UDP calls to a worker thread. The arguments are decoded
+	 * here, because the transport buffer is reused for the next call.
+	 * Anything we can't defer (TCP) is processed right away.
 	 */
+	if (nfsd_nworkers > 0) {
+		nfs_request *req;
+
+		if ((req = nfsd_request_alloc(rqstp, transp)) != NULL) {
+			req->start = start;
+			trace_xid = req->reply.rd_xid;
+			PROBE3(call_start, trace_xid, proc_index,
+			       req->reply.rd_addr.sin_addr.s_addr);
+			t = TRACE_BEGIN();
+			memset(&req->argument, 0, dent->arg_size);
+			if (!svc_getargs(transp, (xdrproc_t) dent->xdr_argument,
+					 (caddr_t) &req->argument)) {
+				svcerr_decode(transp);
+				nfsd_request_free(req);
+				return;
+			}
+			TRACE_END("decode", t);
+			if (drc_key_make(&key, proc_index, NULL, &req->reply)
+			    && drc_check(&key, transp, dent)) {
+				xdr_free(dent->xdr_argument,
+					 (char *) &req->argument);
+				nfsd_request_free(req);
+				return;
+			}
+			nfsd_request_queue(req);
+			return;
+		}
+	}
+#endif /* ENABLE_WORKER_THREADS */
 
-	auth_override_uid(root_uid);
+	nfsd_lock();
+	if (!_rpcsvcthreaded) {
+		_rpcsvcdirty = 1;
+	}
+	trace_xid = nfs_xid(transp);
+	PROBE3(call_start, trace_xid, proc_index,
+	       svc_getcaller(transp)->sin_addr.s_addr);
 
-	if (proc_index >= (sizeof(dtable) / sizeof(dtable[0]))) {
-		svcerr_noproc(transp);
+	t = TRACE_BEGIN();
+	memset(&argument, 0, dent->arg_size);
+	if (!svc_getargs(transp, (xdrproc_t) dent->xdr_argument, &argument)) {
+		svcerr_decode(transp);
 		goto done;
 	}
+	TRACE_END("decode", t);
 
-	dent = &dtable[proc_index];
+	cached = drc_key_make(&key, proc_index, transp, NULL);
+	if (cached && drc_check(&key, transp, dent))
+		goto free;
+
+	nfs_call(dent, proc_index, rqstp, &argument);
+	if (cached)
+		drc_done(&key, &result);
+
+#if 0
+	/* FIXME : either fix this, or pull it out. */
+	if (!svc_sendreply(transp, dent->xdr_result, (caddr_t) & result)) {
+		svcerr_systemerr(transp);
+	}
+#else
+	t = TRACE_BEGIN();
+	if (proc_index == NFSPROC_READ && result.nfsstat == NFS_OK) {
+		nfs_sendreply_read(transp, NULL);
+	} else {
+		svc_sendreply(transp, dent->xdr_result, (caddr_t) & result);
+	}
+	TRACE_END("send", t);
+#endif
+	latency_record(proc_index, svc_getcaller(transp)->sin_addr,
+		       result.nfsstat != NFS_OK, start);
+	TRACE_END(dent->name, t ? start : 0);
+	PROBE4(call_done, trace_xid, proc_index, result.nfsstat, dent->name);
+
+      free:
+	if (!svc_freeargs(transp, (xdrproc_t) dent->xdr_argument, &argument)) {
+		dbg_printf(__FILE__, __LINE__, L_ERROR,
+			   "unable to free RPC arguments, exiting\n");
+		exit(1);
+	}
+
+      done:
+	if (!_rpcsvcthreaded) {
+		_rpcsvcdirty = 0;
+	}
+	nfs_dispatch_done();
+	nfsd_unlock();
+}
+
+#ifdef ENABLE_WORKER_THREADS
+/*
+ * The reply to a call done along with others: the shared one, unless
+ * it is a batched WRITE that failed on its own (see write_batch).
+ */
+static union result_types *
+batch_result(nfs_request *req, union result_types *failed)
+{
+	if (req->status == NFS_OK)
+		return &result;
+	failed->attrstat.status = req->status;
+	return failed;
+}
+
+/*
+ * Process a call queued by nfs_dispatch. This runs in a worker thread.
+ */
+void
+nfs_dispatch_request(nfs_request *req)
+{
+	struct dispatch_entry *dent = &dtable[req->rqst.rq_proc];
+	union result_types failed;
+	nfs_request *next;
+	unsigned long long t;
+	drc_key key;
+
+	trace_xid = req->reply.rd_xid;
+	TRACE_END("queue", trace_enabled ? req->start : 0);
+
+	nfsd_lock();
+	nfsd_request_current = req;
+	nfs_call(dent, req->rqst.rq_proc, &req->rqst, &req->argument);
+	nfsd_request_current = NULL;
+	for (next = req; next != NULL; next = next->batch) {
+		if (drc_key_make(&key, req->rqst.rq_proc, NULL, &next->reply))
+			drc_done(&key, batch_result(next, &failed));
+	}
+#ifdef ENABLE_CALL_PROFILING
+	for (next = req->batch; next != NULL; next = next->batch)
+		calls[req->rqst.rq_proc]++;
+#endif
+	nfs_dispatch_done();
+	nfsd_unlock();
+
+	/* The result lives in thread-local storage */
+	t = TRACE_BEGIN();
+	if (req->rqst.rq_proc == NFSPROC_READ && result.nfsstat == NFS_OK) {
+		nfs_sendreply_read(NULL, &req->reply);
+	} else {
+		svcdgram_sendreply(&req->reply, dent->xdr_result,
+				   (caddr_t) & result);
+	}
+	TRACE_END("send", t);
+	latency_record(req->rqst.rq_proc, req->reply.rd_addr.sin_addr,
+		       result.nfsstat != NFS_OK, req->start);
+	TRACE_END(dent->name, t ? req->start : 0);
+	PROBE4(call_done, req->reply.rd_xid, req->rqst.rq_proc,
+	       result.nfsstat, dent->name);
+	xdr_free(dent->xdr_argument, (char *) &req->argument);
+
+	/* WRITEs done along with this one get the same reply, unless
+	 * they failed on their own (see write_batch) */
+	while ((next = req->batch) != NULL) {
+		union result_types *res = batch_result(next, &failed);
+		nfsstat status = res->nfsstat;
+
+		req->batch = next->batch;
+		svcdgram_sendreply(&next->reply, dent->xdr_result,
+				   (caddr_t) res);
+		latency_record(next->rqst.rq_proc, next->reply.rd_addr.sin_addr,
+			       status != NFS_OK, next->start);
+		if (t)
+			trace_record(dent->name, next->reply.rd_xid,
+				     next->start);
+		PROBE4(call_done, next->reply.rd_xid, next->rqst.rq_proc,
+		       status, dent->name);
+		xdr_free(dent->xdr_argument, (char *) &next->argument);
+		nfsd_request_free(next);
+	}
+}
+#endif /* ENABLE_WORKER_THREADS */
+
+/*
+ * Build the duplicate request cache key of a call, from the deferred
+ * reply rd or else from the transport. Returns 0 if the call does not
+ * need to be cached, or if we can't tell its xid.
+ */
+static int
+drc_key_make(drc_key *key, unsigned long proc, SVCXPRT *transp,
+	     rpc_defer *rd)
+{
+	rpc_defer rdbuf;
+
+	switch (proc) {
+	case NFSPROC_SETATTR:
+	case NFSPROC_WRITE:
+	case NFSPROC_CREATE:
+	case NFSPROC_REMOVE:
+	case NFSPROC_RENAME:
+	case NFSPROC_LINK:
+	case NFSPROC_SYMLINK:
+	case NFSPROC_MKDIR:
+	case NFSPROC_RMDIR:
+		break;
+	default:
+		return 0;
+	}
+
+	if (rd == NULL) {
+		if (svcstream_xid(transp, &key->xid)) {
+			key->addr = svc_getcaller(transp)->sin_addr;
+			key->port = svc_getcaller(transp)->sin_port;
+			key->proc = proc;
+			return 1;
+		}
+		if (!svcdgram_defer(transp, &rdbuf))
+			return 0;
+		rd = &rdbuf;
+	}
+	key->addr = rd->rd_addr.sin_addr;
+	key->port = rd->rd_addr.sin_port;
+	key->xid = rd->rd_xid;
+	key->proc = proc;
+	return 1;
+}
+
+static drc_entry **
+drc_bucket(drc_key *key)
+{
+	return &drc_hash[(key->xid ^ key->addr.s_addr ^ key->port) % DRC_HASH];
+}
+
+static drc_entry *
+drc_lookup(drc_key *key)
+{
+	drc_entry *ep;
+
+	for (ep = *drc_bucket(key); ep != NULL; ep = ep->hash_next) {
+		if (ep->key.xid == key->xid
+		    && ep->key.addr.s_addr == key->addr.s_addr
+		    && ep->key.port == key->port
+		    && ep->key.proc == key->proc)
+			return ep;
+	}
+	return NULL;
+}
+
+static void
+drc_lru_unlink(drc_entry *ep)
+{
+	if (ep->lru_prev != NULL)
+		ep->lru_prev->lru_next = ep->lru_next;
+	else
+		drc_lru_head = ep->lru_next;
+	if (ep->lru_next != NULL)
+		ep->lru_next->lru_prev = ep->lru_prev;
+	else
+		drc_lru_tail = ep->lru_prev;
+}
+
+static void
+drc_lru_push(drc_entry *ep)
+{
+	ep->lru_prev = NULL;
+	if ((ep->lru_next = drc_lru_head) != NULL)
+		drc_lru_head->lru_prev = ep;
+	else
+		drc_lru_tail = ep;
+	drc_lru_head = ep;
+}
+
+/*
+ * Get an entry for a new call: an unused one, or else the least
+ * recently used one that is done. Returns NULL if all are in progress.
+ */
+static drc_entry *
+drc_alloc(void)
+{
+	drc_entry *ep, **pp;
+
+	if (drc_used < DRC_SIZE)
+		return &drc_entries[drc_used++];
+
+	for (ep = drc_lru_tail; ep != NULL && !ep->done; ep = ep->lru_prev)
+		;
+	if (ep == NULL)
+		return NULL;
+	for (pp = drc_bucket(&ep->key); *pp != ep; pp = &(*pp)->hash_next)
+		;
+	*pp = ep->hash_next;
+	drc_lru_unlink(ep);
+	return ep;
+}
+
+/*
+ * Look for a call in the duplicate request cache. If it is a
+ * retransmission, deal with it and return 1. Otherwise, remember the
+ * call as being in progress and return 0.
+ */
+static int
+drc_check(drc_key *key, SVCXPRT *transp, struct dispatch_entry *dent)
+{
+	union result_types res;
+	drc_entry *ep;
+	int done;
+
+	drc_lock();
+	if ((ep = drc_lookup(key)) == NULL) {
+		if ((ep = drc_alloc()) != NULL) {
+			ep->key = *key;
+			ep->done = 0;
+			ep->hash_next = *drc_bucket(key);
+			*drc_bucket(key) = ep;
+			drc_lru_push(ep);
+		}
+		drc_unlock();
+		return 0;
+	}
 
+	drc_lru_unlink(ep);
+	drc_lru_push(ep);
+	if ((done = ep->done) != 0)
+		memcpy(&res, &ep->result, dent->res_size);
 #ifdef ENABLE_CALL_PROFILING
-	gettimeofday(&t0, NULL);
+	drchits[key->proc]++;
+#endif
+	stats_inc(drc_hits);
+	drc_unlock();
+
+	if (log_level_enabled(D_CALL)) {
+		dbg_printf(__FILE__, __LINE__, D_CALL,
+			   "%s: xid %08x is a retransmission, %s\n",
+			   dent->name, (unsigned int) key->xid,
+			   done ? "replaying reply" : "still in progress");
+	}
+	if (done)
+		svc_sendreply(transp, dent->xdr_result, (caddr_t) &res);
+	return 1;
+}
+
+/*
+ * Remember the reply res to a call.
+ */
+static void
+drc_done(drc_key *key, union result_types *res)
+{
+	drc_entry *ep;
+
+	drc_lock();
+	if ((ep = drc_lookup(key)) != NULL) {
+		memcpy(&ep->result, res, dtable[key->proc].res_size);
+		ep->done = 1;
+	}
+	drc_unlock();
+}
+
+/*
+ * Execute an NFS procedure and leave its reply in result.
+ * The caller holds the nfsd lock.
+ */
+static void
+nfs_call(struct dispatch_entry *dent, unsigned long proc_index,
+	 struct svc_req *rqstp, union argument_types *argp)
+{
+#ifdef ENABLE_CALL_PROFILING
+	unsigned long long t0;
+#endif /* ENABLE_CALL_PROFILING */
+
+	/*
+	 * Reset our credentials to some sane default.
+	 * Root privs will be needed in auth_fh/fh_find in order 
+	 * to successfully stat() existing file handles
+	 */
+
+	auth_override_uid(root_uid);
+
+#ifdef ENABLE_CALL_PROFILING
+	t0 = latency_now();
 #endif /* ENABLE_CALL_PROFILING */
 
 	/*
@@ -156,12 +597,6 @@ nfs_dispatch(struct svc_req *rqstp, SVCXPRT * transp)
 
 	nfsclient = NULL;
 
-	memset(&argument, 0, dent->arg_size);
-	if (!svc_getargs(transp, (xdrproc_t) dent->xdr_argument, &argument)) {
-		svcerr_decode(transp);
-		goto done;
-	}
-
 	/* Clear the result structure. */
 	memset(&result, 0, dent->res_size);
 
@@ -171,50 +606,96 @@ nfs_dispatch(struct svc_req *rqstp, SVCXPRT * transp)
 	 */
 
 	if (log_level_enabled(D_CALL)) {
-		log_call(__FILE__, __LINE__, rqstp, dent->name, dent->log_print(&argument));
+		log_call(__FILE__, __LINE__, rqstp, dent->name, dent->log_print(argp));
 	}
 
 	/* Do the function call itself. */
 	nfs_dispatch_time = time(NULL);
-	result.nfsstat = (*dent->funct) (&argument, rqstp);
+	fh_attr_begin();
+	result.nfsstat = (*dent->funct) (argp, rqstp);
 
 	if (log_level_enabled(D_CALL)) {
 		dbg_printf(__FILE__, __LINE__, D_CALL, "result: %d\n", result.nfsstat);
 	}
 
-#if 0
-	/* FIXME : either fix this, or pull it out. */
-	if (!svc_sendreply(transp, dent->xdr_result, (caddr_t) & result)) {
-		svcerr_systemerr(transp);
-	}
-#else
-	svc_sendreply(transp, dent->xdr_result, (caddr_t) & result);
-#endif
+#ifdef ENABLE_CALL_PROFILING
+	rtimes[proc_index] += latency_now() - t0;
+	calls[proc_index]++;
+	syscalls[proc_index] += nfsd_syscalls;
+	nfsd_syscalls = 0;
+	attrhits[proc_index] += fh_attr_hits;
+	fh_attr_hits = 0;
+#endif /* ENABLE_CALL_PROFILING */
+}
 
-	if (!svc_freeargs(transp, (xdrproc_t) dent->xdr_argument, &argument)) {
-		dbg_printf(__FILE__, __LINE__, L_ERROR,
-			   "unable to free RPC arguments, exiting\n");
-		exit(1);
-	}
+/*
+ * Encode a READ reply up to and including the length of the data.
+ */
+static bool_t
+xdr_readres_head(XDR * xdrs, readres * objp)
+{
+	readokres *res = &objp->readres_u.reply;
 
-#ifdef ENABLE_CALL_PROFILING
-	gettimeofday(&t1, NULL);
+	return xdr_nfsstat(xdrs, &objp->status)
+	    && xdr_fattr(xdrs, &res->attributes)
+	    && xdr_u_int(xdrs, &res->data.data_len);
+}
 
-	if (t1.tv_usec < t0.tv_usec) {
-		rtimes[proc_index].tv_sec += t1.tv_sec - t0.tv_sec - 1;
-		rtimes[proc_index].tv_usec +=
-			1000000 + t1.tv_usec - t0.tv_usec;
-	} else {
-		rtimes[proc_index].tv_sec += t1.tv_sec - t0.tv_sec;
-		rtimes[proc_index].tv_usec += t1.tv_usec - t0.tv_usec;
+/*
+ * Send the reply to a successful READ, either to the call on transp or
+ * to the deferred UDP call rd. Only the header goes through XDR; the
+ * data is passed to the socket from where nfsd_nfsproc_read_2 left it,
+ * which is read_pipe if data_val is NULL.
+ */
+static bool_t
+nfs_sendreply_read(SVCXPRT * transp, rpc_defer * rd)
+{
+	readokres *res = &result.readres.readres_u.reply;
+	rpc_defer rdbuf;
+	bool_t ok;
+
+	if (rd == NULL && svcstream_check(transp)) {
+		ok = svcstream_sendreply(transp, (xdrproc_t) xdr_readres_head,
+					 (caddr_t) & result, res->data.data_val,
+					 read_pipe[0], res->data.data_len);
+		if (ok && res->data.data_val == NULL) {
+			read_pipe_len = 0;
+		}
+		return ok;
 	}
 
-	calls[proc_index]++;
-#endif /* ENABLE_CALL_PROFILING */
+	if (rd == NULL && svcdgram_defer(transp, &rdbuf)) {
+		rd = &rdbuf;
+	}
+	if (rd != NULL) {
+		return svcdgram_senddata(rd, (xdrproc_t) xdr_readres_head,
+					 (caddr_t) & result,
+					 res->data.data_val,
+					 res->data.data_len);
+	}
+	return svc_sendreply(transp, (xdrproc_t) xdr_readres,
+			     (caddr_t) & result);
+}
 
-      done:
-	_rpcsvcdirty = 0;
+/*
+ * The xid of the call on transp, for tracing.
+ */
+static __u32
+nfs_xid(SVCXPRT * transp)
+{
+	__u32 xid;
 
+	if (svcstream_xid(transp, &xid) || svcdgram_xid(transp, &xid))
+		return xid;
+	return 0;
+}
+
+/*
+ * Catch up on signals that arrived while we were busy.
+ */
+static void
+nfs_dispatch_done(void)
+{
 	if (nfsd_need_reinit()) {
 		nfsd_reinitialize(0);
 	}
@@ -222,39 +703,118 @@ nfs_dispatch(struct svc_req *rqstp, SVCXPRT * transp)
 	if (fh_need_flush()) {
 		fh_flush_cache(0);
 	}
+
+	if (need_dump) {
+		dump_stats(0);
+	}
 }
 
-#ifdef ENABLE_CALL_PROFILING
+/*
+ * Catch up on signals that arrived while rpc_run was waiting for calls.
+ * With worker threads, the housekeeping thread does that.
+ */
+void
+nfs_dispatch_signalled(void)
+{
+	if (_rpcsvcthreaded)
+		return;
+	nfs_dispatch_done();
+}
+
+/*
+ * Name of an NFS procedure.
+ */
+const char *
+nfs_procname(unsigned long proc)
+{
+	if (proc >= (sizeof(dtable) / sizeof(dtable[0])))
+		return "unknown";
+	return dtable[proc].name;
+}
+
+int
+nfs_need_dump(void)
+{
+	return need_dump;
+}
 
+/*
+ * Dump the latency histograms, the trace if we're tracing, and if we
+ * have them, the call statistics. The latter start over afterwards.
+ * stdio isn't safe in a signal handler, so the SIGUSR2 handler only
+ * asks for the dump, which is written by nfs_dispatch_done once the
+ * current call is done or rpc_run has been woken up, or with worker
+ * threads by the housekeeping thread.
+ */
 void
 dump_stats(int sig)
 {
+	static volatile int inprogress = 0;
 	FILE *fp;
+#ifdef ENABLE_CALL_PROFILING
 	int i;
+#endif
 
+	if (sig || _rpcsvcdirty) {
+		need_dump = 1;
+		return;
+	}
+	if (inprogress++)
+		return;
+	need_dump = 0;
+
+	if ((fp = fopen(PATH_LATENCY, "w")) == NULL) {
+		dbg_printf(__FILE__, __LINE__, L_WARNING,
+			   "unable to write latency data to %s\n",
+			   PATH_LATENCY);
+	} else {
+		latency_dump(fp);
+		fclose(fp);
+	}
+
+	if (trace_enabled) {
+		if ((fp = fopen(PATH_TRACE, "w")) == NULL) {
+			dbg_printf(__FILE__, __LINE__, L_WARNING,
+				   "unable to write trace to %s\n",
+				   PATH_TRACE);
+		} else {
+			trace_dump(fp);
+			fclose(fp);
+		}
+	}
+
+#ifdef ENABLE_CALL_PROFILING
 	if ((fp = fopen(PATH_PROFILE, "w")) == NULL) {
 		dbg_printf(__FILE__, __LINE__, L_WARNING,
 			   "unable to write profile data to %s\n",
 			   PATH_PROFILE);
+		inprogress = 0;
 		return;
 	}
 
 	for (i = 0; i < 18; i++) {
 		float t;
 
-		t = (float) rtimes[i].tv_sec +
-			(float) rtimes[i].tv_usec / 1000000.0;
-		fprintf(fp, "%-20s\t%5d calls %8.4f sec avg\n",
+		t = (float) rtimes[i] / 1000000.0;
+		fprintf(fp, "%-20s\t%5d calls %8.4f sec avg %5.2f syscalls avg"
+			" %5.2f stats saved avg %5u retransmits\n",
 			dtable[i].name, calls[i],
-			(calls[i]) ? t / calls[i] : 0);
-		rtimes[i].tv_sec = rtimes[i].tv_usec = 0;
+			(calls[i]) ? t / calls[i] : 0,
+			(calls[i]) ? (float) syscalls[i] / calls[i] : 0,
+			(calls[i]) ? (float) attrhits[i] / calls[i] : 0,
+			drchits[i]);
+		rtimes[i] = 0;
 		calls[i] = 0;
+		syscalls[i] = 0;
+		attrhits[i] = 0;
+		drchits[i] = 0;
 	}
+	svcdgram_stats(fp);
 
 	fclose(fp);
-}
-
 #endif /* ENABLE_CALL_PROFILING */
+	inprogress = 0;
+}
 
 /*
  * Functions for debugging output. This is still risky, because malformed
@@ -82,13 +82,10 @@ fhc_getattr(fhcache * fhc, fattr * attr, struct stat * stat_optimize,
 	    struct svc_req * rqstp)
 {
 	struct stat *s;
-	struct stat sbuf;
-
-	memset(&sbuf, 0, sizeof(&sbuf));
 
 	if (stat_optimize != NULL && stat_optimize->st_nlink != 0) {
 		s = stat_optimize;
-	} else if (lstat(fhc->path, (s = &sbuf)) != 0) {
+	} else if ((s = fhc_stat(fhc)) == NULL) {
 		dbg_printf(__FILE__, __LINE__, D_CALL,
 			   "getattr(%s): failed!  errno=%d\n", fhc->path,
 			   errno);
@@ -140,7 +137,7 @@ fhc_getattr(fhcache * fhc, fattr * attr, struct stat * stat_optimize,
 		attr->fileid = fh_psi((nfs_fh *) & (fhc->h));
 	} else {
 		attr->fsid = s->st_dev;
-		attr->fileid = covered_ino(fhc->path);
+		attr->fileid = covered_ino(fhc_path(fhc));
 	}
 #else
 	attr->fsid = 1;
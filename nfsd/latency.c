@@ -0,0 +1,202 @@
+/*
+ * latency.c
+ *
+ * Latency histograms of NFS calls, per procedure and per client host,
+ * with successful and failed calls kept apart. The time is taken from
+ * the arrival of a call to the moment its reply has been sent, so it
+ * includes time spent waiting for a worker thread.
+ *
+ * The histograms are log-linear: each power of two is split into
+ * LAT_SUB buckets, which bounds the error of a percentile to 1/LAT_SUB
+ * of its value whatever the range. They are never reset; latency_dump
+ * prints them along with p50, p99 and p99.9.
+ *
+ * This software may be used for any purpose provided
+ * the above copyright notice is retained.  It is supplied
+ * as is, with no warranty expressed or implied.
+ */
+
+#include "nfsd.h"
+#ifdef ENABLE_WORKER_THREADS
+#include <pthread.h>
+#endif
+
+#define LAT_SUB_BITS	3
+#define LAT_SUB		(1 << LAT_SUB_BITS)
+#define LAT_BUCKETS	((32 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+#define LAT_PROCS	18
+#define LAT_CLIENTS	64		/* client hosts told apart */
+
+typedef struct lat_hist {
+	unsigned long		count;
+	unsigned long long	total;		/* usecs */
+	unsigned long		max;
+	unsigned int		bucket[LAT_BUCKETS];
+} lat_hist;
+
+typedef struct lat_client {
+	struct in_addr		addr;
+	int			used;
+	lat_hist		hist[2];	/* ok, failed */
+} lat_client;
+
+static lat_hist		lat_procs[LAT_PROCS][2];
+/* The last one takes the clients that don't fit */
+static lat_client	lat_clients[LAT_CLIENTS + 1];
+
+#ifdef ENABLE_WORKER_THREADS
+static pthread_mutex_t	lat_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define lat_lock()	pthread_mutex_lock(&lat_mutex)
+#define lat_unlock()	pthread_mutex_unlock(&lat_mutex)
+#else
+#define lat_lock()	/* nothing */
+#define lat_unlock()	/* nothing */
+#endif
+
+static int
+lat_bucket(unsigned long usec)
+{
+	int bits;
+
+	if (usec >= 0xffffffffUL)
+		return LAT_BUCKETS - 1;
+	if (usec < LAT_SUB)
+		return (int) usec;
+	for (bits = 0; (usec >> bits) >= 2 * LAT_SUB; bits++)
+		;
+	return ((bits + 1) << LAT_SUB_BITS) + (int) ((usec >> bits) - LAT_SUB);
+}
+
+/* Largest value that falls into bucket i */
+static unsigned long
+lat_bucket_max(int i)
+{
+	int bits;
+
+	if (i < LAT_SUB)
+		return i;
+	bits = (i >> LAT_SUB_BITS) - 1;
+	return ((unsigned long) (LAT_SUB + (i & (LAT_SUB - 1)) + 1) << bits) - 1;
+}
+
+static void
+lat_add(lat_hist *h, unsigned long usec)
+{
+	h->count++;
+	h->total += usec;
+	if (usec > h->max)
+		h->max = usec;
+	h->bucket[lat_bucket(usec)]++;
+}
+
+static lat_client *
+lat_find_client(struct in_addr addr)
+{
+	lat_client *cp;
+	unsigned int i, n;
+
+	i = ntohl(addr.s_addr) % LAT_CLIENTS;
+	for (n = 0; n < LAT_CLIENTS; n++, i = (i + 1) % LAT_CLIENTS) {
+		cp = &lat_clients[i];
+		if (!cp->used) {
+			cp->used = 1;
+			cp->addr = addr;
+			return cp;
+		}
+		if (cp->addr.s_addr == addr.s_addr)
+			return cp;
+	}
+	return &lat_clients[LAT_CLIENTS];
+}
+
+/*
+ * Account for a call to proc from addr that arrived at time start.
+ */
+void
+latency_record(unsigned long proc, struct in_addr addr, int failed,
+	       unsigned long long start)
+{
+	unsigned long usec;
+	unsigned long long now;
+
+	if (proc >= LAT_PROCS)
+		return;
+	now = latency_now();
+	usec = (now > start) ? (unsigned long) (now - start) : 0;
+	failed = (failed != 0);
+
+	lat_lock();
+	lat_add(&lat_procs[proc][failed], usec);
+	lat_add(&lat_find_client(addr)->hist[failed], usec);
+	lat_unlock();
+}
+
+/*
+ * Smallest value that at least q of the calls did not exceed.
+ */
+static unsigned long
+lat_percentile(lat_hist *h, double q)
+{
+	unsigned long want, seen;
+	int i;
+
+	want = (unsigned long) (q * h->count + 0.999999);
+	if (want == 0)
+		want = 1;
+	for (i = 0, seen = 0; i < LAT_BUCKETS; i++) {
+		if ((seen += h->bucket[i]) >= want)
+			break;
+	}
+	if (i == LAT_BUCKETS || lat_bucket_max(i) > h->max)
+		return h->max;
+	return lat_bucket_max(i);
+}
+
+static void
+lat_print(FILE *fp, const char *name, int failed, lat_hist *h)
+{
+	if (h->count == 0)
+		return;
+	fprintf(fp, "%-16s %-6s %9lu %9lu %9lu %9lu %9lu %9lu\n",
+		name, failed ? "failed" : "ok", h->count,
+		(unsigned long) (h->total / h->count),
+		lat_percentile(h, 0.50), lat_percentile(h, 0.99),
+		lat_percentile(h, 0.999), h->max);
+}
+
+/*
+ * Print the histograms as a table of percentiles, in microseconds.
+ */
+void
+latency_dump(FILE *fp)
+{
+	static lat_hist procs[LAT_PROCS][2];
+	static lat_client clients[LAT_CLIENTS + 1];
+	int i, j;
+
+	/* Take a copy, so as not to hold up the workers while printing */
+	lat_lock();
+	memcpy(procs, lat_procs, sizeof(procs));
+	memcpy(clients, lat_clients, sizeof(clients));
+	lat_unlock();
+
+	fprintf(fp, "%-16s %-6s %9s %9s %9s %9s %9s %9s\n",
+		"procedure", "status", "calls", "avg", "p50", "p99",
+		"p99.9", "max");
+	for (i = 0; i < LAT_PROCS; i++) {
+		for (j = 0; j < 2; j++)
+			lat_print(fp, nfs_procname(i), j, &procs[i][j]);
+	}
+
+	fprintf(fp, "\n%-16s %-6s %9s %9s %9s %9s %9s %9s\n",
+		"client", "status", "calls", "avg", "p50", "p99",
+		"p99.9", "max");
+	for (i = 0; i <= LAT_CLIENTS; i++) {
+		if (i < LAT_CLIENTS && !clients[i].used)
+			continue;
+		for (j = 0; j < 2; j++)
+			lat_print(fp, (i < LAT_CLIENTS)
+				  ? inet_ntoa(clients[i].addr) : "others",
+				  j, &clients[i].hist[j]);
+	}
+}
@@ -25,11 +25,15 @@
 #include "fsusage.h"
 #include "rpcmisc.h"
 #include "failsafe.h"
+#include "fhindex.h"
 #include "signals.h"
+#include "stats.h"
+#include "xferlog.h"
 
 #include <rpc/pmap_clnt.h>
 #include <rpc/xdr.h>
 #include <getopt.h>
+#include <sys/uio.h>
 
 #if defined(__linux__)
 #include <sys/un.h>	/* MvS: to create UNIX sockets. */
@@ -54,16 +58,32 @@
 #undef  NFS_MAXDATA
 #define NFS_MAXDATA	(16 * 1024)
 
-static char iobuf[NFS_MAXDATA];
-static char pathbuf[NFS_MAXPATHLEN + NFS_MAXNAMLEN + 1];
-static char pathbuf_1[NFS_MAXPATHLEN + NFS_MAXNAMLEN + 1];
+#ifndef HAVE_FDATASYNC
+#define fdatasync	fsync
+#endif
+
+/*
+ * Read-ahead window for sequential READs
+ */
+
+#define READAHEAD_MIN	(4 * NFS_MAXDATA)
+#define READAHEAD_MAX	(64 * NFS_MAXDATA)
+
+static THREAD_LOCAL char iobuf[NFS_MAXDATA];
+THREAD_LOCAL int read_pipe[2] = { -1, -1 };	/* READ data for TCP */
+THREAD_LOCAL unsigned int read_pipe_len = 0;	/* bytes not yet sent */
+static THREAD_LOCAL char pathbuf[NFS_MAXPATHLEN + NFS_MAXNAMLEN + 1];
+static THREAD_LOCAL char pathbuf_1[NFS_MAXPATHLEN + NFS_MAXNAMLEN + 1];
 static nfsstat build_path(struct svc_req *rqstp, char *buf,
 			  diropargs * dopa, int flags);
 static fhcache *auth_fh(struct svc_req *rqstp, nfs_fh * fh,
 			nfsstat * statp, int flags);
+static fhcache *auth_fh_check(struct svc_req *rqstp, nfs_fh * fh,
+			      nfsstat * statp, int flags);
 static void usage(FILE *, char *program_name, int);
 static void terminate(void);
 static RETSIGTYPE sigterm(int sig);
+static void dir_forget(psi_t psi);
 
 /*
  * Option table
@@ -71,17 +91,25 @@ static RETSIGTYPE sigterm(int sig);
 
 static struct option longopts[] = {
 	{"auth-deamon", required_argument, 0, 'a'},
+	{"attr-cache-ttl", required_argument, 0, 'A'},
+	{"fh-cache-size", required_argument, 0, 'C'},
+	{"fd-cache-size", required_argument, 0, 'O'},
 	{"debug", required_argument, 0, 'd'},
 	{"foreground", 0, 0, 'F'},
 	{"exports-file", required_argument, 0, 'f'},
 	{"help", 0, 0, 'h'},
 	{"log-transfers", 0, 0, 'l'},
+	{"xferlog", required_argument, 0, 'L'},
+	{"xferlog-format", required_argument, 0, 'X'},
+	{"xferlog-size", required_argument, 0, 'K'},
 	{"allow-non-root", 0, 0, 'n'},
 	{"port", required_argument, 0, 'P'},
 	{"promiscuous", 0, 0, 'p'},
 	{"re-export", 0, 0, 'r'},
 	{"public-root", required_argument, 0, 'R'},
 	{"synchronous-writes", 0, 0, 's'},
+	{"threads", required_argument, 0, 'T'},
+	{"trace-buffer", required_argument, 0, 'b'},
 	{"no-spoof-trace", 0, 0, 't'},
 	{"root-uid", required_argument, 0, 'u'},
 	{"version", 0, 0, 'v'},
@@ -91,7 +119,7 @@ static struct option longopts[] = {
 	{NULL, 0, 0, 0}
 };
 
-static const char *shortopts = "a:d:Ff:hlnP:prR:stu:vxz::";
+static const char *shortopts = "a:A:b:C:d:Ff:hK:lL:nO:P:prR:sT:tu:vX:xz::";
 
 /*
  * Table of supported versions
@@ -102,15 +130,46 @@ static unsigned long nfsd_versions[] = {
 	0
 };
 
-nfs_client *nfsclient = NULL;		       /* the current client */
-nfs_mount *nfsmount = NULL;		       /* the current mount point */
+THREAD_LOCAL nfs_client *nfsclient = NULL;    /* the current client */
+THREAD_LOCAL nfs_mount *nfsmount = NULL;       /* the current mount point */
 
 static int need_reinit = 0;		       /* SIGHUP handling */
 static int read_only = 0;		       /* Global ro forced */
 static int cross_mounts = 1;		       /* Transparently cross mnts */
 static int log_transfers = 0;		       /* Log transfers */
+static char *xferlog_path = NULL;	       /* to this file */
+static int xferlog_fmt = XFERLOG_TEXT;
+static unsigned long xferlog_size = 0;	       /* rotate at this size */
 static svc_fh public_fh;		       /* Public NFSv2 FH (all zeros) */
 
+/*
+ * Directory streams kept open between READDIRs, so that a client
+ * listing a large directory continues where its last READDIR stopped
+ * instead of having the directory opened and searched again. A stream
+ * is found by the psi of the directory and the last cookie sent.
+ */
+
+#define DIR_CACHE_SIZE		16
+#define DIR_CACHE_TIMEOUT	30	/* seconds */
+
+typedef struct dir_stream {
+	DIR *		dirp;
+	psi_t		psi;
+	uid_t		uid;		/* of the user who opened it */
+	unsigned int	gids;		/* auth_gids_hash of the user */
+	__u32		cookie;		/* of the last entry sent */
+	time_t		mtime;		/* of the directory when opened */
+	time_t		ctime;
+	time_t		last_used;
+	ino_t		dotinum;
+	int		pending;	/* entry below not sent yet */
+	ino_t		ino;
+	long		loc;		/* telldir after the entry */
+	char		name[NAME_MAX + 1];
+} dir_stream;
+
+static dir_stream dir_cache[DIR_CACHE_SIZE];
+
 /*
  * auth_fh
  *
@@ -121,12 +180,30 @@ static svc_fh public_fh;		       /* Public NFSv2 FH (all zeros) */
 static fhcache *
 auth_fh(struct svc_req *rqstp, nfs_fh * fh, nfsstat * statp, int flags)
 {
+	unsigned long long t = TRACE_BEGIN();
 	fhcache *fhc;
 
+	fhc = auth_fh_check(rqstp, fh, statp, flags);
+	TRACE_END("auth_fh", t);
+	return fhc;
+}
+
+/*
+ * The work of auth_fh, which is traced as a whole.
+ */
+static fhcache *
+auth_fh_check(struct svc_req *rqstp, nfs_fh * fh, nfsstat * statp, int flags)
+{
+	unsigned long long t = TRACE_BEGIN();
+	fhcache *fhc;
+	char *path;
+
 	/* Try to map FH. If not cached, reconstruct path with root priv */
 	fhc = fh_find((svc_fh *) fh, FHFIND_FEXISTS | FHFIND_CHECK);
+	TRACE_END("fh_find", t);
 
-	if (fhc == NULL) {
+	/* If the file has been moved, this also forgets its mount point */
+	if (fhc == NULL || (path = fhc_path(fhc)) == NULL) {
 		*statp = NFSERR_STALE;
 		return NULL;
 	}
@@ -148,7 +225,7 @@ auth_fh(struct svc_req *rqstp, nfs_fh * fh, nfsstat * statp, int flags)
 	if (fhc->last_clnt == nfsclient) {
 		nfsmount = fhc->last_mount;	/* get cached mount point */
 	} else {
-		nfsmount = auth_path(nfsclient, rqstp, fhc->path);
+		nfsmount = auth_path(nfsclient, rqstp, path);
 		if (nfsmount == NULL) {
 			*statp = NFSERR_ACCES;
 			return NULL;
@@ -158,12 +235,12 @@ auth_fh(struct svc_req *rqstp, nfs_fh * fh, nfsstat * statp, int flags)
 	}
 
 	if (nfsmount->o.noaccess &&
-	    ((flags & CHK_NOACCESS) || strcmp(nfsmount->path, fhc->path))) {
+	    ((flags & CHK_NOACCESS) || strcmp(nfsmount->path, path))) {
 		struct in_addr addr = svc_getcaller(rqstp->rq_xprt)->sin_addr;
 
 		dbg_printf(__FILE__, __LINE__, L_WARNING,
 			   "client %s tried to access %s (noaccess)\n",
-			   inet_ntoa(addr), fhc->path);
+			   inet_ntoa(addr), path);
 
 		*statp = NFSERR_ACCES;
 		return NULL;
@@ -176,6 +253,13 @@ auth_fh(struct svc_req *rqstp, nfs_fh * fh, nfsstat * statp, int flags)
 
 	auth_user(nfsmount, rqstp);
 
+	/* The caller is about to change the file */
+	if (flags & CHK_WRITE) {
+		fhc->flags &= ~FHC_ATTRVALID;
+		dir_forget(fhc->h.psi);
+		fh_negative_forget(fhc);
+	}
+
 	*statp = NFS_OK;
 
 	return fhc;
@@ -198,12 +282,11 @@ build_path(struct svc_req *rqstp, char *buf, diropargs * dopa, int flags)
 	}
 
 	/* Get the directory path and append "/" + dopa->filename */
-	if (strlen(fhc->path) + strlen(dopa->name) + 1 >= NFS_MAXPATHLEN) {
+	sp = fhc_path(fhc);
+	if (strlen(sp) + strlen(dopa->name) + 1 >= NFS_MAXPATHLEN) {
 		return NFSERR_NAMETOOLONG;
 	}
 
-	sp = fhc->path;
-
 	while (*sp) {	/* strcpy(buf, fhc->path); */
 		*buf++ = *sp++;
 	}
@@ -231,14 +314,14 @@ build_path(struct svc_req *rqstp, char *buf, diropargs * dopa, int flags)
 }
 
 /*
- * Log a transfer to syslog.
+ * Count a transfer for the transfer log.
  */
 static void
-nfsd_xferlog(struct svc_req *rqstp, char *inout, char *pathname)
+nfsd_xferlog(struct svc_req *rqstp, fhcache *fhc, int write, int count)
 {
 	struct in_addr addr = svc_getcaller(rqstp->rq_xprt)->sin_addr;
 
-	syslog(LOG_INFO, "%s %s %s", inet_ntoa(addr), inout, pathname);
+	xferlog_account(fhc, addr, write, (unsigned int) count);
 }
 
 /*
@@ -283,15 +366,19 @@ nfsd_nfsproc_setattr_2(sattrargs * argp, struct svc_req *rqstp)
 		return status;
 	}
 
-	path = fhc->path;
+	path = fhc_path(fhc);
 	errno = 0;
 
-	/* Stat the file first and only change fields that are different. */
+	/* Stat the file first and only change fields that are different.
+	 * Keep other servers from writing to it meanwhile. */
+	(void) fh_lock(&argp->file);
 	if (lstat(path, &buf) < 0) {
+		fh_unlock(&argp->file);
 		return nfs_errno();
 	}
 
 	status = setattr(path, &argp->attributes, &buf, rqstp, SATTR_ALL);
+	fh_unlock(&argp->file);
 
 	if (status != NFS_OK) {
 		return status;
@@ -351,9 +438,19 @@ nfsd_nfsproc_lookup_2(diropargs * argp, struct svc_req *rqstp)
 		return status;
 	}
 
+	/* Compilers look for the same missing files over and over */
+	if (!ispublic && fh_negative_find(fhc, argp->name)) {
+		return NFSERR_NOENT;
+	}
+
 	status = fh_compose(argp, &dp->file, &sbuf, -1, -1, ispublic);
 
 	if (status != NFS_OK) {
+		/* fh_compose fails before making room for a new handle,
+		 * so fhc is still cached */
+		if (status == NFSERR_NOENT && !ispublic) {
+			fh_negative_add(fhc, argp->name);
+		}
 		return status;
 	}
 
@@ -387,7 +484,7 @@ nfsd_nfsproc_readlink_2(nfs_fh * argp, struct svc_req *rqstp)
 		return status;
 	}
 
-	path = fhc->path;
+	path = fhc_path(fhc);
 	errno = 0;
 
 	if ((cc = readlink(path, pathbuf, NFS_MAXPATHLEN)) < 0) {
@@ -465,6 +562,81 @@ nfsd_nfsproc_readlink_2(nfs_fh * argp, struct svc_req *rqstp)
 	return (NFS_OK);
 }
 
+#ifdef HAVE_SPLICE
+/*
+ * Move up to count bytes at offset in fd into read_pipe. Returns the
+ * number of bytes moved, or -1 if nothing could be moved.
+ */
+static int
+read_splice(int fd, off_t offset, unsigned int count)
+{
+	loff_t off = offset;
+	ssize_t n = 0;
+	int len = 0;
+
+	/* Throw away the data of a READ whose reply was never sent */
+	if (read_pipe_len != 0) {
+		close(read_pipe[0]);
+		close(read_pipe[1]);
+		read_pipe[0] = read_pipe[1] = -1;
+		read_pipe_len = 0;
+	}
+	if (read_pipe[0] < 0 && pipe(read_pipe) < 0) {
+		read_pipe[0] = read_pipe[1] = -1;
+		return -1;
+	}
+
+	while (len < (int) count) {
+		n = splice(fd, &off, read_pipe[1], NULL, count - len,
+			   SPLICE_F_MOVE);
+		count_syscall();
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	read_pipe_len = len;
+	return (len == 0 && n < 0) ? -1 : len;
+}
+#endif /* HAVE_SPLICE */
+
+#ifdef HAVE_POSIX_FADVISE
+/*
+ * Sequential access detection. When the READs of a file come in order,
+ * the data after them is read ahead, so that it is in the page cache
+ * by the time the client asks for it. The window doubles every time
+ * the client gets halfway through it, up to READAHEAD_MAX, and closes
+ * again on a READ out of order. Returns the number of bytes to read
+ * ahead at *startp, 0 if none.
+ */
+static unsigned int
+read_ahead(fhcache *fhc, off_t offset, unsigned int count, off_t *startp)
+{
+	off_t end = offset + count;
+	off_t start;
+
+	if (offset != fhc->ra_next) {
+		fhc->ra_next = end;
+		fhc->ra_end = 0;
+		fhc->ra_size = 0;
+		return 0;
+	}
+	fhc->ra_next = end;
+	if (fhc->ra_size != 0 && fhc->ra_end >= end + fhc->ra_size / 2)
+		return 0;
+
+	if (fhc->ra_size == 0)
+		fhc->ra_size = READAHEAD_MIN;
+	else if (fhc->ra_size < READAHEAD_MAX)
+		fhc->ra_size *= 2;
+	start = (fhc->ra_end > end) ? fhc->ra_end : end;
+	fhc->ra_end = end + fhc->ra_size;
+	*startp = start;
+	return (unsigned int) (fhc->ra_end - start);
+}
+#endif /* HAVE_POSIX_FADVISE */
+
 int
 nfsd_nfsproc_read_2(readargs * argp, struct svc_req *rqstp)
 {
@@ -474,6 +646,11 @@ nfsd_nfsproc_read_2(readargs * argp, struct svc_req *rqstp)
 	int fd;
 	int len;
 	unsigned int nfslen;
+	unsigned long long t;
+#ifdef HAVE_POSIX_FADVISE
+	unsigned int ralen;
+	off_t rastart = 0;
+#endif
 
 	fhc = auth_fh(rqstp, &(argp->file), &status, CHK_READ | CHK_NOACCESS);
 
@@ -486,17 +663,41 @@ nfsd_nfsproc_read_2(readargs * argp, struct svc_req *rqstp)
 	}
 
 	len = -1;
-	nfslen = 0;
+	if ((nfslen = argp->count) > NFS_MAXDATA) {
+		nfslen = NFS_MAXDATA;
+	}
+#ifdef HAVE_POSIX_FADVISE
+	ralen = read_ahead(fhc, argp->offset, nfslen, &rastart);
+#endif
 
-	if (lseek(fd, argp->offset, L_SET) >= 0) {
+	nfsd_io_begin();
+	t = TRACE_BEGIN();
+#ifdef HAVE_SPLICE
+	/*
+	 * Over TCP, the data is moved into a pipe and spliced from there
+	 * to the socket when the reply goes out. Fall back to reading it
+	 * if the file system can't do that.
+	 */
+	if (svcstream_check(rqstp->rq_xprt)
+	    && (len = read_splice(fd, argp->offset, nfslen)) >= 0) {
+		res->data.data_val = NULL;
+		res->data.data_len = (unsigned int) len;
+	} else
+#endif
+	if ((len = (int) pread(fd, iobuf, nfslen, argp->offset)) >= 0) {
 		res->data.data_val = iobuf;
-		if ((nfslen = argp->count) > NFS_MAXDATA) {
-			nfslen = NFS_MAXDATA;
-		}
-		if ((len = (int) read(fd, iobuf, nfslen)) >= 0) {
-			res->data.data_len = (unsigned int) len;
-		}
+		res->data.data_len = (unsigned int) len;
+	}
+	count_syscall();
+	TRACE_END("io read", t);
+#ifdef HAVE_POSIX_FADVISE
+	/* Start reading what comes next once this READ is done */
+	if (ralen != 0 && len > 0) {
+		(void) posix_fadvise(fd, rastart, ralen, POSIX_FADV_WILLNEED);
+		count_syscall();
 	}
+#endif
+	nfsd_io_end();
 
 	fd_inactive(fd);
 
@@ -504,9 +705,15 @@ nfsd_nfsproc_read_2(readargs * argp, struct svc_req *rqstp)
 		return (nfs_errno());
 	}
 
-	/* Write record to syslog */
-	if (argp->offset == 0 && log_transfers) {
-		nfsd_xferlog(rqstp, "<", fhc->path);
+#ifdef ENABLE_WORKER_THREADS
+	/* The cache entry may have been dropped while we were unlocked */
+	if ((fhc = fh_find((svc_fh *) &argp->file, FHFIND_FEXISTS)) == NULL) {
+		return NFSERR_STALE;
+	}
+#endif
+
+	if (xferlog_enabled) {
+		nfsd_xferlog(rqstp, fhc, 0, len);
 	}
 
 	return (fhc_getattr(fhc, &(res->attributes), NULL, rqstp));
@@ -518,13 +725,104 @@ nfsd_nfsproc_writecache_2(void *argp, struct svc_req *rqstp)
 	return (0);
 }
 
+/*
+ * Write count bytes at offset, going on after short writes, so that
+ * one that stops early (say, because the disk filled up) ends in the
+ * error that stopped it.
+ */
+static int
+write_all(int fd, char *buf, unsigned int count, off_t offset)
+{
+	unsigned int done = 0;
+	int len;
+
+	do {
+		len = (int) pwrite(fd, buf + done, count - done, offset + done);
+		count_syscall();
+		if (len < 0)
+			return -1;
+		if (len == 0 && done < count) {
+			errno = ENOSPC;
+			return -1;
+		}
+		done += len;
+	} while (done < count);
+	return (int) done;
+}
+
+#if WRITE_BATCH_MAX > 1
+/*
+ * Write the data of argp and of the WRITEs batched with it, each of
+ * which starts where the one before ends, with a single system call.
+ * The total number of bytes to be written is returned in countp.
+ *
+ * If that comes up short, the WRITEs it did not cover are finished one
+ * at a time. A batched WRITE that fails then gets its own error status
+ * (see nfs_dispatch_request); if argp itself fails, -1 is returned and
+ * the whole batch shares its error. Otherwise, the number of bytes
+ * written by the WRITEs that succeeded is returned.
+ */
+static int
+write_batch(int fd, writeargs * argp, unsigned int *countp)
+{
+	struct iovec iov[WRITE_BATCH_MAX];
+	nfs_request *reqs[WRITE_BATCH_MAX];
+	nfs_request *req;
+	writeargs *wa;
+	unsigned int done;
+	off_t offset;
+	int len;
+	int n, i;
+
+	iov[0].iov_base = argp->data.data_val;
+	iov[0].iov_len = argp->data.data_len;
+	reqs[0] = NULL;
+	*countp = argp->data.data_len;
+	n = 1;
+	for (req = nfsd_request_current->batch; req && n < WRITE_BATCH_MAX;
+	     req = req->batch) {
+		wa = &req->argument.nfsproc_write_2_arg;
+		iov[n].iov_base = wa->data.data_val;
+		iov[n].iov_len = wa->data.data_len;
+		reqs[n] = req;
+		*countp += wa->data.data_len;
+		n++;
+	}
+	len = (int) pwritev(fd, iov, n, argp->offset);
+	count_syscall();
+	if (len < 0 || (unsigned int) len == *countp)
+		return len;
+
+	done = len;
+	len = 0;
+	offset = argp->offset;
+	for (i = 0; i < n; i++) {
+		if (done < iov[i].iov_len
+		    && write_all(fd, (char *) iov[i].iov_base + done,
+				 iov[i].iov_len - done, offset + done) < 0) {
+			if (reqs[i] == NULL)
+				return -1;
+			reqs[i]->status = nfs_errno();
+		} else {
+			len += iov[i].iov_len;
+		}
+		offset += iov[i].iov_len;
+		done = done > iov[i].iov_len ? done - iov[i].iov_len : 0;
+	}
+	return len;
+}
+#endif
+
 int
 nfsd_nfsproc_write_2(writeargs * argp, struct svc_req *rqstp)
 {
 	nfsstat status;
 	fhcache *fhc;
+	unsigned int count;
 	int fd;
 	int len;
+	int sync;
+	unsigned long long t;
 
 	fhc = auth_fh(rqstp, &(argp->file), &status,
 		      CHK_WRITE | CHK_NOACCESS);
@@ -545,14 +843,57 @@ nfsd_nfsproc_write_2(writeargs * argp, struct svc_req *rqstp)
 		return ((int) status);
 	}
 
-	len = -1;
+	count = argp->data.data_len;
+	sync = nfsmount->o.sync_writes;
 
-	if (lseek(fd, argp->offset, L_SET) >= 0) {
-		len = (int) write(fd, argp->data.data_val, argp->data.data_len);
-		if ((unsigned int) len != argp->data.data_len) {
-			dbg_printf(__FILE__, __LINE__, D_CALL,
-				   "Write failure, errno is %d.\n", errno);
+#if WRITE_BATCH_MAX > 1
+	/* Let the WRITEs that follow this one share the fdatasync */
+	if (sync && nfsd_request_current != NULL) {
+		nfsd_io_begin();
+		nfsd_write_gather(nfsd_request_current);
+		nfsd_io_end();
+	}
+#endif
+
+	/* When running several servers, writes to a file are done one at
+	 * a time. The lock is our thread's, so it does without the nfsd lock,
+	 * but it has to be released before taking that back. */
+	nfsd_io_begin();
+	(void) fh_lock(&argp->file);
+	t = TRACE_BEGIN();
+#if WRITE_BATCH_MAX > 1
+	if (nfsd_request_current != NULL
+	    && nfsd_request_current->batch != NULL) {
+		len = write_batch(fd, argp, &count);
+	} else
+#endif
+	len = write_all(fd, argp->data.data_val, count, argp->offset);
+	TRACE_END("io write", t);
+	if (sync && len >= 0) {
+#if WRITE_BATCH_MAX > 1
+		struct timeval t0, t1;
+
+		gettimeofday(&t0, NULL);
+#endif
+		t = TRACE_BEGIN();
+		if (fdatasync(fd) < 0)
+			len = -1;
+		count_syscall();
+		TRACE_END("fdatasync", t);
+#if WRITE_BATCH_MAX > 1
+		gettimeofday(&t1, NULL);
+		if (nfsd_request_current != NULL) {
+			nfsd_write_committed((t1.tv_sec - t0.tv_sec) * 1000000
+					     + t1.tv_usec - t0.tv_usec);
 		}
+#endif
+	}
+	fh_unlock(&argp->file);
+	nfsd_io_end();
+
+	if ((unsigned int) len != count) {
+		dbg_printf(__FILE__, __LINE__, D_CALL,
+			   "Write failure, errno is %d.\n", errno);
 	}
 
 	fd_inactive(fd);
@@ -561,9 +902,16 @@ nfsd_nfsproc_write_2(writeargs * argp, struct svc_req *rqstp)
 		return nfs_errno();
 	}
 
-	/* Write record to syslog */
-	if (argp->offset == 0 && log_transfers) {
-		nfsd_xferlog(rqstp, ">", fhc->path);
+#ifdef ENABLE_WORKER_THREADS
+	if ((fhc = fh_find((svc_fh *) &argp->file, FHFIND_FEXISTS)) == NULL) {
+		return NFSERR_STALE;
+	}
+	/* Another thread may have fetched the attributes meanwhile */
+	fhc->flags &= ~FHC_ATTRVALID;
+#endif
+
+	if (xferlog_enabled) {
+		nfsd_xferlog(rqstp, fhc, 1, len);
 	}
 
 	return (fhc_getattr(fhc, &(result.attrstat.attrstat_u.attributes),
@@ -835,11 +1183,22 @@ nfsd_nfsproc_rename_2(renameargs * argp, struct svc_req *rqstp)
 	dbg_printf(__FILE__, __LINE__, D_CALL,
 		   "\tpathfrom='%s' pathto='%s'\n", pathbuf, pathbuf_1);
 
-	/* Remove any file handle from our cache. */
-	fh_remove(pathbuf);
+	/* Remove any file handle of the file replaced from our cache. */
 	fh_remove(pathbuf_1);
 
-	return (!rename(pathbuf, pathbuf_1) ? NFS_OK : nfs_errno());
+	if (rename(pathbuf, pathbuf_1) != 0) {
+		return (nfs_errno());
+	}
+
+	/* The cached handles of the file, and of the files below it,
+	 * follow it to its new name */
+	fh_rename(pathbuf, pathbuf_1);
+
+	/* Record the new name, so that the files below a renamed
+	 * directory can still be found through the fh index */
+	fh_index_rename(&argp->to, pathbuf_1);
+
+	return (NFS_OK);
 }
 
 /*
@@ -863,7 +1222,14 @@ nfsd_nfsproc_link_2(linkargs * argp, struct svc_req *rqstp)
 	}
 
 	mountp1 = nfsmount;
-	path = fhc->path;
+
+	/* Looking up the target may evict the source handle, and its
+	 * path along with it, so take a copy first */
+	path = fhc_path(fhc);
+	if (strlen(path) >= sizeof(pathbuf)) {
+		return NFSERR_NAMETOOLONG;
+	}
+	strcpy(pathbuf, path);
 
 	status = build_path(rqstp, pathbuf_1, &argp->to,
 			    CHK_WRITE | CHK_NOACCESS);
@@ -873,7 +1239,7 @@ nfsd_nfsproc_link_2(linkargs * argp, struct svc_req *rqstp)
 	}
 
 	dbg_printf(__FILE__, __LINE__, D_CALL,
-		   "\tpathfrom='%s' pathto='%s'\n", path, pathbuf_1);
+		   "\tpathfrom='%s' pathto='%s'\n", pathbuf, pathbuf_1);
 
 	if (nfsmount != mountp1) {
 		dbg_printf(__FILE__, __LINE__, D_CALL,
@@ -881,7 +1247,7 @@ nfsd_nfsproc_link_2(linkargs * argp, struct svc_req *rqstp)
 		return NFSERR_ACCES;
 	}
 
-	return (!link(path, pathbuf_1) ? NFS_OK : nfs_errno());
+	return (!link(pathbuf, pathbuf_1) ? NFS_OK : nfs_errno());
 }
 
 int
@@ -993,12 +1359,12 @@ nfsd_nfsproc_rmdir_2(diropargs * argp, struct svc_req *rqstp)
 }
 
 static int
-dpsize(struct dirent *dp)
+dpsize(const char *name)
 {
 #define DP_SLOP	16
 #define MAX_E_SIZE sizeof(entry) + NAME_MAX + DP_SLOP
 	/*@ +matchanyintegral @*/
-	return (sizeof(entry) + NLENGTH(dp) + DP_SLOP);
+	return (sizeof(entry) + strlen(name) + DP_SLOP);
 	/*@ =matchanyintegral @*/
 }
 
@@ -1024,23 +1390,121 @@ dirent_ino(const char * parent_path, struct dirent * dp)
 #endif /* ! __CYGWIN__ */
 }
 
+static void
+dir_close(dir_stream * ds)
+{
+	if (ds->dirp != NULL) {
+		closedir(ds->dirp);
+		ds->dirp = NULL;
+	}
+}
+
+/*
+ * Find the directory stream to continue a READDIR at cookie, or open
+ * a new one. opendir checks whether the user may read the directory,
+ * so a stream is only used by the user who opened it. Streams whose
+ * directory has changed since it was opened aren't used, and those
+ * left idle for DIR_CACHE_TIMEOUT are closed.
+ */
+static dir_stream *
+dir_open(fhcache * h, struct stat *sbp, __u32 cookie)
+{
+	dir_stream *ds, *slot = NULL;
+	unsigned int gids = auth_gids_hash();
+
+	for (ds = dir_cache; ds < dir_cache + DIR_CACHE_SIZE; ds++) {
+		if (ds->dirp != NULL
+		    && nfs_dispatch_time - ds->last_used > DIR_CACHE_TIMEOUT) {
+			dir_close(ds);
+		}
+		if (ds->dirp != NULL && cookie != 0 && ds->psi == h->h.psi
+		    && ds->cookie == cookie && ds->uid == auth_uid
+		    && ds->gids == gids) {
+			if (ds->mtime == sbp->st_mtime
+			    && ds->ctime == sbp->st_ctime) {
+				ds->last_used = nfs_dispatch_time;
+				return ds;
+			}
+			dir_close(ds);
+		}
+		if (slot == NULL || (slot->dirp != NULL
+				     && (ds->dirp == NULL
+					 || ds->last_used < slot->last_used))) {
+			slot = ds;
+		}
+	}
+
+	dir_close(slot);
+	if ((slot->dirp = opendir(fhc_path(h))) == NULL) {
+		return NULL;
+	}
+	if (cookie != 0) {
+		seekdir(slot->dirp, (long) ntohl(cookie));
+	}
+	slot->psi = h->h.psi;
+	slot->uid = auth_uid;
+	slot->gids = gids;
+	slot->cookie = cookie;
+	slot->mtime = sbp->st_mtime;
+	slot->ctime = sbp->st_ctime;
+	slot->last_used = nfs_dispatch_time;
+	slot->dotinum = 0;
+	slot->pending = 0;
+	return slot;
+}
+
+/*
+ * Read the next entry of a directory stream. It stays pending until
+ * it has been put into a READDIR reply.
+ */
+static int
+dir_read(dir_stream * ds, const char *path)
+{
+	struct dirent *dp;
+
+	if ((dp = readdir(ds->dirp)) == NULL) {
+		return 0;
+	}
+	ds->ino = dirent_ino(path, dp);
+	strcpy(ds->name, dp->d_name);
+	/*@ +matchanyintegral @*/
+	ds->loc = telldir(ds->dirp);
+	/*@ =matchanyintegral @*/
+	ds->pending = 1;
+	return 1;
+}
+
+/*
+ * Close the streams of a directory that is about to be changed.
+ */
+static void
+dir_forget(psi_t psi)
+{
+	dir_stream *ds;
+
+	for (ds = dir_cache; ds < dir_cache + DIR_CACHE_SIZE; ds++) {
+		if (ds->dirp != NULL && ds->psi == psi) {
+			dir_close(ds);
+		}
+	}
+}
+
 int
 nfsd_nfsproc_readdir_2(readdirargs * argp, struct svc_req *rqstp)
 {
-	static readdirres oldres;
+	static THREAD_LOCAL readdirres oldres;
 	entry **ep;
 	entry *e;
 	__u32 dloc;
-	DIR *dirp;
-	struct dirent *dp;
-	struct stat sbuf;
+	dir_stream *ds;
+	struct stat *sbp;
 	unsigned int res_size;
 	int dotsonly;
 	int hidedot;
 	int first;
+	int eof;
 	fhcache *h;
 	nfsstat status;
-	ino_t dotinum = 0;
 	ino_t ino = 0;
 
 	/* Free the previous result, since it has 'malloc'ed strings.  */
@@ -1066,33 +1530,30 @@ nfsd_nfsproc_readdir_2(readdirargs * argp, struct svc_req *rqstp)
 	dotsonly = ((!re_export && (h->flags & FHC_NFSMOUNTED))
 		    || nfsmount->o.noaccess);
 	hidedot = (nfsmount->parent == NULL
-		   && !strcmp(h->path, nfsmount->path));
+		   && !strcmp(fhc_path(h), nfsmount->path));
 
 	/* This code is from Mark Shand's version */
 	errno = 0;
 
-	if (lstat(h->path, &sbuf) < 0 || !(S_ISDIR(sbuf.st_mode))) {
+	if ((sbp = fhc_stat(h)) == NULL || !(S_ISDIR(sbp->st_mode))) {
 		return (NFSERR_NOTDIR);
 	}
 
-	if ((dirp = opendir(h->path)) == NULL) {
-		return ((errno ? nfs_errno() : NFSERR_NAMETOOLONG));
-	}
-
-	res_size = 0;
-
 	memcpy(&dloc, argp->cookie, sizeof(dloc));
 
-	if (dloc != 0) {
-		seekdir(dirp, (long) ntohl(dloc));
+	if ((ds = dir_open(h, sbp, dloc)) == NULL) {
+		return ((errno ? nfs_errno() : NFSERR_NAMETOOLONG));
 	}
 
+	res_size = 0;
 	first = 1;
+	eof = 0;
 	ep = &(result.readdirres.readdirres_u.reply.entries);
 
-	while ((dp = readdir(dirp)) != NULL) {
+	/* The entry that didn't fit into the last reply comes first */
+	while (ds->pending || dir_read(ds, fhc_path(h))) {
 
-		res_size += dpsize(dp);
+		res_size += dpsize(ds->name);
 
 		if (res_size >= argp->count && !first) {
 			break;
@@ -1100,41 +1561,49 @@ nfsd_nfsproc_readdir_2(readdirargs * argp, struct svc_req *rqstp)
 
 		/* XXX: This code relies on . coming before .. */
 
-		ino = dirent_ino(h->path, dp);
+		ino = ds->ino;
 
-		if (!strcmp(dp->d_name, "..")) {
+		if (!strcmp(ds->name, "..")) {
 			if (hidedot) {
-				ino = dotinum;
+				ino = ds->dotinum;
 			}
-		} else if (!strcmp(dp->d_name, ".")) {
+		} else if (!strcmp(ds->name, ".")) {
 			if (hidedot) {
-				dotinum = ino;
+				ds->dotinum = ino;
 			}
 		} else if (dotsonly) {
-			dp = NULL;
+			eof = 1;
 			break;
 		}
 
 		e = *ep = (entry *) xmalloc(sizeof(entry));
-		e->fileid = (unsigned int) pseudo_inode(ino, sbuf.st_dev);
-		e->name = xmalloc(NLENGTH(dp) + 1);
+		e->fileid = (unsigned int) pseudo_inode(ino, sbp->st_dev);
+		e->name = xmalloc(strlen(ds->name) + 1);
 
-		strcpy(e->name, dp->d_name);
+		strcpy(e->name, ds->name);
 
-		/*@ +matchanyintegral @*/
-		dloc = htonl(telldir(dirp));
-		/*@ =matchanyintegral @*/
+		dloc = htonl((__u32) ds->loc);
 
 		memcpy(&e->cookie, &dloc, sizeof(nfscookie));
 
+		ds->pending = 0;
 		ep = &e->nextentry;
 		first = 0;
 	}
 
+	if (!ds->pending) {
+		eof = 1;
+	}
+
 	*ep = NULL;
-	result.readdirres.readdirres_u.reply.eof = (dp == NULL);
+	result.readdirres.readdirres_u.reply.eof = eof;
 
-	closedir(dirp);
+	/* Keep the stream for the READDIR that continues at dloc */
+	if (eof) {
+		dir_close(ds);
+	} else {
+		ds->cookie = dloc;
+	}
 
 	/* FIXME: there has to be a better way of freeing result.readdirres */
 
@@ -1163,7 +1632,7 @@ nfsd_nfsproc_statfs_2(nfs_fh * argp, struct svc_req *rqstp)
 		return status;
 	}
 
-	path = fhc->path;
+	path = fhc_path(fhc);
 
 	if (get_fs_usage(path, NULL, &fs) < 0) {
 		return (nfs_errno());
@@ -1190,6 +1659,8 @@ main(int argc, char **argv)
 	int c;
 	int i;
 	int ncopies = 1;
+	int nthreads = 0;
+	int tracesize = 0;
 
 	chdir("/");
 
@@ -1218,6 +1689,25 @@ main(int argc, char **argv)
 		case 'l':
 			log_transfers = 1;
 			break;
+		case 'L':
+			log_transfers = 1;
+			xferlog_path = optarg;
+			break;
+		case 'X':
+			if ((xferlog_fmt = xferlog_format(optarg)) < 0) {
+				fprintf(stderr, "nfsd: bad transfer log format: %s\n",
+					optarg);
+				usage(stderr, program_name, 1);
+			}
+			break;
+		case 'K':
+			if (atol(optarg) <= 0) {
+				fprintf(stderr, "nfsd: bad transfer log size: %s\n",
+					optarg);
+				usage(stderr, program_name, 1);
+			}
+			xferlog_size = (unsigned long) atol(optarg) * 1024;
+			break;
 		case 'n':
 			allow_non_root = 1;
 			break;
@@ -1238,6 +1728,51 @@ main(int argc, char **argv)
 		case 'R':
 			public_root_path = xstrdup(optarg);
 			break;
+		case 'A':
+			fh_attr_ttl = atoi(optarg);
+			if (fh_attr_ttl < 0) {
+				fprintf(stderr, "nfsd: bad attribute cache ttl: %s\n",
+					optarg);
+				usage(stderr, program_name, 1);
+			}
+			break;
+		case 'b':
+			tracesize = atoi(optarg);
+			if (tracesize <= 0) {
+				fprintf(stderr, "nfsd: bad trace buffer size: %s\n",
+					optarg);
+				usage(stderr, program_name, 1);
+			}
+			break;
+		case 'C':
+			fh_cache_limit = atoi(optarg);
+			if (fh_cache_limit <= 0) {
+				fprintf(stderr, "nfsd: bad fh cache size: %s\n",
+					optarg);
+				usage(stderr, program_name, 1);
+			}
+			break;
+		case 'O':
+			fd_cache_limit = atoi(optarg);
+			if (fd_cache_limit <= 0) {
+				fprintf(stderr, "nfsd: bad fd cache size: %s\n",
+					optarg);
+				usage(stderr, program_name, 1);
+			}
+			break;
+		case 'T':
+			nthreads = atoi(optarg);
+			if (nthreads < 0) {
+				fprintf(stderr, "nfsd: bad number of threads: %s\n",
+					optarg);
+				usage(stderr, program_name, 1);
+			}
+#ifndef ENABLE_WORKER_THREADS
+			fprintf(stderr, "nfsd: warning: worker threads not "
+				"supported, option ignored\n");
+			nthreads = 0;
+#endif
+			break;
 		case 't':
 			trace_spoof = 0;
 			break;
@@ -1306,6 +1841,20 @@ main(int argc, char **argv)
 	/* Initialize logging. */
 	log_open("nfsd", foreground);
 
+	if (log_transfers
+	    && xferlog_open(xferlog_path, xferlog_fmt, xferlog_size) < 0) {
+		dbg_printf(__FILE__, __LINE__, L_FATAL,
+			   "nfsd: cannot open transfer log %s\n",
+			   xferlog_path);
+	}
+
+#ifdef ENABLE_MULTIPLE_SERVERS
+	/* Each server will get sockets of its own */
+	if (ncopies > 1) {
+		_rpcreuseport = ncopies;
+	}
+#endif
+
 	/* Initialize RPC stuff */
 	rpc_init("nfsd", NFS_PROGRAM, nfsd_versions, nfs_dispatch,
 		 nfsport, NFS_MAXDATA);
@@ -1318,10 +1867,38 @@ main(int argc, char **argv)
 		ncopies = 1;
 	}
 
-	if (ncopies > 1) {
+	/* Worker threads only make sense for a standalone server */
+	if (_rpcpmstart && nthreads > 0) {
+		dbg_printf(__FILE__, __LINE__, L_WARNING,
+			   "nfsd: warning: can't use worker "
+			   "threads in inetd mode\n");
+		nthreads = 0;
+	}
+#if !defined(HAVE_SETFSUID)
+	/* Without setfsuid, all threads share a single set of credentials */
+	if (nthreads > 0) {
+		dbg_printf(__FILE__, __LINE__, L_WARNING,
+			   "nfsd: warning: worker threads need "
+			   "setfsuid support\n");
+		nthreads = 0;
+	}
+#endif
+
+#ifdef ENABLE_MULTIPLE_SERVERS
+	/* The servers must agree on which files were removed */
+	if (ncopies > 1 && fh_share_init() < 0) {
 		read_only = 1;
 	}
 
+	/* A WRITE would hold the nfsd lock while it waits for the disk */
+	if (ncopies > 1 && nthreads > 0 && !fh_lock_threads()) {
+		dbg_printf(__FILE__, __LINE__, L_WARNING,
+			   "nfsd: warning: can't use worker threads "
+			   "with several servers here\n");
+		nthreads = 0;
+	}
+#endif
+
 	/* We first fork off a child. */
 	if (!foreground) {
 		pid_t child;
@@ -1350,12 +1927,20 @@ main(int argc, char **argv)
 					   strerror(errno));
 			} else if (child == 0) {
 				/* Child process */
+				rpc_ownsocks();
 				break;
 			}
 		}
 	} else {
+		/* The failsafe parent serves no calls, so it must not
+		 * hold on to a socket the kernel hands calls to. */
+		if (_rpcreuseport) {
+			rpc_closesocks();
+		}
+
 		/* Init for failsafe mode */
 		failsafe(failsafe_level, ncopies);
+		rpc_ownsocks();
 	}
 
 	/*
@@ -1387,6 +1972,15 @@ main(int argc, char **argv)
 
 	}
 
+	/* Publish the cache statistics of this server copy */
+	stats_init("nfsd");
+
+	/* Record the phases of calls until the buffer is dumped */
+	trace_init(tracesize);
+
+	/* From now on, log messages are written out behind our back */
+	log_async_start();
+
 	/*
 	 * Initialize the FH module.
 	 * This must happen after the fork(), otherwise the alarm timer
@@ -1394,6 +1988,11 @@ main(int argc, char **argv)
 	 */
 	fh_init();
 
+#ifdef ENABLE_FH_INDEX
+	/* Without the index, we fall back to scanning directories */
+	(void) fhindex_open(NULL);
+#endif
+
 	/*
 	 * If we have a public root, build the FH now.
 	 */
@@ -1411,25 +2010,29 @@ main(int argc, char **argv)
 	 * Enable signal handlers:
 	 * 
 	 * SIGUSR1 : toggle logging
-	 * SIGUSR2 : dump call statistics
+	 * SIGUSR2 : dump latency histograms, trace and call statistics
 	 * SIGHUP  : reinitialize
 	 * SIGTERM : rpc.nfsd.die.die.die 
 	 */
 
 	install_signal_handler(SIGUSR1, log_toggle);
 
-#ifdef ENABLE_CALL_PROFILING
 	install_signal_handler(SIGUSR2, dump_stats);
-#endif /* ENABLE_CALL_PROFILING */
+	_rpcsignalled = nfs_dispatch_signalled;
 
 	install_signal_handler(SIGHUP, nfsd_reinitialize);
 	install_signal_handler(SIGTERM, sigterm);
 	atexit(terminate);
 
+#ifdef ENABLE_WORKER_THREADS
+	/* Start the worker threads; rpc_run() below becomes the receiver */
+	nfsd_workers_start(nthreads);
+#endif
+
 	/* Run the NFS server. */
-	svc_run();
+	rpc_run();
 
-	dbg_printf(__FILE__, __LINE__, L_ERROR, "svc_run() returned\n");
+	dbg_printf(__FILE__, __LINE__, L_ERROR, "rpc_run() returned\n");
 
 	exit(1);
 }
@@ -1442,7 +2045,12 @@ usage(FILE * fp, char *program_name, int n)
 		"       [--debug kind] [--exports-file=file] [--port port]\n"
 		"       [--allow-non-root] [--promiscuous] [--version] [--foreground]\n"
 		"       [--re-export] [--log-transfers] [--public-root path]\n"
-		"       [--no-spoof-trace] [--help]\n", program_name);
+		"       [--xferlog file] [--xferlog-format format]\n"
+		"       [--xferlog-size kbytes]\n"
+		"       [--no-spoof-trace] [--threads n] [--fh-cache-size n]\n"
+		"       [--fd-cache-size n]\n"
+		"       [--attr-cache-ttl msec] [--trace-buffer n] [--help]\n",
+		program_name);
 	exit(n);
 }
 
@@ -1459,6 +2067,11 @@ static void
 terminate(void)
 {
 	rpc_exit(NFS_PROGRAM, nfsd_versions);
+	if (xferlog_enabled) {
+		fh_xferlog_all();
+		xferlog_close();
+	}
+	stats_exit();
 }
 
 int
@@ -1472,7 +2085,8 @@ nfsd_reinitialize(sig)
 {
 	static volatile int inprogress = 0;
 
-	if (_rpcsvcdirty) {
+	/* With worker threads, leave the work to the housekeeping thread */
+	if (_rpcsvcdirty || (sig && _rpcsvcthreaded)) {
 		need_reinit = 1;
 		return;
 	}
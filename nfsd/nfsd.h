@@ -20,6 +20,8 @@
 #include "auth.h"
 #include "fhandle.h"
 #include "logging.h"
+#include "rpcmisc.h"
+#include "trace.h"
 
 #define SATTR_STAT	0x01
 #define SATTR_CHOWN	0x02
@@ -56,15 +58,54 @@ union result_types {
 	statfsres statfsres;
 };
 
+/*
+ * Max number of WRITEs done with one system call. Only the worker
+ * threads have several calls at hand to merge.
+ */
+#if defined(ENABLE_WORKER_THREADS) && defined(HAVE_PWRITEV)
+#define WRITE_BATCH_MAX	16
+#else
+#define WRITE_BATCH_MAX	1
+#endif
+
+#ifdef ENABLE_WORKER_THREADS
+/*
+ * A decoded NFS call waiting for a worker thread. Everything the
+ * handlers look at in the svc_req is copied, because the transport
+ * and RPC library buffers are reused for the next call.
+ */
+typedef struct nfs_request {
+	struct nfs_request *	next;
+	struct nfs_request *	batch;		/* WRITEs done along with this */
+	nfsstat			status;		/* of a batched WRITE that failed */
+	struct nfs_request *	gather_next;	/* see nfsd_write_gather */
+	struct svc_req		rqst;
+	SVCXPRT			xprt;		/* rq_xprt; for the caller address */
+	rpc_defer		reply;
+	struct authunix_parms	aup;		/* rq_clntcred */
+	char			credbody[MAX_AUTH_BYTES];
+	char			machname[MAX_MACHINE_NAME + 1];
+	gid_t			gids[NGRPS];
+	unsigned long long	start;		/* see latency_record */
+	union argument_types	argument;
+} nfs_request;
+#endif
+
 /*
  * Global variables.
  */
 
-extern union argument_types argument;
-extern union result_types result;
+extern THREAD_LOCAL union argument_types argument;
+extern THREAD_LOCAL union result_types result;
 extern time_t nfs_dispatch_time;
-extern nfs_client *nfsclient;		       /* the current client */
-extern nfs_mount *nfsmount;		       /* the current mount point */
+extern THREAD_LOCAL nfs_client *nfsclient;     /* the current client */
+extern THREAD_LOCAL nfs_mount *nfsmount;       /* the current mount point */
+#ifdef ENABLE_WORKER_THREADS
+extern int nfsd_nworkers;
+extern THREAD_LOCAL nfs_request *nfsd_request_current;
+#endif
+extern THREAD_LOCAL int read_pipe[2];
+extern THREAD_LOCAL unsigned int read_pipe_len;
 
 /*
  * Global Function prototypes.
@@ -84,6 +125,36 @@ extern nfsstat setattr(char *path, sattr * attr,
 extern int nfsd_need_reinit(void);
 extern RETSIGTYPE nfsd_reinitialize(int sig);
 
+#ifdef ENABLE_WORKER_THREADS
+extern void nfs_dispatch_request(nfs_request *req);
+extern void nfsd_workers_start(int nworkers);
+extern nfs_request *nfsd_request_alloc(struct svc_req *, SVCXPRT *);
+extern void nfsd_request_queue(nfs_request *req);
+extern void nfsd_request_free(nfs_request *req);
+extern void nfsd_write_gather(nfs_request *req);
+extern void nfsd_write_committed(long usec);
+extern void nfsd_lock(void);
+extern void nfsd_unlock(void);
+extern void nfsd_io_begin(void);
+extern void nfsd_io_end(void);
+#else
+#define nfsd_lock()		/* nothing */
+#define nfsd_unlock()		/* nothing */
+#define nfsd_io_begin()		/* nothing */
+#define nfsd_io_end()		/* nothing */
+#endif
+
+/*
+ * Count the file I/O system calls made by READ and WRITE, for the
+ * call profile.
+ */
+#ifdef ENABLE_CALL_PROFILING
+extern THREAD_LOCAL unsigned int nfsd_syscalls;
+#define count_syscall()		(nfsd_syscalls++)
+#else
+#define count_syscall()		/* nothing */
+#endif
+
 extern int nfsd_nfsproc_null_2(void *, struct svc_req *);
 extern int nfsd_nfsproc_getattr_2(nfs_fh *, struct svc_req *);
 extern int nfsd_nfsproc_setattr_2(sattrargs *, struct svc_req *);
@@ -103,8 +174,12 @@ extern int nfsd_nfsproc_rmdir_2(diropargs *, struct svc_req *);
 extern int nfsd_nfsproc_readdir_2(readdirargs *, struct svc_req *);
 extern int nfsd_nfsproc_statfs_2(nfs_fh *, struct svc_req *);
 
-#ifdef ENABLE_CALL_PROFILING
+extern const char *nfs_procname(unsigned long proc);
 extern void dump_stats(int sig);
-#endif
+extern int nfs_need_dump(void);
+extern void nfs_dispatch_signalled(void);
+extern void latency_record(unsigned long proc, struct in_addr addr,
+			   int failed, unsigned long long start);
+extern void latency_dump(FILE *fp);
 
 #endif /* UNFSD_NFSD_H_INCLUDED */
@@ -128,6 +128,9 @@ setattr(char *path, sattr * attr, struct stat * s,
 			if (chmod(path, mode) < 0) {
 				return nfs_errno();
 			}
+			if (S_ISDIR(s->st_mode)) {
+				fh_perm_forget();
+			}
 			s->st_mode = (s->st_mode & ~07777) | (mode & 07777);
 		}
 	}
@@ -149,6 +152,9 @@ setattr(char *path, sattr * attr, struct stat * s,
 			if (lchown(path, uid, gid) < 0) {
 				return nfs_errno();
 			}
+			if (S_ISDIR(s->st_mode)) {
+				fh_perm_forget();
+			}
 			if (uid != (uid_t) - 1) {
 				s->st_uid = uid;
 			}
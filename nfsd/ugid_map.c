@@ -23,6 +23,8 @@
 #include "xmalloc.h"
 #include "nfsd.h"
 #include "ugid.h"
+#include "stats.h"
+#include "probes.h"
 
 #if defined(__CYGWIN__)
 #define BITSPERBYTE 8
@@ -200,7 +202,13 @@ ugid_find(nfs_mount * mountp,
 	/* Dynamic mapping flavors */
 	ent = ugid_get_entry(umap->map[how], id, 1);
 	if (ent->id == AUTH_UID_NONE) {
+		unsigned long long t = TRACE_BEGIN();
+
+		stats_inc(ugid_lookups);
+		PROBE2(ugid_lookup_start, how, id);
 		rlookup(mountp, rqstp, how, id, ent);
+		PROBE3(ugid_lookup_done, how, id, ent->id);
+		TRACE_END("ugid_lookup", t);
 		if (ent->id == AUTH_UID_NONE) {
 			ent->id = anonid;
 		} else {
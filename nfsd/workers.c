@@ -0,0 +1,496 @@
+/*
+ * workers.c
+ *
+ * Worker thread pool for nfsd. The main thread keeps running rpc_run()
+ * and acts as the receiver: nfs_dispatch decodes every UDP call and
+ * queues it here, and one of the workers executes it and sends the
+ * reply.
+ *
+ * The server state (fh cache, export lists, uid maps, ...) was never
+ * meant to be shared, so it is protected by a single lock that a
+ * worker holds while it executes a call. The lock is dropped only
+ * around the file I/O of READ and WRITE (see nfsd_io_begin), which is
+ * where the server waits for the disk. A worker that picks up a WRITE
+ * also takes the queued WRITEs that continue it, and writes all of
+ * them with a single system call. For exports with the sync option,
+ * it first waits a little for more of them to arrive (write gathering),
+ * so that they also share the fdatasync.
+ *
+ * Signals are delivered to the receiver only. Cache flushes, exports
+ * reloads and statistics dumps requested by a signal are carried out
+ * by a housekeeping thread once no worker is doing I/O.
+ *
+ * This software may be used for any purpose provided
+ * the above copyright notice is retained.  It is supplied
+ * as is, with no warranty expressed or implied.
+ */
+
+#include "nfsd.h"
+#include "xmalloc.h"
+
+#ifdef ENABLE_WORKER_THREADS
+
+#include <pthread.h>
+
+#define QUEUE_PER_WORKER	16	/* max queued calls per worker */
+#define WRITE_GATHER_DELAY	5000	/* max usec to wait for more WRITEs */
+#define HOUSEKEEPING_INTERVAL	1	/* seconds */
+
+int nfsd_nworkers = 0;
+
+static pthread_mutex_t	nfsd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	io_drained = PTHREAD_COND_INITIALIZER;
+static int		io_draining = 0;
+static THREAD_LOCAL int	io_unlocked = 0;
+
+static pthread_mutex_t	queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	queue_nonempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	queue_nonfull = PTHREAD_COND_INITIALIZER;
+static nfs_request *	queue_head = NULL;
+static nfs_request *	queue_tail = NULL;
+static nfs_request *	free_list = NULL;
+static int		queue_len = 0;
+static int		queue_max = 0;
+
+static pthread_cond_t	gather_more = PTHREAD_COND_INITIALIZER;
+static nfs_request *	gather_list = NULL;	/* in nfsd_write_gather */
+static long		gather_delay = WRITE_GATHER_DELAY;
+
+static void		nfsd_request_batch(nfs_request *req);
+static int		nfsd_request_join(nfs_request *req);
+static void *		nfsd_worker(void *arg);
+static void *		nfsd_housekeeper(void *arg);
+
+void
+nfsd_lock(void)
+{
+	pthread_mutex_lock(&nfsd_mutex);
+}
+
+void
+nfsd_unlock(void)
+{
+	pthread_mutex_unlock(&nfsd_mutex);
+}
+
+/*
+ * Drop the nfsd lock around a blocking system call. Between
+ * nfsd_io_begin and nfsd_io_end the caller must not touch any shared
+ * state, and it has to look up its fh cache entry again afterwards.
+ * The fd itself stays valid until fd_inactive.
+ *
+ * _rpcsvcdirty counts the threads doing I/O, which holds off cache
+ * flushes and exports reloads.
+ */
+void
+nfsd_io_begin(void)
+{
+	if (nfsd_nworkers == 0 || io_draining)
+		return;
+	_rpcsvcdirty++;
+	io_unlocked = 1;
+	pthread_mutex_unlock(&nfsd_mutex);
+}
+
+void
+nfsd_io_end(void)
+{
+	if (!io_unlocked)
+		return;
+	pthread_mutex_lock(&nfsd_mutex);
+	io_unlocked = 0;
+	if (--_rpcsvcdirty == 0 && io_draining)
+		pthread_cond_signal(&io_drained);
+}
+
+/*
+ * Take a copy of a call so that it can be processed by a worker.
+ * Returns NULL if the call has to be processed right away.
+ */
+nfs_request *
+nfsd_request_alloc(struct svc_req *rqstp, SVCXPRT *transp)
+{
+	struct authunix_parms *aup;
+	nfs_request *req;
+
+	if ((rqstp->rq_cred.oa_flavor != AUTH_UNIX
+	     && rqstp->rq_cred.oa_flavor != AUTH_NULL)
+	    || rqstp->rq_cred.oa_length > MAX_AUTH_BYTES)
+		return NULL;
+
+	pthread_mutex_lock(&queue_mutex);
+	if ((req = free_list) != NULL)
+		free_list = req->next;
+	pthread_mutex_unlock(&queue_mutex);
+	if (req == NULL)
+		req = (nfs_request *) xmalloc(sizeof(*req));
+
+	if (!svcdgram_defer(transp, &req->reply)) {
+		nfsd_request_free(req);
+		return NULL;
+	}
+
+	req->xprt = *transp;
+	req->rqst = *rqstp;
+	req->rqst.rq_xprt = &req->xprt;
+	req->rqst.rq_cred.oa_base = req->credbody;
+	memcpy(req->credbody, rqstp->rq_cred.oa_base,
+	       rqstp->rq_cred.oa_length);
+
+	if (rqstp->rq_cred.oa_flavor == AUTH_UNIX) {
+		aup = (struct authunix_parms *) rqstp->rq_clntcred;
+		req->aup = *aup;
+		strncpy(req->machname, aup->aup_machname, MAX_MACHINE_NAME);
+		req->machname[MAX_MACHINE_NAME] = '\0';
+		req->aup.aup_machname = req->machname;
+		if (req->aup.aup_len > NGRPS)
+			req->aup.aup_len = NGRPS;
+		memcpy(req->gids, aup->aup_gids,
+		       req->aup.aup_len * sizeof(gid_t));
+		req->aup.aup_gids = req->gids;
+		req->rqst.rq_clntcred = (caddr_t) &req->aup;
+	}
+
+	return req;
+}
+
+void
+nfsd_request_free(nfs_request *req)
+{
+	pthread_mutex_lock(&queue_mutex);
+	req->next = free_list;
+	free_list = req;
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+/*
+ * Queue a call for the workers. If they're falling behind, the
+ * receiver waits here and the socket buffer absorbs the load.
+ */
+void
+nfsd_request_queue(nfs_request *req)
+{
+	req->next = NULL;
+
+	pthread_mutex_lock(&queue_mutex);
+	while (queue_len >= queue_max)
+		pthread_cond_wait(&queue_nonfull, &queue_mutex);
+	if (queue_tail != NULL)
+		queue_tail->next = req;
+	else
+		queue_head = req;
+	queue_tail = req;
+	queue_len++;
+	pthread_cond_signal(&queue_nonempty);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+static nfs_request *
+nfsd_request_dequeue(void)
+{
+	nfs_request *req;
+
+	pthread_mutex_lock(&queue_mutex);
+	for (;;) {
+		while ((req = queue_head) == NULL)
+			pthread_cond_wait(&queue_nonempty, &queue_mutex);
+		if ((queue_head = req->next) == NULL)
+			queue_tail = NULL;
+		if (queue_len-- == queue_max)
+			pthread_cond_signal(&queue_nonfull);
+		req->batch = NULL;
+		req->status = NFS_OK;
+		if (req->rqst.rq_proc != NFSPROC_WRITE)
+			break;
+		/* WRITEs that continue a gathering batch join it */
+		if (!nfsd_request_join(req)) {
+			nfsd_request_batch(req);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&queue_mutex);
+
+	return req;
+}
+
+/*
+ * Check whether WRITE next can be done along with WRITE req, i.e.
+ * comes from the same user on the same client address and port, and is
+ * for the same file. Only req is checked for access, which may depend
+ * on the port (see the secure export option).
+ */
+static int
+nfsd_request_same(nfs_request *req, nfs_request *next)
+{
+	if (next->rqst.rq_proc != NFSPROC_WRITE
+	    || next->rqst.rq_cred.oa_flavor != req->rqst.rq_cred.oa_flavor
+	    || next->reply.rd_addr.sin_family != req->reply.rd_addr.sin_family
+	    || next->reply.rd_addr.sin_port != req->reply.rd_addr.sin_port
+	    || next->reply.rd_addr.sin_addr.s_addr
+	       != req->reply.rd_addr.sin_addr.s_addr
+	    || memcmp(&next->argument.nfsproc_write_2_arg.file,
+		      &req->argument.nfsproc_write_2_arg.file,
+		      sizeof(nfs_fh)) != 0)
+		return 0;
+	if (req->rqst.rq_cred.oa_flavor != AUTH_UNIX)
+		return 1;
+	return next->aup.aup_uid == req->aup.aup_uid
+	    && next->aup.aup_gid == req->aup.aup_gid
+	    && next->aup.aup_len == req->aup.aup_len
+	    && memcmp(next->gids, req->gids,
+		      req->aup.aup_len * sizeof(gid_t)) == 0;
+}
+
+/*
+ * Add WRITE next to the batch of req if it starts where the batch ends
+ * and there's room for it. Called with the queue locked.
+ */
+static int
+nfsd_request_append(nfs_request *req, nfs_request *next)
+{
+	nfs_request *last;
+	writeargs *wa;
+	u_int offset;
+	int n;
+
+	wa = &next->argument.nfsproc_write_2_arg;
+	if (wa->data.data_len > NFS_MAXDATA || !nfsd_request_same(req, next))
+		return 0;
+
+	n = 1;
+	for (last = req; last->batch != NULL; last = last->batch)
+		n++;
+	offset = last->argument.nfsproc_write_2_arg.offset
+		+ last->argument.nfsproc_write_2_arg.data.data_len;
+	if (n >= WRITE_BATCH_MAX || wa->offset != offset
+	    || offset + wa->data.data_len < offset)
+		return 0;
+
+	next->batch = NULL;
+	next->status = NFS_OK;
+	last->batch = next;
+	return 1;
+}
+
+/*
+ * Take the queued WRITEs that continue where req leaves off and chain
+ * them to req->batch, so that all of them are done with one system
+ * call. Called with the queue locked.
+ */
+static void
+nfsd_request_batch(nfs_request *req)
+{
+	nfs_request **pp, *next, *prev;
+
+	prev = NULL;
+	pp = &queue_head;
+	while ((next = *pp) != NULL) {
+		if (!nfsd_request_append(req, next)) {
+			prev = next;
+			pp = &next->next;
+			continue;
+		}
+		if ((*pp = next->next) == NULL)
+			queue_tail = prev;
+		if (queue_len-- == queue_max)
+			pthread_cond_signal(&queue_nonfull);
+	}
+}
+
+/*
+ * Add a WRITE to the batch of a worker waiting in nfsd_write_gather,
+ * if it continues one. Called with the queue locked.
+ */
+static int
+nfsd_request_join(nfs_request *next)
+{
+	nfs_request *req;
+
+	for (req = gather_list; req != NULL; req = req->gather_next) {
+		if (nfsd_request_append(req, next)) {
+			pthread_cond_broadcast(&gather_more);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Hold on to WRITE req for a little while, so that the WRITEs that
+ * continue it can be written, and committed, along with it. Each WRITE
+ * that joins the batch restarts the wait. Called by the worker that
+ * executes req, after nfsd_io_begin.
+ *
+ * Waiting only pays off if it takes less than the commits it saves, so
+ * we never wait longer than an fdatasync takes on average. A client
+ * that has no more WRITEs in flight costs us at most one extra commit
+ * time that way.
+ *
+ * If nfsd_io_begin couldn't let go of the nfsd lock because the
+ * housekeeping thread is waiting for I/O to drain, req only takes the
+ * WRITEs already queued: waiting would hold up everybody else.
+ */
+void
+nfsd_write_gather(nfs_request *req)
+{
+	nfs_request **pp;
+	struct timeval now;
+	struct timespec deadline;
+	nfs_request *last;
+	int n, m;
+
+	pthread_mutex_lock(&queue_mutex);
+	nfsd_request_batch(req);
+	if (!io_unlocked) {
+		pthread_mutex_unlock(&queue_mutex);
+		return;
+	}
+	req->gather_next = gather_list;
+	gather_list = req;
+
+	n = 0;
+	for (;;) {
+		m = 1;
+		for (last = req; last->batch != NULL; last = last->batch)
+			m++;
+		if (m >= WRITE_BATCH_MAX)
+			break;
+		if (m != n) {
+			gettimeofday(&now, NULL);
+			now.tv_usec += gather_delay;
+			deadline.tv_sec = now.tv_sec + now.tv_usec / 1000000;
+			deadline.tv_nsec = (now.tv_usec % 1000000) * 1000;
+			n = m;
+		}
+		if (pthread_cond_timedwait(&gather_more, &queue_mutex,
+					   &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	for (pp = &gather_list; *pp != req; pp = &(*pp)->gather_next)
+		;
+	*pp = req->gather_next;
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+/*
+ * Record how long an fdatasync of gathered WRITEs took.
+ */
+void
+nfsd_write_committed(long usec)
+{
+	pthread_mutex_lock(&queue_mutex);
+	gather_delay = (7 * gather_delay + usec) / 8;
+	if (gather_delay > WRITE_GATHER_DELAY)
+		gather_delay = WRITE_GATHER_DELAY;
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+static void *
+nfsd_worker(void *arg)
+{
+	nfs_request *req;
+
+	for (;;) {
+		req = nfsd_request_dequeue();
+		nfs_dispatch_request(req);
+		nfsd_request_free(req);
+	}
+
+	return NULL;
+}
+
+/*
+ * Do the work deferred by the SIGALRM, SIGHUP and SIGUSR2 handlers.
+ * New I/O is done with the lock held until the pending flush is done.
+ */
+static void *
+nfsd_housekeeper(void *arg)
+{
+	for (;;) {
+		sleep(HOUSEKEEPING_INTERVAL);
+		if (!nfsd_need_reinit() && !fh_need_flush()
+		    && !nfs_need_dump())
+			continue;
+
+		pthread_mutex_lock(&nfsd_mutex);
+		io_draining = 1;
+		while (_rpcsvcdirty)
+			pthread_cond_wait(&io_drained, &nfsd_mutex);
+		if (nfsd_need_reinit())
+			nfsd_reinitialize(0);
+		if (fh_need_flush())
+			fh_flush_cache(0);
+		if (nfs_need_dump())
+			dump_stats(0);
+		io_draining = 0;
+		pthread_mutex_unlock(&nfsd_mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start the worker threads. If none can be created, nfsd keeps
+ * processing all calls in the main thread.
+ */
+void
+nfsd_workers_start(int nworkers)
+{
+	sigset_t mask, omask;
+	pthread_t tid;
+	int i, err;
+
+	if (nworkers <= 0)
+		return;
+
+	/* The threads inherit our signal mask. Keep asynchronous
+	 * signals away from them. */
+	sigfillset(&mask);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+
+	nfsd_nworkers = nworkers;
+	queue_max = QUEUE_PER_WORKER * nworkers;
+	_rpcsvcthreaded = 1;
+
+	for (i = 0; i < nworkers; i++) {
+		if ((err = pthread_create(&tid, NULL, nfsd_worker, NULL)) != 0) {
+			dbg_printf(__FILE__, __LINE__, L_ERROR,
+				   "cannot create worker thread: %s\n",
+				   strerror(err));
+			break;
+		}
+		pthread_detach(tid);
+	}
+
+	if (i > 0) {
+		if ((err = pthread_create(&tid, NULL, nfsd_housekeeper,
+					  NULL)) != 0) {
+			dbg_printf(__FILE__, __LINE__, L_FATAL,
+				   "cannot create housekeeping thread: %s\n",
+				   strerror(err));
+		}
+		pthread_detach(tid);
+	}
+
+	if (i < nworkers) {
+		/* Workers already running only ever look at their queue */
+		pthread_mutex_lock(&queue_mutex);
+		nfsd_nworkers = i;
+		queue_max = QUEUE_PER_WORKER * (i ? i : 1);
+		pthread_mutex_unlock(&queue_mutex);
+		if (i == 0)
+			_rpcsvcthreaded = 0;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+	dbg_printf(__FILE__, __LINE__, D_GENERAL,
+		   "started %d worker threads\n", nfsd_nworkers);
+}
+
+#endif /* ENABLE_WORKER_THREADS */
@@ -13,6 +13,7 @@
 #include <rpc/pmap_clnt.h>
 #include <getopt.h>
 #include "logging.h"
+#include "rpcmisc.h"
 #include "haccess.h"
 #include "ugid_xdr.c"
 
@@ -74,7 +75,7 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
-	transp = svctcp_create(RPC_ANYSOCK, 0, 0);
+	transp = svcstream_create(RPC_ANYSOCK);
 	if (transp == NULL) {
 		fprintf(stderr, "cannot create tcp service.\n");
 		exit(1);
@@ -119,9 +120,9 @@ main(int argc, char **argv)
 
 	log_open("ugidd", foreground);
 
-	svc_run();
+	rpc_run();
 
-	dbg_printf(__FILE__, __LINE__, L_ERROR, "svc_run() returned\n");
+	dbg_printf(__FILE__, __LINE__, L_ERROR, "rpc_run() returned\n");
 
 	return 1;
 }
@@ -0,0 +1,244 @@
+/*
+ * fhindex.c -- rebuild the file handle index used by nfsd
+ *
+ * Walks the given directory trees, typically the exported file
+ * systems, and records every file in a new index, which then replaces
+ * the one nfsd is using. nfsd keeps the index up to date by itself,
+ * this is only needed to fill it before clients come back after a
+ * restart, or after a lot of files have been moved around behind
+ * nfsd's back.
+ *
+ * This software may be used for any purpose provided
+ * the above copyright notice is retained.  It is supplied
+ * as is, with no warranty expressed or implied.
+ */
+
+#include "system.h"
+#include "mount.h"
+#include "nfs_prot.h"
+#include "auth.h"
+#include "fhandle.h"
+#include "fhindex.h"
+#include "logging.h"
+#include <getopt.h>
+
+#ifdef ENABLE_FH_INDEX
+
+static int verbose = 0;
+static unsigned long nfiles = 0;
+
+static struct option longopts[] = {
+	{"file", 1, 0, 'f'},
+	{"verbose", 0, 0, 'v'},
+	{"help", 0, 0, 'h'},
+	{NULL, 0, 0, 0}
+};
+
+static void
+usage(FILE * fp, char *program_name, int n)
+{
+	fprintf(fp, "Usage: %s [-hv] [-f indexfile] directory ...\n",
+		program_name);
+	fprintf(fp, "       [--file indexfile] [--verbose] [--help]\n");
+	exit(n);
+}
+
+/*
+ * Index the contents of directory path, whose psi is dpsi, and that
+ * of its subdirectories. Files deeper than nfsd can build handles for
+ * are left out.
+ */
+static void
+index_tree(char *path, size_t len, psi_t dpsi, int depth)
+{
+	struct stat dsb, sb;
+	struct dirent *dp;
+	DIR *dir;
+	psi_t psi;
+	size_t n;
+
+	if (depth + 1 >= HP_LEN)
+		return;
+	if (lstat(path, &dsb) < 0 || (dir = opendir(path)) == NULL) {
+		fprintf(stderr, "fhindex: %s: %s\n", path, strerror(errno));
+		return;
+	}
+	while ((dp = readdir(dir)) != NULL) {
+		n = strlen(dp->d_name);
+		if (dp->d_name[0] == '.'
+		    && (n == 1 || (n == 2 && dp->d_name[1] == '.')))
+			continue;
+		if (len + n + 1 >= NFS_MAXPATHLEN)
+			continue;
+
+		/* Same as fh_buildpath does it */
+		psi = pseudo_inode(dp->d_ino, dsb.st_dev);
+		fhindex_add(psi, dpsi, dp->d_name);
+		nfiles++;
+
+		path[len] = '/';
+		strcpy(path + len + 1, dp->d_name);
+		if (lstat(path, &sb) >= 0 && S_ISDIR(sb.st_mode))
+			index_tree(path, len + n + 1, psi, depth + 1);
+	}
+	closedir(dir);
+}
+
+/*
+ * Index a directory and everything below it. The directories leading
+ * up to it from the root have to be in the index as well.
+ */
+static void
+index_dir(char *name)
+{
+	char path[NFS_MAXPATHLEN + NAME_MAX + 2];
+	char dirpath[NFS_MAXPATHLEN + NAME_MAX + 2];
+	struct stat sb;
+	struct dirent *dp;
+	char *comp, *next;
+	psi_t psi, dpsi;
+	int depth;
+	DIR *dir;
+
+	if (realpath(name, dirpath) == NULL) {
+		fprintf(stderr, "fhindex: %s: %s\n", name, strerror(errno));
+		return;
+	}
+	if (stat("/", &sb) < 0) {
+		fprintf(stderr, "fhindex: /: %s\n", strerror(errno));
+		return;
+	}
+	dpsi = pseudo_inode(sb.st_ino, sb.st_dev);
+
+	strcpy(path, "/");
+	depth = 0;
+	for (comp = dirpath + 1; *comp != '\0'; comp = next) {
+		if ((next = strchr(comp, '/')) != NULL)
+			*next++ = '\0';
+		else
+			next = comp + strlen(comp);
+
+		if (lstat(path, &sb) < 0 || (dir = opendir(path)) == NULL) {
+			fprintf(stderr, "fhindex: %s: %s\n", path,
+				strerror(errno));
+			return;
+		}
+		while ((dp = readdir(dir)) != NULL
+		       && strcmp(dp->d_name, comp) != 0);
+		if (dp == NULL) {
+			closedir(dir);
+			fprintf(stderr, "fhindex: %s not found in %s\n",
+				comp, path);
+			return;
+		}
+		psi = pseudo_inode(dp->d_ino, sb.st_dev);
+		closedir(dir);
+
+		fhindex_add(psi, dpsi, comp);
+		if (depth++ > 0)
+			strcat(path, "/");
+		strcat(path, comp);
+		dpsi = psi;
+	}
+
+	if (verbose)
+		printf("indexing %s\n", path);
+	index_tree(path, depth ? strlen(path) : 0, dpsi, depth);
+}
+
+/*
+ * pseudo_inode may have to update the devtab, which drags in
+ * auth_clnt. Same hack as in mountd.
+ */
+uid_t
+luid(uid_t uid, nfs_mount * mp, struct svc_req * rqstp)
+{
+	return -2;
+}
+
+gid_t
+lgid(gid_t gid, nfs_mount * mp, struct svc_req * rqstp)
+{
+	return -2;
+}
+
+void
+ugid_free_map(struct ugid_map *map)
+{
+	/* NOP */
+}
+
+void
+ugid_map_uid(nfs_mount * mp, uid_t from, uid_t to)
+{
+	/* NOP */
+}
+
+void
+ugid_map_gid(nfs_mount * mp, gid_t from, gid_t to)
+{
+	/* NOP */
+}
+
+void
+ugid_squash_uids(nfs_mount * mp, uid_t from, uid_t to)
+{
+	/* NOP */
+}
+
+void
+ugid_squash_gids(nfs_mount * mp, gid_t from, gid_t to)
+{
+	/* NOP */
+}
+
+int
+main(int argc, char **argv)
+{
+	char *program_name = argv[0];
+	char *indexfile = NULL;
+	int c;
+
+	log_open("fhindex", 1);
+
+	while ((c = getopt_long(argc, argv, "f:hv", longopts, NULL)) != EOF) {
+		switch (c) {
+		case 'f':
+			indexfile = optarg;
+			break;
+		case 'h':
+			usage(stdout, program_name, 0);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(stderr, program_name, 1);
+		}
+	}
+	if (optind == argc)
+		usage(stderr, program_name, 1);
+
+	if (fhindex_create(indexfile) < 0)
+		exit(1);
+	while (optind < argc)
+		index_dir(argv[optind++]);
+	if (fhindex_commit() < 0)
+		exit(1);
+
+	if (verbose)
+		printf("%lu files indexed\n", nfiles);
+	return 0;
+}
+
+#else /* ENABLE_FH_INDEX */
+
+int
+main(int argc, char **argv)
+{
+	fprintf(stderr, "%s: nfs-server was built without fh index support\n",
+		argv[0]);
+	return 1;
+}
+
+#endif /* ENABLE_FH_INDEX */
@@ -0,0 +1,228 @@
+/*
+ * nfsdstat.c -- show the cache statistics of the running servers
+ *
+ * Reads the statistics files nfsd and mountd keep in PATH_STATSDIR,
+ * and prints their counters, summed over the copies of each server
+ * unless asked for each process. Given an interval, it keeps polling
+ * and also prints how fast each counter went up since the last time.
+ *
+ * This software may be used for any purpose provided
+ * the above copyright notice is retained.  It is supplied
+ * as is, with no warranty expressed or implied.
+ */
+
+#include "system.h"
+#include "stats.h"
+#include <getopt.h>
+#include <signal.h>
+#include <stddef.h>
+
+#define MAX_SERVERS	64
+
+static struct stat_info {
+	const char *	name;
+	int		gauge;
+	const char *	descr;
+	size_t		offset;
+} stat_info[] = {
+#define STAT(name, gauge, descr) \
+	{ #name, gauge, descr, offsetof(nfs_stats_t, name) },
+	STATS_LIST
+#undef STAT
+};
+
+#define NSTATS	(sizeof(stat_info) / sizeof(stat_info[0]))
+
+static struct server {
+	char		name[40];
+	int		nprocs;
+	unsigned long	val[NSTATS];
+	unsigned long	prev[NSTATS];
+	int		has_prev;
+} servers[MAX_SERVERS];
+static int nservers = 0;
+
+static const char *statsdir = PATH_STATSDIR;
+static int per_process = 0;
+static unsigned int only_pid = 0;
+
+static struct option longopts[] = {
+	{"all", 0, 0, 'a'},
+	{"directory", 1, 0, 'd'},
+	{"pid", 1, 0, 'p'},
+	{"help", 0, 0, 'h'},
+	{NULL, 0, 0, 0}
+};
+
+static void
+usage(FILE * fp, char *program_name, int n)
+{
+	fprintf(fp, "Usage: %s [-ah] [-d directory] [-p pid] "
+		"[interval [count]]\n", program_name);
+	fprintf(fp, "       [--all] [--directory directory] [--pid pid] "
+		"[--help]\n");
+	exit(n);
+}
+
+static struct server *
+find_server(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nservers; i++) {
+		if (!strcmp(servers[i].name, name))
+			return &servers[i];
+	}
+	if (nservers == MAX_SERVERS)
+		return NULL;
+	strcpy(servers[nservers].name, name);
+	return &servers[nservers++];
+}
+
+/*
+ * Read one statistics file. Files left behind by a server that died
+ * are skipped.
+ */
+static void
+read_stats(const char *path)
+{
+	nfs_stats_t st;
+	struct server *sp;
+	char name[sizeof(servers[0].name)];
+	unsigned int i;
+	int fd, n;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return;
+	n = read(fd, &st, sizeof(st));
+	close(fd);
+	if (n != sizeof(st) || st.magic != STATS_MAGIC
+	    || st.version != STATS_VERSION)
+		return;
+	if (only_pid != 0 && st.pid != only_pid)
+		return;
+	if (kill((pid_t) st.pid, 0) < 0 && errno == ESRCH)
+		return;
+
+	st.progname[sizeof(st.progname) - 1] = '\0';
+	if (per_process)
+		sprintf(name, "%s[%u]", st.progname, st.pid);
+	else
+		sprintf(name, "%s", st.progname);
+	if ((sp = find_server(name)) == NULL)
+		return;
+	sp->nprocs++;
+	for (i = 0; i < NSTATS; i++)
+		sp->val[i] += *(unsigned long *) ((char *) &st
+						  + stat_info[i].offset);
+}
+
+static int
+poll_stats(void)
+{
+	struct dirent *dp;
+	char path[PATH_MAX];
+	size_t len, slen = strlen(STATS_SUFFIX);
+	DIR *dir;
+	int i;
+
+	for (i = 0; i < nservers; i++) {
+		servers[i].nprocs = 0;
+		memset(servers[i].val, 0, sizeof(servers[i].val));
+	}
+	if ((dir = opendir(statsdir)) == NULL) {
+		fprintf(stderr, "nfsdstat: %s: %s\n", statsdir,
+			strerror(errno));
+		return -1;
+	}
+	while ((dp = readdir(dir)) != NULL) {
+		len = strlen(dp->d_name);
+		if (len <= slen
+		    || strcmp(dp->d_name + len - slen, STATS_SUFFIX) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", statsdir, dp->d_name);
+		read_stats(path);
+	}
+	closedir(dir);
+	return 0;
+}
+
+static void
+print_stats(unsigned int interval)
+{
+	struct server *sp;
+	unsigned int i;
+	int found = 0;
+
+	for (sp = servers; sp < servers + nservers; sp++) {
+		if (sp->nprocs == 0) {
+			sp->has_prev = 0;
+			continue;
+		}
+		found = 1;
+		if (sp->nprocs > 1)
+			printf("%s (%d processes)\n", sp->name, sp->nprocs);
+		else
+			printf("%s\n", sp->name);
+		for (i = 0; i < NSTATS; i++) {
+			printf("  %-16s %12lu", stat_info[i].name, sp->val[i]);
+			if (sp->has_prev && !stat_info[i].gauge
+			    && sp->val[i] >= sp->prev[i])
+				printf(" %10.1f/s", (double) (sp->val[i]
+					- sp->prev[i]) / interval);
+			else
+				printf(" %12s", "");
+			printf("  %s\n", stat_info[i].descr);
+		}
+		memcpy(sp->prev, sp->val, sizeof(sp->prev));
+		sp->has_prev = 1;
+	}
+	if (!found)
+		printf("no servers found in %s\n", statsdir);
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *program_name = argv[0];
+	unsigned int interval = 0;
+	long count = -1;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "ad:hp:", longopts, NULL)) != EOF) {
+		switch (c) {
+		case 'a':
+			per_process = 1;
+			break;
+		case 'd':
+			statsdir = optarg;
+			break;
+		case 'h':
+			usage(stdout, program_name, 0);
+			break;
+		case 'p':
+			only_pid = (unsigned int) atoi(optarg);
+			break;
+		default:
+			usage(stderr, program_name, 1);
+		}
+	}
+	if (optind < argc && (interval = atoi(argv[optind++])) == 0)
+		usage(stderr, program_name, 1);
+	if (optind < argc && (count = atol(argv[optind++])) <= 0)
+		usage(stderr, program_name, 1);
+	if (optind < argc)
+		usage(stderr, program_name, 1);
+
+	for (;;) {
+		if (poll_stats() < 0)
+			exit(1);
+		print_stats(interval);
+		if (interval == 0 || (count > 0 && --count == 0))
+			break;
+		sleep(interval);
+		printf("\n");
+	}
+	return 0;
+}